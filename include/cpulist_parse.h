@@ -34,8 +34,8 @@ static inline int parse_cpu_list(const char *clist, cpu_set_t *set, size_t setsi
 						case '\0':
 							clist = endp2;
 							if (num2 >= (long)setsize * 8) return -1;
-							for (int i = num; i < num2; i++)
-								CPU_SET_S(num, setsize, set);
+							for (long i = num; i <= num2; i++)
+								CPU_SET_S(i, setsize, set);
 							continue;
 						default:
 							break;
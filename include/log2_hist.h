@@ -0,0 +1,69 @@
+/*
+ * Histogram of unsigned values in power of two buckets, cheap enough to update inline
+ * and fine enough to see the tail of a latency distribution.
+ *
+ * Copyright (c) 2024 David P. Reed. All rights reserved.
+ */
+
+#ifndef _LOG2_HIST_H_
+#define _LOG2_HIST_H_
+
+/* bucket 0 counts zeros, bucket i counts values in [2^(i-1), 2^i) */
+#define LOG2_HIST_BUCKETS 65
+
+struct log2_hist {
+	unsigned long samples;
+	unsigned long max;
+	unsigned long count[LOG2_HIST_BUCKETS];
+};
+
+static inline void log2_hist_init(struct log2_hist *hist)
+{
+	hist->samples = hist->max = 0;
+	for (int i = 0; i < LOG2_HIST_BUCKETS; i++)
+		hist->count[i] = 0;
+}
+
+static inline unsigned int log2_hist_bucket(unsigned long value)
+{
+	return value ? 64 - __builtin_clzl(value) : 0;
+}
+
+static inline void log2_hist_sample(struct log2_hist *hist, unsigned long value)
+{
+	hist->samples += 1;
+	hist->count[log2_hist_bucket(value)] += 1;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+/* add the counts of another histogram */
+static inline void log2_hist_add(struct log2_hist *hist, const struct log2_hist *other)
+{
+	hist->samples += other->samples;
+	if (other->max > hist->max)
+		hist->max = other->max;
+	for (int i = 0; i < LOG2_HIST_BUCKETS; i++)
+		hist->count[i] += other->count[i];
+}
+
+/*
+ * upper bound of the value at fraction p (0.0 to 1.0) of the samples, that is the largest
+ * value in its bucket, but never more than the largest sample.
+ */
+static inline unsigned long log2_hist_percentile(const struct log2_hist *hist, double p)
+{
+	unsigned long rank = p * hist->samples;
+	unsigned long seen = 0;
+
+	for (int i = 0; i < LOG2_HIST_BUCKETS; i++) {
+		seen += hist->count[i];
+		if (seen > rank || seen == hist->samples) {
+			unsigned long bound = i == 0 ? 0 : i == 64 ? ~0UL : (1UL << i) - 1;
+			return bound < hist->max ? bound : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+#endif
@@ -26,6 +26,8 @@
  * be used! This eliminates "false sharing" to a very large extent!
  * The simple log counts "lost" log events, and throws away the oldest, just by wrapping around. If lost events
  * are a problem, the simple log can be expanded by adding new rings for newer entries whenever the log becomes full.
+ * A ring's overflow policy can instead drop the newest entries, or take a new ring from a pool when full, and a
+ * low water hook can be called a little before the ring fills, so a consumer can extend it in time.
  * once such a log is full, it can be passed to some activity that may eventually merge it.
  * If a new log ring is not available (the system is out of memory), the log ring will be discarded.
  *
@@ -34,10 +36,15 @@
  * and allocating a new ring before the current ring is empty, if no entries are to be lost. This is
  * double-buffering of rings.
  *
- * A simple merging operation for logs is provided here that enumerates multiple logs in pstamp order.
+ * A simple merging operation for logs is provided in pstamp_merge.h that enumerates multiple logs in pstamp order.
+ * pstamp_ring_spans gives the entries of a ring as contiguous runs, for the batch consumers in pstamp_batch.h.
+ * pstamp_ring_snapshot copies a ring that is still being logged into, keeping only entries it can vouch for.
  */
 
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tsc_stuff.h"
 
 /* timestamp taken at an enumerated point on logical processor at a particular time instant */
 typedef struct pstamp {
@@ -54,17 +61,60 @@ typedef struct pstamp_log {
 typedef struct pstamp_ring {
 	struct pstamp_ring *next_ring;
 	unsigned int size;
-	unsigned int next;
-	unsigned int end;
+	unsigned int next;	/* index where the next entry will be logged, full (or wrapping) at size */
+	unsigned int limit;	/* pstamp_log takes its slow path when next reaches limit */
+	unsigned long seq;	/* entries logged, stored after each entry for concurrent readers */
 	bool inactive;	/* set when recording has moved to next ring */
-	unsigned long overflows;
+	unsigned char policy;	/* enum pstamp_overflow, what to do when full with no next ring */
+	unsigned long overflows;	/* entries dropped, pstamp_log_overflows adds the overwritten ones */
+	struct pstamp_pool *pool;	/* rings for PSTAMP_EXTEND */
+	unsigned int low_water;	/* free entries left when low_water_hook is called, 0 for never */
+	void (*low_water_hook)(struct pstamp_ring *pstamp_ring, void *arg);
+	void *low_water_arg;
 	pstamp_log_t ring[];
 } pstamp_ring_t;
 
+/* what a full ring with no next ring does with a new entry */
+enum pstamp_overflow {
+	PSTAMP_OVERWRITE,	/* overwrite the oldest entry */
+	PSTAMP_DROP,		/* drop the new entry */
+	PSTAMP_EXTEND,		/* extend the log with a ring from the pool, overwrite if the pool is empty */
+};
+
+/*
+ * how pstamp reads the TSC, a tsc_strategy from tsc_stuff.h. rdtscp gives the logical
+ * processor with the time, the other strategies take it from rdpid, which CPUs before Ice
+ * Lake and Zen 2 don't have (it traps, SIGILL), so a program built with one of them should
+ * check pstamp_tsc_strategy_supported before logging. rdpru reads MPERF, not the TSC, so
+ * it can't be used. (pstamp_rseq.h always uses rdtscp.)
+ */
+#ifndef PSTAMP_TSC_STRATEGY
+#define PSTAMP_TSC_STRATEGY TSC_RDTSCP
+#endif
+_Static_assert(PSTAMP_TSC_STRATEGY != TSC_RDPRU, "PSTAMP_TSC_STRATEGY can't be TSC_RDPRU, it reads MPERF, not the TSC");
+
+/* true if this CPU has the instructions pstamp is built to use */
+static inline bool pstamp_tsc_strategy_supported(void)
+{
+	if (!tsc_strategy_supported(PSTAMP_TSC_STRATEGY))
+		return false;
+	return PSTAMP_TSC_STRATEGY == TSC_RDTSCP || PSTAMP_TSC_STRATEGY == TSC_RDTSCP_LFENCE || tsc_rdpid_supported();
+}
+
 static inline void pstamp(int point, pstamp_t *pstamp)
 {
 	unsigned long d, a, c;
-	asm volatile("rdtscp;" : "=a"(a), "=d"(d), "=c"(c));
+
+	if (PSTAMP_TSC_STRATEGY == TSC_RDTSCP) {
+		asm volatile("rdtscp;" : "=a"(a), "=d"(d), "=c"(c));
+	} else if (PSTAMP_TSC_STRATEGY == TSC_RDTSCP_LFENCE) {
+		asm volatile("rdtscp; lfence" : "=a"(a), "=d"(d), "=c"(c) : : "memory");
+	} else {
+		a = tsc_read(PSTAMP_TSC_STRATEGY);
+		d = a >> 32;
+		a &= 0xffffffffUL;
+		c = tsc_rdpid();
+	}
 	pstamp->time = (d << 32) | a; 
 	pstamp->logical_processor = c;
 	pstamp->point = point;
@@ -84,8 +134,36 @@ static inline void pstamp_ring_init(pstamp_ring_t *pstamp_ring, int size)
 {
 	pstamp_ring->next_ring = NULL;
 	pstamp_ring->next = pstamp_ring->overflows = 0;
-	pstamp_ring->size = pstamp_ring->end = size;
+	pstamp_ring->seq = 0;
+	pstamp_ring->size = pstamp_ring->limit = size;
 	pstamp_ring->inactive = false;
+	pstamp_ring->policy = PSTAMP_OVERWRITE;
+	pstamp_ring->pool = NULL;
+	pstamp_ring->low_water = 0;
+	pstamp_ring->low_water_hook = NULL;
+	pstamp_ring->low_water_arg = NULL;
+}
+
+/* set the overflow policy of a ring, pool is only used by PSTAMP_EXTEND */
+static inline void pstamp_ring_policy(pstamp_ring_t *pstamp_ring, enum pstamp_overflow policy,
+				      struct pstamp_pool *pool)
+{
+	pstamp_ring->policy = policy;
+	pstamp_ring->pool = pool;
+}
+
+/*
+ * call hook (on the logging thread) when only low_water entries are left free in a ring,
+ * so a consumer can extend the log before it fills. Set it before logging to the ring.
+ */
+static inline void pstamp_ring_low_water(pstamp_ring_t *pstamp_ring, unsigned int low_water,
+					 void (*hook)(pstamp_ring_t *pstamp_ring, void *arg), void *arg)
+{
+	pstamp_ring->low_water = low_water;
+	pstamp_ring->low_water_hook = hook;
+	pstamp_ring->low_water_arg = arg;
+	if (hook != NULL && low_water > 0 && low_water < pstamp_ring->size)
+		pstamp_ring->limit = pstamp_ring->size - low_water;
 }
 
 /* avoid ring modulo division cost by comparing with n with size and wrapping to zero */
@@ -94,25 +172,98 @@ static inline unsigned int _wrap(unsigned int n, unsigned int size)
 	return n < size? n : 0;
 }
 
-/* log, and perhaps change the pointer to the ring */
-static inline pstamp_ring_t *pstamp_log(pstamp_ring_t *pstamp_ring, int point, const pstamp_t *cause)
+/*
+ * A pool of preallocated rings of the same size, so that logs can be extended without
+ * allocating memory. Rings are taken from the pool once per ring, not per entry, so a
+ * simple spin lock is enough to let any thread get and put rings.
+ */
+typedef struct pstamp_pool {
+	unsigned int size;		/* entries per ring */
+	unsigned int count;		/* rings in the pool now */
+	unsigned int capacity;
+	bool lock;
+	void *memory;			/* the rings, if allocated by pstamp_pool_init */
+	pstamp_ring_t **rings;
+} pstamp_pool_t;
+
+/* rings in a pool start on cache line boundaries, so neighbours don't share a line */
+#define pstamp_pool_stride(size) ((pstamp_ring_size(size) + 63) & ~(size_t)63)
+
+static inline void _pstamp_pool_lock(pstamp_pool_t *pool)
 {
-	/* if  full ring */
-	if (pstamp_ring->next == pstamp_ring->end) {
-		/* if no next ring, overwrite, else move to next ring */
-		if (pstamp_ring->next_ring == NULL)
-			pstamp_ring->end = pstamp_ring->next = _wrap(pstamp_ring->next + 1, pstamp_ring->size);
-		else {
-			pstamp_ring-> inactive = true;
-			pstamp_ring = pstamp_ring->next_ring;
-		}
+	while (__atomic_test_and_set(&pool->lock, __ATOMIC_ACQUIRE))
+		asm volatile("pause;");
+}
+
+static inline void _pstamp_pool_unlock(pstamp_pool_t *pool)
+{
+	__atomic_clear(&pool->lock, __ATOMIC_RELEASE);
+}
+
+/*
+ * make a pool of count rings of size entries each in memory provided by the caller, which
+ * must be 64 byte aligned and pstamp_pool_stride(size) * count bytes. The memory is not
+ * freed by pstamp_pool_destroy. Returns 0 if ok, -1 if out of memory.
+ */
+static inline int pstamp_pool_init_memory(pstamp_pool_t *pool, void *memory, unsigned int count, unsigned int size)
+{
+	size_t stride = pstamp_pool_stride(size);
+
+	pool->rings = malloc(sizeof(pstamp_ring_t *) * count);
+	if (pool->rings == NULL) return -1;
+	pool->memory = NULL;
+	pool->size = size;
+	pool->count = pool->capacity = count;
+	pool->lock = false;
+	for (unsigned int i = 0; i < count; i++)
+		pool->rings[i] = (pstamp_ring_t *)((char *)memory + stride * i);
+	return 0;
+}
+
+/* allocate a pool of count rings of size entries each, returns 0 if ok, -1 if out of memory */
+static inline int pstamp_pool_init(pstamp_pool_t *pool, unsigned int count, unsigned int size)
+{
+	void *memory;
+
+	if (posix_memalign(&memory, 64, pstamp_pool_stride(size) * count) != 0)
+		return -1;
+	if (pstamp_pool_init_memory(pool, memory, count, size) != 0) {
+		free(memory);
+		return -1;
 	}
-	pstamp_ring->next = _wrap(pstamp_ring->next + 1, pstamp_ring->size);
-	log_pstamp(point, cause, pstamp_ring->ring + pstamp_ring->next);
-	/* return current (may be next) ring */
+	pool->memory = memory;
+	return 0;
+}
+
+/* free the pool memory, all rings must have been returned */
+static inline void pstamp_pool_destroy(pstamp_pool_t *pool)
+{
+	free(pool->memory);
+	free(pool->rings);
+}
+
+/* take an initialized ring from the pool, NULL if the pool is empty */
+static inline pstamp_ring_t *pstamp_pool_get(pstamp_pool_t *pool)
+{
+	pstamp_ring_t *pstamp_ring = NULL;
+
+	_pstamp_pool_lock(pool);
+	if (pool->count > 0)
+		pstamp_ring = pool->rings[--pool->count];
+	_pstamp_pool_unlock(pool);
+	if (pstamp_ring != NULL)
+		pstamp_ring_init(pstamp_ring, pool->size);
 	return pstamp_ring;
 }
 
+/* return a ring to the pool once its entries have been consumed */
+static inline void pstamp_pool_put(pstamp_pool_t *pool, pstamp_ring_t *pstamp_ring)
+{
+	_pstamp_pool_lock(pool);
+	pool->rings[pool->count++] = pstamp_ring;
+	_pstamp_pool_unlock(pool);
+}
+
 /*
  * add an extra ring to a pstamp ring before it overflows, returns true if extended,
  * false if already extended.
@@ -121,14 +272,92 @@ static inline pstamp_ring_t *pstamp_log(pstamp_ring_t *pstamp_ring, int point, c
  */
 static inline bool pstamp_log_extend(pstamp_ring_t *pstamp_ring, pstamp_ring_t *next_ring)
 {
+	pstamp_ring_t *none = NULL;
 	bool ok = false;
-	if (!pstamp_ring->inactive && pstamp_ring->next_ring == NULL) {
-	    pstamp_ring->next_ring = next_ring;
-	    ok = true;
-	}
+	if (!pstamp_ring->inactive)
+	    /* the logging thread may extend from its pool at the same time */
+	    ok = __atomic_compare_exchange_n(&pstamp_ring->next_ring, &none, next_ring, false,
+					     __ATOMIC_RELEASE, __ATOMIC_RELAXED);
 	return ok;
 }
 
+/*
+ * Full ring or low water mark, returns the ring to log into, or NULL if the entry is dropped.
+ * Rare, so kept out of line to keep pstamp_log small.
+ */
+static __attribute__((__noinline__, __unused__)) pstamp_ring_t *_pstamp_log_slow(pstamp_ring_t *pstamp_ring)
+{
+	pstamp_ring_t *next_ring;
+
+	if (pstamp_ring->next != pstamp_ring->size) {
+		/* low water mark, not full yet */
+		pstamp_ring->limit = pstamp_ring->size;
+		pstamp_ring->low_water_hook(pstamp_ring, pstamp_ring->low_water_arg);
+		return pstamp_ring;
+	}
+	next_ring = __atomic_load_n(&pstamp_ring->next_ring, __ATOMIC_ACQUIRE);
+	if (next_ring == NULL && pstamp_ring->policy == PSTAMP_EXTEND && pstamp_ring->pool != NULL) {
+		pstamp_ring_t *new_ring = pstamp_pool_get(pstamp_ring->pool);
+		if (new_ring != NULL && !pstamp_log_extend(pstamp_ring, new_ring)) {
+			/* a consumer extended the log meanwhile */
+			pstamp_pool_put(pstamp_ring->pool, new_ring);
+		}
+		next_ring = __atomic_load_n(&pstamp_ring->next_ring, __ATOMIC_ACQUIRE);
+	}
+	if (next_ring != NULL) {
+		/* the log carries on in next ring, with the same policy and low water mark */
+		pstamp_ring_policy(next_ring, pstamp_ring->policy, pstamp_ring->pool);
+		pstamp_ring_low_water(next_ring, pstamp_ring->low_water, pstamp_ring->low_water_hook,
+				      pstamp_ring->low_water_arg);
+		/* release: a consumer that sees inactive also sees every entry */
+		__atomic_store_n(&pstamp_ring->inactive, true, __ATOMIC_RELEASE);
+		return next_ring;
+	}
+	if (pstamp_ring->policy == PSTAMP_DROP) {
+		pstamp_ring->overflows += 1;
+		return NULL;
+	}
+	/*
+	 * overwrite from the oldest entry, a whole lap on the fast path. seq says how many
+	 * entries have been overwritten, so nothing is counted here.
+	 */
+	pstamp_ring->next = 0;
+	pstamp_ring->limit = pstamp_ring->size;
+	return pstamp_ring;
+}
+
+/*
+ * log an entry into *pstamp_ringp, which is changed to the ring logged into (it may be the
+ * next ring). Returns the entry written, or NULL if it was dropped.
+ */
+static inline pstamp_log_t *_pstamp_log_entry(pstamp_ring_t **pstamp_ringp, int point, const pstamp_t *cause)
+{
+	pstamp_ring_t *current = *pstamp_ringp;
+	pstamp_log_t *entry;
+
+	/* if full ring (or low water) move to next ring, overwrite or drop as the policy says */
+	if (current->next == current->limit) {
+		current = _pstamp_log_slow(current);
+		if (current == NULL)
+			return NULL;
+		*pstamp_ringp = current;
+	}
+	entry = current->ring + current->next;
+	log_pstamp(point, cause, entry);
+	current->next += 1;
+	/* release is only ordering of the stores here, no fence on x86 */
+	__atomic_store_n(&current->seq, current->seq + 1, __ATOMIC_RELEASE);
+	return entry;
+}
+
+/* log, and perhaps change the pointer to the ring */
+static inline pstamp_ring_t *pstamp_log(pstamp_ring_t *pstamp_ring, int point, const pstamp_t *cause)
+{
+	_pstamp_log_entry(&pstamp_ring, point, cause);
+	/* return current (may be next) ring */
+	return pstamp_ring;
+}
+
 /*
  * calls that can observe the pstamp_log while it is in use or inactive.
  */
@@ -136,12 +365,121 @@ static inline bool pstamp_log_extend(pstamp_ring_t *pstamp_ring, pstamp_ring_t *
 /* capture the number of overflows that have happened in this part of the log so far */
 static inline unsigned long pstamp_log_overflows(pstamp_ring_t *pstamp_ring)
 {
-	return pstamp_ring->overflows;
+	unsigned long seq = __atomic_load_n(&pstamp_ring->seq, __ATOMIC_ACQUIRE);
+
+	/* only overwriting logs more than size entries into a ring */
+	return pstamp_ring->overflows + (seq > pstamp_ring->size ? seq - pstamp_ring->size : 0);
+}
+
+/* entries lost in the whole log, the chain of rings starting with this one */
+static inline unsigned long pstamp_log_lost(pstamp_ring_t *pstamp_ring)
+{
+	unsigned long lost = 0;
+
+	for (; pstamp_ring != NULL; pstamp_ring = pstamp_ring->next_ring)
+		lost += pstamp_log_overflows(pstamp_ring);
+	return lost;
 }
 
 static inline bool pstamp_log_extended(pstamp_ring_t *pstamp_ring)
 {
-	return pstamp_ring->next_ring != NULL;
+	/* a drain thread may be extending the log */
+	return __atomic_load_n(&pstamp_ring->next_ring, __ATOMIC_ACQUIRE) != NULL;
+}
+
+/* true once recording has moved to next_ring, all entries of this ring may then be read */
+static inline bool pstamp_log_inactive(pstamp_ring_t *pstamp_ring)
+{
+	return __atomic_load_n(&pstamp_ring->inactive, __ATOMIC_ACQUIRE);
+}
+
+/* index of the oldest entry in the ring, entries are in order from there, wrapping at size */
+static inline unsigned int pstamp_ring_first(const pstamp_ring_t *pstamp_ring)
+{
+	/* once full, the oldest entry is the next one to be overwritten */
+	if (__atomic_load_n(&pstamp_ring->seq, __ATOMIC_ACQUIRE) < pstamp_ring->size)
+		return 0;
+	return _wrap(pstamp_ring->next, pstamp_ring->size);
+}
+
+/* number of entries in the ring, once the ring has wrapped it is always full */
+static inline unsigned int pstamp_ring_count(const pstamp_ring_t *pstamp_ring)
+{
+	unsigned long seq = __atomic_load_n(&pstamp_ring->seq, __ATOMIC_ACQUIRE);
+	return seq < pstamp_ring->size ? seq : pstamp_ring->size;
+}
+
+/* a contiguous run of entries, oldest first */
+struct pstamp_span {
+	pstamp_log_t *entries;
+	unsigned int count;
+};
+
+/*
+ * the entries of the ring as at most two contiguous spans, the part from the oldest entry
+ * up to the end of the ring, then the part from the start of the ring after it wraps.
+ * Returns the number of spans filled in, 0 for an empty ring. The same rules as
+ * pstamp_log_enumerate apply to a ring that is still being logged into.
+ */
+static inline unsigned int pstamp_ring_spans(pstamp_ring_t *pstamp_ring, struct pstamp_span span[2])
+{
+	/* snapshot the ring pointers */
+	unsigned int size = pstamp_ring->size;
+	unsigned int count = pstamp_ring_count(pstamp_ring);
+	unsigned int first = pstamp_ring_first(pstamp_ring);
+
+	if (count == 0)
+		return 0;
+	span[0].entries = pstamp_ring->ring + first;
+	if (first + count <= size) {
+		span[0].count = count;
+		return 1;
+	}
+	span[0].count = size - first;
+	span[1].entries = pstamp_ring->ring;
+	span[1].count = first + count - size;
+	return 2;
+}
+
+/*
+ * copy the entries of a ring that may be being logged into, by a reader on another core,
+ * into buffer (room for the ring's size entries). span is set to the entries copied intact,
+ * oldest first, and the sequence number (count of entries logged to the ring before it)
+ * of the first is returned, so successive snapshots can tell new entries from old.
+ *
+ * Logical entry k of a ring is always at k modulo size, and seq counts the entries logged.
+ * The reader reads seq, copies the entries before it, and reads seq again. The logger
+ * stores seq after writing each entry (in order, without a fence, on x86), so every entry
+ * before the first seq had been written. By the time of the second read the logger may
+ * have gone on to overwrite the entries up to seq - size (one of them maybe while it was
+ * being copied), so those are dropped. A snapshot can come out empty if the logger laps
+ * the ring during the copy, a reason to keep rings read live well above the rate of
+ * logging times the copy time. A DROP ring that is full, or an inactive ring, is stable.
+ */
+static inline unsigned long pstamp_ring_snapshot(pstamp_ring_t *pstamp_ring, pstamp_log_t *buffer,
+						 struct pstamp_span *span)
+{
+	unsigned int size = pstamp_ring->size;
+	unsigned long seq = __atomic_load_n(&pstamp_ring->seq, __ATOMIC_ACQUIRE);
+	unsigned int count = seq < size ? seq : size;
+	unsigned long oldest = seq - count;
+	unsigned int first = oldest % size;
+	unsigned int part = count < size - first ? count : size - first;
+	unsigned long after, torn;
+
+	memcpy(buffer, pstamp_ring->ring + first, sizeof(pstamp_log_t) * part);
+	memcpy(buffer + part, pstamp_ring->ring, sizeof(pstamp_log_t) * (count - part));
+	/* the copies are done before seq is read again */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	after = __atomic_load_n(&pstamp_ring->seq, __ATOMIC_RELAXED);
+	/* entries up to after - size may have been overwritten */
+	torn = after >= size ? after - size + 1 : 0;
+	torn = torn > oldest ? torn - oldest : 0;
+	if (torn > count)
+		torn = count;
+	span->entries = buffer + torn;
+	span->count = count - torn;
+	return oldest + torn;
 }
 
 /*
@@ -149,21 +487,34 @@ static inline bool pstamp_log_extended(pstamp_ring_t *pstamp_ring)
  * If log is concurrently updated, overflows may overwrite log entries, but
  * at most size entries will be enumerated.
  * to avoid interference due to overwriting, only enumerate log if it has been extended or
- * is inactive. 
+ * is inactive, or enumerate a pstamp_ring_snapshot of it.
  */
 static inline void pstamp_log_enumerate(pstamp_ring_t *pstamp_ring, void (*callback)(pstamp_log_t *pstamp_log))
 {
-	/* snapshot the ring pointers */
-	int size = pstamp_ring->size;
-	int last = pstamp_ring->next;
-	int start = _wrap(pstamp_ring->end + 1, size);
-	
-	for (int i = start;
-	     i != last;
-	     i = _wrap(i + 1, size)) {
-		callback(pstamp_ring->ring + i);
-	}
+	struct pstamp_span span[2];
+	unsigned int spans = pstamp_ring_spans(pstamp_ring, span);
+
+	for (unsigned int s = 0; s < spans; s++)
+		for (unsigned int i = 0; i < span[s].count; i++)
+			callback(span[s].entries + i);
 }
 
+/*
+ * enumerate the whole log, the chain of rings starting with this one, a span at a time.
+ * One call per run of entries rather than per entry, so the callback can work through
+ * them in a tight loop (see pstamp_batch.h).
+ */
+static inline void pstamp_log_enumerate_spans(pstamp_ring_t *pstamp_ring,
+					      void (*callback)(const struct pstamp_span *span, void *arg),
+					      void *arg)
+{
+	struct pstamp_span span[2];
+
+	for (; pstamp_ring != NULL; pstamp_ring = pstamp_ring->next_ring) {
+		unsigned int spans = pstamp_ring_spans(pstamp_ring, span);
+		for (unsigned int s = 0; s < spans; s++)
+			callback(span + s, arg);
+	}
+}
 
 #endif
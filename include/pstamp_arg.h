@@ -0,0 +1,205 @@
+/*
+ * pstamp log entries carrying one or two 64 bit arguments.
+ *
+ * Copyright (c) 2024 David P. Reed. All rights reserved.
+ */
+#ifndef _PSTAMP_ARG_H_
+#define _PSTAMP_ARG_H_
+/*
+ * Sometimes when isn't enough, and the log must say which request, queue depth or byte
+ * count an event was about. An arg entry is a pstamp_log_t followed by a 64 bit argument,
+ * an arg2 entry by two, and each has its own ring type, so plain pstamp rings stay 32
+ * bytes per entry and the plain pstamp_log is unchanged. Logging an argument is one more
+ * store (or two) into the same entry. Entries of 40 and 48 bytes don't pack into cache
+ * lines, half of them straddle two, and a ring of them is bigger for the same number of
+ * entries. "-m pstamp" in clock_speed measures both against pstamp_log, in a ring that
+ * fits in L2 and one that doesn't.
+ *
+ * Arg rings work like pstamp rings: they can be extended by next_ring, and wrap around,
+ * overwriting the oldest entries, when full with no next_ring. A wrap starts a whole lap
+ * of overwrites on the fast path, and the laps count the entries overwritten. The two ring
+ * types share their header, and the code that handles a full ring.
+ */
+
+#include "pstamp.h"
+
+typedef struct pstamp_arg_log {
+	pstamp_t pstamp;
+	pstamp_t cause;
+	unsigned long arg;
+} pstamp_arg_log_t;
+
+typedef struct pstamp_arg2_log {
+	pstamp_t pstamp;
+	pstamp_t cause;
+	unsigned long arg[2];
+} pstamp_arg2_log_t;
+
+/* header of both ring types, next_ring points to a ring of the same type */
+struct pstamp_arg_head {
+	struct pstamp_arg_head *next_ring;
+	unsigned int size;
+	unsigned int next;	/* index where the next entry will be logged, full (or wrapping) at size */
+	bool inactive;	/* set when recording has moved to next ring */
+	unsigned long laps;	/* times the ring has wrapped, see pstamp_arg_overflows */
+};
+
+typedef struct pstamp_arg_ring {
+	struct pstamp_arg_head head;
+	pstamp_arg_log_t ring[];
+} pstamp_arg_ring_t;
+
+typedef struct pstamp_arg2_ring {
+	struct pstamp_arg_head head;
+	pstamp_arg2_log_t ring[];
+} pstamp_arg2_ring_t;
+
+/* size of memory for a particular ring size, if we want to allocate it dynamically */
+#define pstamp_arg_ring_size(size) (sizeof(pstamp_arg_ring_t) + sizeof(pstamp_arg_log_t) * size)
+#define pstamp_arg2_ring_size(size) (sizeof(pstamp_arg2_ring_t) + sizeof(pstamp_arg2_log_t) * size)
+
+static inline void _pstamp_arg_init(struct pstamp_arg_head *head, int size)
+{
+	head->next_ring = NULL;
+	head->next = head->laps = 0;
+	head->size = size;
+	head->inactive = false;
+}
+
+static inline void pstamp_arg_ring_init(pstamp_arg_ring_t *pstamp_ring, int size)
+{
+	_pstamp_arg_init(&pstamp_ring->head, size);
+}
+
+static inline void pstamp_arg2_ring_init(pstamp_arg2_ring_t *pstamp_ring, int size)
+{
+	_pstamp_arg_init(&pstamp_ring->head, size);
+}
+
+/* full ring: move to next ring if there is one, otherwise overwrite the oldest entry */
+static __attribute__((__noinline__, __unused__)) struct pstamp_arg_head *_pstamp_arg_full(struct pstamp_arg_head *head)
+{
+	struct pstamp_arg_head *next_ring = __atomic_load_n(&head->next_ring, __ATOMIC_ACQUIRE);
+
+	if (next_ring != NULL) {
+		__atomic_store_n(&head->inactive, true, __ATOMIC_RELEASE);
+		return next_ring;
+	}
+	/* overwrite from the oldest entry, a whole lap on the fast path */
+	head->laps += 1;
+	head->next = 0;
+	return head;
+}
+
+/* log with an argument, and perhaps change the pointer to the ring */
+static inline pstamp_arg_ring_t *pstamp_arg_log(pstamp_arg_ring_t *pstamp_ring, int point, const pstamp_t *cause,
+						unsigned long arg)
+{
+	pstamp_arg_log_t *entry;
+
+	if (pstamp_ring->head.next == pstamp_ring->head.size)
+		pstamp_ring = (pstamp_arg_ring_t *)_pstamp_arg_full(&pstamp_ring->head);
+	entry = pstamp_ring->ring + pstamp_ring->head.next;
+	pstamp(point, &entry->pstamp);
+	entry->cause = *cause;
+	entry->arg = arg;
+	pstamp_ring->head.next += 1;
+	/* return current (may be next) ring */
+	return pstamp_ring;
+}
+
+/* log with two arguments, and perhaps change the pointer to the ring */
+static inline pstamp_arg2_ring_t *pstamp_arg2_log(pstamp_arg2_ring_t *pstamp_ring, int point, const pstamp_t *cause,
+						  unsigned long arg0, unsigned long arg1)
+{
+	pstamp_arg2_log_t *entry;
+
+	if (pstamp_ring->head.next == pstamp_ring->head.size)
+		pstamp_ring = (pstamp_arg2_ring_t *)_pstamp_arg_full(&pstamp_ring->head);
+	entry = pstamp_ring->ring + pstamp_ring->head.next;
+	pstamp(point, &entry->pstamp);
+	entry->cause = *cause;
+	entry->arg[0] = arg0;
+	entry->arg[1] = arg1;
+	pstamp_ring->head.next += 1;
+	/* return current (may be next) ring */
+	return pstamp_ring;
+}
+
+/* same as pstamp_log_extend, next_ring must be the same type of ring */
+static inline bool _pstamp_arg_extend(struct pstamp_arg_head *head, struct pstamp_arg_head *next_ring)
+{
+	struct pstamp_arg_head *none = NULL;
+	bool ok = false;
+	if (!head->inactive)
+	    ok = __atomic_compare_exchange_n(&head->next_ring, &none, next_ring, false,
+					     __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	return ok;
+}
+
+static inline bool pstamp_arg_log_extend(pstamp_arg_ring_t *pstamp_ring, pstamp_arg_ring_t *next_ring)
+{
+	return _pstamp_arg_extend(&pstamp_ring->head, &next_ring->head);
+}
+
+static inline bool pstamp_arg2_log_extend(pstamp_arg2_ring_t *pstamp_ring, pstamp_arg2_ring_t *next_ring)
+{
+	return _pstamp_arg_extend(&pstamp_ring->head, &next_ring->head);
+}
+
+/* next ring of a log, NULL if not extended */
+static inline pstamp_arg_ring_t *pstamp_arg_next_ring(pstamp_arg_ring_t *pstamp_ring)
+{
+	return (pstamp_arg_ring_t *)__atomic_load_n(&pstamp_ring->head.next_ring, __ATOMIC_ACQUIRE);
+}
+
+static inline pstamp_arg2_ring_t *pstamp_arg2_next_ring(pstamp_arg2_ring_t *pstamp_ring)
+{
+	return (pstamp_arg2_ring_t *)__atomic_load_n(&pstamp_ring->head.next_ring, __ATOMIC_ACQUIRE);
+}
+
+/* entries overwritten in a ring of either type, as pstamp_log_overflows */
+static inline unsigned long pstamp_arg_overflows(const struct pstamp_arg_head *head)
+{
+	unsigned long logged = head->laps * head->size + head->next;
+
+	return logged > head->size ? logged - head->size : 0;
+}
+
+/* index of the oldest entry in a ring of either type */
+static inline unsigned int pstamp_arg_first(const struct pstamp_arg_head *head)
+{
+	/* once full, the oldest entry is the next one to be overwritten */
+	if (head->laps == 0)
+		return 0;
+	return _wrap(head->next, head->size);
+}
+
+/* number of entries in a ring of either type, once the ring has wrapped it is always full */
+static inline unsigned int pstamp_arg_count(const struct pstamp_arg_head *head)
+{
+	return head->laps == 0 ? head->next : head->size;
+}
+
+/* enumerate current entries in order, calling a callback per entry */
+static inline void pstamp_arg_enumerate(pstamp_arg_ring_t *pstamp_ring, void (*callback)(pstamp_arg_log_t *entry))
+{
+	unsigned int size = pstamp_ring->head.size;
+	unsigned int count = pstamp_arg_count(&pstamp_ring->head);
+	unsigned int i = pstamp_arg_first(&pstamp_ring->head);
+
+	for (; count > 0; count--, i = _wrap(i + 1, size))
+		callback(pstamp_ring->ring + i);
+}
+
+static inline void pstamp_arg2_enumerate(pstamp_arg2_ring_t *pstamp_ring, void (*callback)(pstamp_arg2_log_t *entry))
+{
+	unsigned int size = pstamp_ring->head.size;
+	unsigned int count = pstamp_arg_count(&pstamp_ring->head);
+	unsigned int i = pstamp_arg_first(&pstamp_ring->head);
+
+	for (; count > 0; count--, i = _wrap(i + 1, size))
+		callback(pstamp_ring->ring + i);
+}
+
+#endif
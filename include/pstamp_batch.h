@@ -0,0 +1,84 @@
+/*
+ * Batch processing of pstamp log entries, a span at a time.
+ *
+ * Copyright (c) 2024 David P. Reed. All rights reserved.
+ */
+#ifndef _PSTAMP_BATCH_H_
+#define _PSTAMP_BATCH_H_
+/*
+ * pstamp_log_enumerate makes an indirect call per entry, which costs more than looking at
+ * the entry. These consumers instead take a contiguous run of entries, as returned by
+ * pstamp_ring_spans, and work through it in a simple loop with no calls and (mostly) no
+ * branches that depend on the data, so the compiler can unroll and vectorize them and
+ * analysis runs near memory bandwidth.
+ *
+ * Each takes entries and a count, so it can be used on a span, a trace file segment, or
+ * any other array of entries. Results accumulate, so a log is processed by calling the
+ * consumer on each of its spans, directly or from pstamp_log_enumerate_spans.
+ */
+
+#include "pstamp.h"
+#include "tsc_freq.h"
+#include "tsc_batch.h"
+#include "log2_hist.h"
+
+/* convert entry times to ns since base, into ns[0 .. count-1] */
+static inline void pstamp_batch_to_ns(const pstamp_log_t *entries, unsigned int count, unsigned long base,
+				      const struct tsc_ns_adjust *ns_adjust, unsigned long *ns)
+{
+	/* read in place, the times are an entry apart, converted with SIMD where there is some */
+	tsc_batch_to_ns(&entries->pstamp.time, sizeof(pstamp_log_t) / sizeof(unsigned long), base, ns, count,
+			ns_adjust);
+}
+
+/*
+ * count entries by point, into counts[0 .. points-1], returns the number of entries
+ * whose point is out of that range (they are not counted).
+ */
+static inline unsigned int pstamp_batch_count_points(const pstamp_log_t *entries, unsigned int count,
+						     unsigned long *counts, unsigned int points)
+{
+	unsigned int other = 0;
+
+	for (unsigned int i = 0; i < count; i++) {
+		unsigned int point = entries[i].pstamp.point;
+		if (point < points)
+			counts[point] += 1;
+		else
+			other += 1;
+	}
+	return other;
+}
+
+/*
+ * histogram the cycles from cause to entry, for the entries at point that have a cause.
+ * A point of -1 takes every entry with a cause.
+ */
+static inline void pstamp_batch_latency_hist(const pstamp_log_t *entries, unsigned int count, int point,
+					     struct log2_hist *hist)
+{
+	for (unsigned int i = 0; i < count; i++) {
+		const pstamp_log_t *entry = entries + i;
+		if ((point == -1 || entry->pstamp.point == point) && entry->cause.time != 0)
+			log2_hist_sample(hist, entry->pstamp.time - entry->cause.time);
+	}
+}
+
+/*
+ * copy the entries at point to out, which must have room for count entries, returns the
+ * number copied. Every entry is stored and only the output index depends on the match,
+ * so the loop has no unpredictable branch.
+ */
+static inline unsigned int pstamp_batch_filter(const pstamp_log_t *entries, unsigned int count, int point,
+					       pstamp_log_t *out)
+{
+	unsigned int n = 0;
+
+	for (unsigned int i = 0; i < count; i++) {
+		out[n] = entries[i];
+		n += entries[i].pstamp.point == point;
+	}
+	return n;
+}
+
+#endif
@@ -0,0 +1,414 @@
+/*
+ * Causal chain reconstruction and critical path analysis of pstamp logs.
+ *
+ * Copyright (c) 2024 David P. Reed. All rights reserved.
+ */
+#ifndef _PSTAMP_CAUSE_H_
+#define _PSTAMP_CAUSE_H_
+/*
+ * Every logged pstamp carries its cause, a prior pstamp. Entries with the same cause form
+ * a chain, in time order. The cause of a chain may itself be a logged entry (of another
+ * chain), so chains link into a tree below a root cause that was never logged. Together
+ * the trees are the cause DAG of the logs.
+ *
+ * Entries are added in time order, as produced by pstamp_merge_next, so the cause of an
+ * entry has always been seen before it. Each entry is linked to its predecessor: the
+ * previous entry of its chain, or for the first entry of a chain, the entry that is its
+ * cause. The step from predecessor to entry is a hop from one point to another, and its
+ * latency is sampled into a distribution per (from point, to point) pair. The first entry
+ * of a chain under a root hops from the root's point.
+ *
+ * Entries and causes are found by time and logical processor, which are enough to tell
+ * pstamps apart (one core never reads the same TSC value twice). So a cause with point -1,
+ * as decoded from a compact log (pstamp_compact.h), still finds its entry, and takes its
+ * point from it. A cause that was never logged keeps point -1.
+ *
+ * When all entries are added, pstamp_cause_finish computes
+ *	the end to end latency of each chain: its last entry minus its cause
+ *	the critical path of each root: the path of hops from the root to its latest entry,
+ *	whose hops are charged to their pair as critical time
+ * A pair with a large share of critical time is the one to blame for tail latency.
+ * The longest critical path of all is kept, to be printed hop by hop.
+ *
+ * A cause with time 0 is no cause, such entries are roots of their own.
+ *
+ * This is an offline analysis, so entries are kept in memory, about 40 bytes each plus
+ * hash tables.
+ */
+
+#include <stdio.h>
+#include <math.h>
+#include "shorthand.h"
+#include "pstamp.h"
+#include "pstamp_point.h"
+#include "running_average.h"
+#include "log2_hist.h"
+#include "tsc_freq.h"
+
+/* open addressing hash table from a pair of keys to an index, -1 marks an empty slot */
+struct pstamp_map_slot {
+	unsigned long k1, k2;
+	long value;
+};
+
+struct pstamp_map {
+	struct pstamp_map_slot *slots;
+	unsigned long mask;
+	unsigned long used;
+};
+
+static inline int _pstamp_map_init(struct pstamp_map *map, unsigned long capacity)
+{
+	map->slots = malloc(sizeof(*map->slots) * capacity);
+	if (map->slots == NULL) return -1;
+	for (unsigned long i = 0; i < capacity; i++)
+		map->slots[i].value = -1;
+	map->mask = capacity - 1;
+	map->used = 0;
+	return 0;
+}
+
+static inline struct pstamp_map_slot *_pstamp_map_slot(const struct pstamp_map *map, unsigned long k1, unsigned long k2)
+{
+	unsigned long i = (k1 * 0x9E3779B97F4A7C15UL) ^ (k2 * 0xC2B2AE3D27D4EB4FUL);
+
+	for (i ^= i >> 29;; i++) {
+		struct pstamp_map_slot *slot = map->slots + (i & map->mask);
+		if (slot->value < 0 || (slot->k1 == k1 && slot->k2 == k2))
+			return slot;
+	}
+}
+
+static inline long _pstamp_map_find(const struct pstamp_map *map, unsigned long k1, unsigned long k2)
+{
+	return _pstamp_map_slot(map, k1, k2)->value;
+}
+
+/* set the value of a key, growing the table to keep it at most half full */
+static inline int _pstamp_map_set(struct pstamp_map *map, unsigned long k1, unsigned long k2, long value)
+{
+	struct pstamp_map_slot *slot;
+
+	if (2 * (map->used + 1) > map->mask + 1) {
+		struct pstamp_map old = *map;
+		if (_pstamp_map_init(map, 2 * (old.mask + 1)) < 0) {
+			*map = old;
+			return -1;
+		}
+		for (unsigned long i = 0; i <= old.mask; i++)
+			if (old.slots[i].value >= 0)
+				*_pstamp_map_slot(map, old.slots[i].k1, old.slots[i].k2) = old.slots[i];
+		map->used = old.used;
+		free(old.slots);
+	}
+	slot = _pstamp_map_slot(map, k1, k2);
+	if (slot->value < 0)
+		map->used += 1;
+	*slot = (struct pstamp_map_slot){.k1 = k1, .k2 = k2, .value = value};
+	return 0;
+}
+
+/* a pstamp as a pair of keys, with its time: its logical processor, not its point, which may be unknown */
+#define _pstamp_key2(p) ((unsigned long)(unsigned int)(p)->logical_processor)
+
+struct pstamp_cause_event {
+	pstamp_t pstamp;
+	long pred;		/* previous entry on the path from the root, -1 if the root */
+	long root;
+};
+
+struct pstamp_cause_chain {
+	pstamp_t cause;
+	long last;		/* latest entry of the chain */
+	unsigned long events;
+};
+
+struct pstamp_cause_root {
+	pstamp_t cause;
+	long latest;		/* latest entry under this root */
+};
+
+/* latency distribution of hops between two points */
+struct pstamp_hop {
+	int from, to;
+	struct running_stats stats;
+	struct log2_hist hist;
+	unsigned long critical_cycles;	/* time spent in this hop on critical paths */
+	unsigned long critical_count;
+};
+
+typedef struct pstamp_cause {
+	struct pstamp_cause_event *events;
+	struct pstamp_cause_chain *chains;
+	struct pstamp_cause_root *roots;
+	struct pstamp_hop *hops;
+	unsigned long event_count, event_capacity;
+	unsigned long chain_count, chain_capacity;
+	unsigned long root_count, root_capacity;
+	unsigned long hop_count, hop_capacity;
+	struct pstamp_map event_map;	/* pstamp -> event */
+	struct pstamp_map chain_map;	/* cause -> chain */
+	struct pstamp_map hop_map;	/* (from, to) -> hop */
+	/* computed by pstamp_cause_finish */
+	struct running_stats chain_stats;
+	struct log2_hist chain_hist;
+	long critical_root;		/* root with the longest critical path, -1 if none */
+	unsigned long critical_cycles;
+	/* names of points in the report */
+	pstamp_point_lookup_t *point_name;
+	const void *point_name_arg;
+} pstamp_cause_t;
+
+static inline void pstamp_cause_destroy(pstamp_cause_t *pc)
+{
+	free(pc->events);
+	free(pc->chains);
+	free(pc->roots);
+	free(pc->hops);
+	free(pc->event_map.slots);
+	free(pc->chain_map.slots);
+	free(pc->hop_map.slots);
+}
+
+/* returns 0, or -1 if out of memory, with nothing left allocated */
+static inline int pstamp_cause_init(pstamp_cause_t *pc)
+{
+	memset(pc, 0, sizeof(*pc));
+	pc->critical_root = -1;
+	pc->point_name = pstamp_point_lookup;
+	if (_pstamp_map_init(&pc->event_map, 1024) < 0 || _pstamp_map_init(&pc->chain_map, 1024) < 0 ||
+	    _pstamp_map_init(&pc->hop_map, 64) < 0) {
+		/* the maps not made have NULL slots */
+		pstamp_cause_destroy(pc);
+		return -1;
+	}
+	return 0;
+}
+
+/* make room for one more item in a growing array, returns 0 or -1 if out of memory */
+static inline int _pstamp_cause_reserve(void **array, unsigned long *capacity, unsigned long count, size_t size)
+{
+	if (count == *capacity) {
+		unsigned long n = max(2 * *capacity, 1024UL);
+		void *p = realloc(*array, n * size);
+		if (p == NULL) return -1;
+		*array = p;
+		*capacity = n;
+	}
+	return 0;
+}
+
+/* the hop statistics for a pair of points, created if new, NULL if out of memory */
+static inline struct pstamp_hop *_pstamp_cause_hop(pstamp_cause_t *pc, int from, int to)
+{
+	unsigned long key = ((unsigned long)(unsigned int)from << 32) | (unsigned int)to;
+	long i = _pstamp_map_find(&pc->hop_map, key, 0);
+	struct pstamp_hop *hop;
+
+	if (i >= 0)
+		return pc->hops + i;
+	if (_pstamp_cause_reserve((void **)&pc->hops, &pc->hop_capacity, pc->hop_count, sizeof(*pc->hops)) < 0 ||
+	    _pstamp_map_set(&pc->hop_map, key, 0, pc->hop_count) < 0)
+		return NULL;
+	hop = pc->hops + pc->hop_count++;
+	hop->from = from;
+	hop->to = to;
+	running_stats_init(&hop->stats);
+	log2_hist_init(&hop->hist);
+	hop->critical_cycles = hop->critical_count = 0;
+	return hop;
+}
+
+static inline int _pstamp_cause_sample(pstamp_cause_t *pc, const pstamp_t *from, const pstamp_t *to)
+{
+	struct pstamp_hop *hop = _pstamp_cause_hop(pc, from->point, to->point);
+	unsigned long cycles = to->time - from->time;
+
+	if (hop == NULL) return -1;
+	running_stats_sample(&hop->stats, cycles);
+	log2_hist_sample(&hop->hist, cycles);
+	return 0;
+}
+
+/* add the next entry in time order, returns 0 or -1 if out of memory */
+static inline int pstamp_cause_add(pstamp_cause_t *pc, const pstamp_log_t *entry)
+{
+	pstamp_t resolved = entry->cause;
+	const pstamp_t *cause = &resolved;
+	long e = pc->event_count;
+	struct pstamp_cause_event *event;
+	long chain = -1, pred = -1, root;
+
+	if (_pstamp_cause_reserve((void **)&pc->events, &pc->event_capacity, pc->event_count, sizeof(*pc->events)) < 0)
+		return -1;
+	/* a cause without its point, from a compact log: take it from the logged entry */
+	if (cause->time != 0 && cause->point == -1) {
+		long c = _pstamp_map_find(&pc->event_map, cause->time, _pstamp_key2(cause));
+		if (c >= 0)
+			resolved.point = pc->events[c].pstamp.point;
+	}
+	if (cause->time != 0) {
+		chain = _pstamp_map_find(&pc->chain_map, cause->time, _pstamp_key2(cause));
+		if (chain >= 0) {
+			pred = pc->chains[chain].last;
+		} else {
+			/* first entry of a new chain, its cause may be a logged entry */
+			pred = _pstamp_map_find(&pc->event_map, cause->time, _pstamp_key2(cause));
+			if (_pstamp_cause_reserve((void **)&pc->chains, &pc->chain_capacity, pc->chain_count,
+						  sizeof(*pc->chains)) < 0 ||
+			    _pstamp_map_set(&pc->chain_map, cause->time, _pstamp_key2(cause), pc->chain_count) < 0)
+				return -1;
+			chain = pc->chain_count++;
+			pc->chains[chain] = (struct pstamp_cause_chain){.cause = *cause, .last = e, .events = 0};
+		}
+		pc->chains[chain].last = e;
+		pc->chains[chain].events += 1;
+	}
+
+	if (pred >= 0) {
+		root = pc->events[pred].root;
+		if (_pstamp_cause_sample(pc, &pc->events[pred].pstamp, &entry->pstamp) < 0) return -1;
+	} else {
+		/* a new root: the unlogged cause, or this entry if it has no cause */
+		if (_pstamp_cause_reserve((void **)&pc->roots, &pc->root_capacity, pc->root_count, sizeof(*pc->roots)) < 0)
+			return -1;
+		root = pc->root_count++;
+		pc->roots[root].cause = cause->time != 0 ? *cause : entry->pstamp;
+		if (cause->time != 0 && _pstamp_cause_sample(pc, cause, &entry->pstamp) < 0) return -1;
+	}
+	pc->roots[root].latest = e;
+
+	if (_pstamp_map_set(&pc->event_map, entry->pstamp.time, _pstamp_key2(&entry->pstamp), e) < 0)
+		return -1;
+	event = pc->events + pc->event_count++;
+	event->pstamp = entry->pstamp;
+	event->pred = pred;
+	event->root = root;
+	return 0;
+}
+
+/* the pstamp an entry hops from: its predecessor, or its root's cause, NULL if it is the root */
+static inline const pstamp_t *_pstamp_cause_from(const pstamp_cause_t *pc, const struct pstamp_cause_event *event)
+{
+	const pstamp_t *cause = &pc->roots[event->root].cause;
+
+	if (event->pred >= 0)
+		return &pc->events[event->pred].pstamp;
+	return cause->time == event->pstamp.time ? NULL : cause;
+}
+
+/* compute chain latencies and critical paths, after all entries are added */
+static inline void pstamp_cause_finish(pstamp_cause_t *pc)
+{
+	running_stats_init(&pc->chain_stats);
+	log2_hist_init(&pc->chain_hist);
+	for (unsigned long c = 0; c < pc->chain_count; c++) {
+		unsigned long cycles = pc->events[pc->chains[c].last].pstamp.time - pc->chains[c].cause.time;
+		running_stats_sample(&pc->chain_stats, cycles);
+		log2_hist_sample(&pc->chain_hist, cycles);
+	}
+
+	pc->critical_root = -1;
+	pc->critical_cycles = 0;
+	for (unsigned long r = 0; r < pc->root_count; r++) {
+		const struct pstamp_cause_root *root = pc->roots + r;
+		unsigned long cycles = pc->events[root->latest].pstamp.time - root->cause.time;
+
+		/* a root that is just an entry without a cause has no path */
+		if (cycles == 0)
+			continue;
+		if (pc->critical_root < 0 || cycles > pc->critical_cycles) {
+			pc->critical_root = r;
+			pc->critical_cycles = cycles;
+		}
+		for (long e = root->latest; e >= 0; e = pc->events[e].pred) {
+			const struct pstamp_cause_event *event = pc->events + e;
+			const pstamp_t *from = _pstamp_cause_from(pc, event);
+			long h;
+
+			if (from == NULL)
+				break;
+			h = _pstamp_map_find(&pc->hop_map,
+						  ((unsigned long)(unsigned int)from->point << 32) |
+						  (unsigned int)event->pstamp.point, 0);
+			if (h >= 0) {
+				pc->hops[h].critical_cycles += event->pstamp.time - from->time;
+				pc->hops[h].critical_count += 1;
+			}
+		}
+	}
+}
+
+/* name points in the report with lookup instead of the PSTAMP_POINT registry */
+static inline void pstamp_cause_point_names(pstamp_cause_t *pc, pstamp_point_lookup_t *lookup, const void *arg)
+{
+	pc->point_name = lookup;
+	pc->point_name_arg = arg;
+}
+
+/* cycles may be a statistic, NaN (the std of one sample) shows as 0 */
+static inline double _pstamp_cause_ns(double cycles, const struct tsc_ns_adjust *ns_adjust)
+{
+	return cycles > 0 ? tsc_cycles_to_ns(cycles, ns_adjust) : 0;
+}
+
+/* print hop distributions, chain latency and the longest critical path, times in ns */
+static inline void pstamp_cause_report(pstamp_cause_t *pc, FILE *out, const struct tsc_ns_adjust *ns_adjust)
+{
+	unsigned long total_critical = 0;
+	char from_buffer[16], to_buffer[16];
+
+	for (unsigned long h = 0; h < pc->hop_count; h++)
+		total_critical += pc->hops[h].critical_cycles;
+
+	fprintf(out, "%lu entries, %lu chains, %lu roots\n", pc->event_count, pc->chain_count, pc->root_count);
+	fprintf(out, "Chain end to end: mean %.0f nsec, std %.0f nsec, p50 <= %.0f, p99 <= %.0f, max %.0f nsec\n",
+		_pstamp_cause_ns(running_stats_mean(&pc->chain_stats), ns_adjust),
+		_pstamp_cause_ns(sqrt(running_stats_variance(&pc->chain_stats)), ns_adjust),
+		_pstamp_cause_ns(log2_hist_percentile(&pc->chain_hist, 0.5), ns_adjust),
+		_pstamp_cause_ns(log2_hist_percentile(&pc->chain_hist, 0.99), ns_adjust),
+		_pstamp_cause_ns(pc->chain_hist.max, ns_adjust));
+
+	fprintf(out, "\n%16s %16s %10s %10s %10s %10s %10s %10s %9s\n",
+		"from", "to", "hops", "mean", "std", "p99<=", "p99.9<=", "max", "critical");
+	for (unsigned long h = 0; h < pc->hop_count; h++) {
+		struct pstamp_hop *hop = pc->hops + h;
+		struct running_stats *stats = &hop->stats;
+		fprintf(out, "%16s %16s %10lu %10.0f %10.0f %10.0f %10.0f %10.0f %8.1f%%\n",
+			pstamp_point_label(pc->point_name, pc->point_name_arg, hop->from, from_buffer, sizeof(from_buffer)),
+			pstamp_point_label(pc->point_name, pc->point_name_arg, hop->to, to_buffer, sizeof(to_buffer)),
+			running_stats_samples(stats),
+			_pstamp_cause_ns(running_stats_mean(stats), ns_adjust),
+			_pstamp_cause_ns(sqrt(running_stats_variance(stats)), ns_adjust),
+			_pstamp_cause_ns(log2_hist_percentile(&hop->hist, 0.99), ns_adjust),
+			_pstamp_cause_ns(log2_hist_percentile(&hop->hist, 0.999), ns_adjust),
+			_pstamp_cause_ns(hop->hist.max, ns_adjust),
+			total_critical ? 100.0 * hop->critical_cycles / total_critical : 0.0);
+	}
+
+	if (pc->critical_root >= 0) {
+		const struct pstamp_cause_root *root = pc->roots + pc->critical_root;
+		fprintf(out, "\nLongest critical path, %.0f nsec from point %s on cpu %d, latest hop first:\n",
+			_pstamp_cause_ns(pc->critical_cycles, ns_adjust),
+			pstamp_point_label(pc->point_name, pc->point_name_arg, root->cause.point, from_buffer,
+					   sizeof(from_buffer)),
+			root->cause.logical_processor);
+		/* walk back from the latest entry, printing the hops in reverse */
+		for (long e = root->latest; e >= 0; e = pc->events[e].pred) {
+			const struct pstamp_cause_event *event = pc->events + e;
+			const pstamp_t *from = _pstamp_cause_from(pc, event);
+
+			if (from == NULL)
+				break;
+			fprintf(out, "  %16s -> %16s on cpu %d: %.0f nsec\n",
+				pstamp_point_label(pc->point_name, pc->point_name_arg, from->point, from_buffer,
+						   sizeof(from_buffer)),
+				pstamp_point_label(pc->point_name, pc->point_name_arg, event->pstamp.point, to_buffer,
+						   sizeof(to_buffer)),
+				event->pstamp.logical_processor,
+				_pstamp_cause_ns(event->pstamp.time - from->time, ns_adjust));
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,182 @@
+/*
+ * Compact 16 byte pstamp log entries, four to a cache line.
+ *
+ * Copyright (c) 2024 David P. Reed. All rights reserved.
+ */
+#ifndef _PSTAMP_COMPACT_H_
+#define _PSTAMP_COMPACT_H_
+/*
+ * A pstamp_log_t is 32 bytes, two full pstamps. Most of that is redundant in a per core ring:
+ * every entry has the same logical processor, and the times are close together. A compact
+ * ring keeps the logical processor and a base time in the ring header, taken from its first
+ * entry, and each entry holds
+ *	stamp: time - base in the high 48 bits, a 16 bit point in the low 16 bits
+ *	cause: the low 48 bits of the cause time in the high bits, the cause's logical processor
+ *	       in the low 16 bits
+ * The cause point is not kept, a decoded entry's cause has point -1. pstamp_cause_add looks
+ * the cause up among the entries already added, by time and logical processor, and takes
+ * its point from there. Other consumers (pstamp_stats, pstamp_json) show it as -1.
+ * The high bits of the cause time are recovered from the entry time, taking the cause time
+ * nearest it, before or after (a cause on another core can read a TSC a little ahead of
+ * the effect's). So a cause must be within 2^47 cycles, about 13 hours at 3 GHz, of its
+ * effect, and a ring must not span more than 48 bits of cycles, about a day.
+ *
+ * Compact rings work like pstamp rings: they can be extended by next_ring, and wrap around,
+ * overwriting the oldest entries, a whole lap on the fast path, when full with no
+ * next_ring. The first entry of a ring takes the slow path too, to set the base. They must
+ * be allocated with 64 byte alignment (posix_memalign or aligned_alloc) so entries don't
+ * straddle lines. "-m pstamp" in clock_speed measures them against pstamp rings of the
+ * same number of entries, in each footprint.
+ */
+
+#include "pstamp.h"
+
+typedef struct pstamp_clog {
+	unsigned long stamp;
+	unsigned long cause;
+} pstamp_clog_t;
+
+typedef struct pstamp_cring {
+	struct pstamp_cring *next_ring;
+	unsigned int size;
+	unsigned int next;	/* index where the next entry will be logged, full (or wrapping) at size */
+	unsigned int limit;	/* pstamp_clog takes its slow path at limit, 0 before the first entry */
+	bool inactive;	/* set when recording has moved to next ring */
+	int logical_processor;	/* of every entry */
+	unsigned long base;	/* time of the first entry */
+	unsigned long laps;	/* times the ring has wrapped, see pstamp_cring_overflows */
+	pstamp_clog_t ring[] __attribute__((aligned(64)));
+} pstamp_cring_t;
+
+#define PSTAMP_CLOG_SHIFT 16
+#define PSTAMP_CLOG_MASK ((1UL << PSTAMP_CLOG_SHIFT) - 1)
+
+/* size of memory for a particular pstamp_cring size, if we want to allocate it dynamically */
+#define pstamp_cring_size(size) (sizeof(pstamp_cring_t) + sizeof(pstamp_clog_t) * size)
+
+/* initialize compact ring in memory */
+static inline void pstamp_cring_init(pstamp_cring_t *pstamp_cring, int size)
+{
+	pstamp_cring->next_ring = NULL;
+	pstamp_cring->next = pstamp_cring->limit = 0;
+	pstamp_cring->size = size;
+	pstamp_cring->inactive = false;
+	pstamp_cring->logical_processor = -1;
+	pstamp_cring->base = pstamp_cring->laps = 0;
+}
+
+/* full ring, or first entry of the ring: returns the ring to log into, its base set */
+static __attribute__((__noinline__, __unused__)) pstamp_cring_t *_pstamp_clog_slow(pstamp_cring_t *pstamp_cring,
+										   unsigned long time, int logical_processor)
+{
+	if (pstamp_cring->limit != 0) {
+		pstamp_cring_t *next_ring = __atomic_load_n(&pstamp_cring->next_ring, __ATOMIC_ACQUIRE);
+		if (next_ring == NULL) {
+			/* overwrite from the oldest entry, a whole lap on the fast path */
+			pstamp_cring->laps += 1;
+			pstamp_cring->next = 0;
+			return pstamp_cring;
+		}
+		__atomic_store_n(&pstamp_cring->inactive, true, __ATOMIC_RELEASE);
+		pstamp_cring = next_ring;
+	}
+	if (pstamp_cring->limit == 0) {
+		pstamp_cring->base = time;
+		pstamp_cring->logical_processor = logical_processor;
+		pstamp_cring->limit = pstamp_cring->size;
+	}
+	return pstamp_cring;
+}
+
+/* log, and perhaps change the pointer to the ring */
+static inline pstamp_cring_t *pstamp_clog(pstamp_cring_t *pstamp_cring, int point, const pstamp_t *cause)
+{
+	unsigned long d, a, c, time;
+	pstamp_clog_t *entry;
+
+	asm volatile("rdtscp;" : "=a"(a), "=d"(d), "=c"(c));
+	time = (d << 32) | a;
+	if (pstamp_cring->next == pstamp_cring->limit)
+		pstamp_cring = _pstamp_clog_slow(pstamp_cring, time, c);
+	entry = pstamp_cring->ring + pstamp_cring->next;
+	entry->stamp = ((time - pstamp_cring->base) << PSTAMP_CLOG_SHIFT) | (point & PSTAMP_CLOG_MASK);
+	entry->cause = (cause->time << PSTAMP_CLOG_SHIFT) | (cause->logical_processor & PSTAMP_CLOG_MASK);
+	pstamp_cring->next += 1;
+	/* return current (may be next) ring */
+	return pstamp_cring;
+}
+
+/* same as pstamp_log_extend, for compact rings */
+static inline bool pstamp_clog_extend(pstamp_cring_t *pstamp_cring, pstamp_cring_t *next_ring)
+{
+	pstamp_cring_t *none = NULL;
+	bool ok = false;
+	if (!pstamp_cring->inactive)
+	    ok = __atomic_compare_exchange_n(&pstamp_cring->next_ring, &none, next_ring, false,
+					     __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	return ok;
+}
+
+/* entries overwritten in the ring, as pstamp_log_overflows */
+static inline unsigned long pstamp_cring_overflows(const pstamp_cring_t *pstamp_cring)
+{
+	unsigned long logged = pstamp_cring->laps * pstamp_cring->size + pstamp_cring->next;
+
+	return logged > pstamp_cring->size ? logged - pstamp_cring->size : 0;
+}
+
+/* index of the oldest entry in the ring */
+static inline unsigned int pstamp_cring_first(const pstamp_cring_t *pstamp_cring)
+{
+	/* once full, the oldest entry is the next one to be overwritten */
+	if (pstamp_cring->laps == 0)
+		return 0;
+	return _wrap(pstamp_cring->next, pstamp_cring->size);
+}
+
+/* number of entries in the ring, once the ring has wrapped it is always full */
+static inline unsigned int pstamp_cring_count(const pstamp_cring_t *pstamp_cring)
+{
+	return pstamp_cring->laps == 0 ? pstamp_cring->next : pstamp_cring->size;
+}
+
+/*
+ * expand a compact entry to a full pstamp_log_t. The cause point is not recorded, it is
+ * set to -1 (pstamp_cause_add resolves it). A zero cause is expanded as a zero cause.
+ */
+static inline void pstamp_clog_decode(const pstamp_cring_t *pstamp_cring, const pstamp_clog_t *entry,
+				      pstamp_log_t *pstamp_log)
+{
+	unsigned long time = pstamp_cring->base + (entry->stamp >> PSTAMP_CLOG_SHIFT);
+	unsigned long cause_time = entry->cause >> PSTAMP_CLOG_SHIFT;
+
+	pstamp_log->pstamp.point = entry->stamp & PSTAMP_CLOG_MASK;
+	pstamp_log->pstamp.logical_processor = pstamp_cring->logical_processor;
+	pstamp_log->pstamp.time = time;
+	if (entry->cause == 0) {
+		pstamp_log->cause.point = pstamp_log->cause.logical_processor = 0;
+		pstamp_log->cause.time = 0;
+		return;
+	}
+	/* the cause time nearest the entry time with these low bits, the difference sign extended */
+	cause_time = time + ((long)((cause_time - time) << PSTAMP_CLOG_SHIFT) >> PSTAMP_CLOG_SHIFT);
+	pstamp_log->cause.point = -1;
+	pstamp_log->cause.logical_processor = entry->cause & PSTAMP_CLOG_MASK;
+	pstamp_log->cause.time = cause_time;
+}
+
+/* enumerate current entries in order, expanded, calling a callback per entry */
+static inline void pstamp_clog_enumerate(pstamp_cring_t *pstamp_cring, void (*callback)(pstamp_log_t *pstamp_log))
+{
+	unsigned int size = pstamp_cring->size;
+	unsigned int count = pstamp_cring_count(pstamp_cring);
+	unsigned int i = pstamp_cring_first(pstamp_cring);
+	pstamp_log_t pstamp_log;
+
+	for (; count > 0; count--, i = _wrap(i + 1, size)) {
+		pstamp_clog_decode(pstamp_cring, pstamp_cring->ring + i, &pstamp_log);
+		callback(&pstamp_log);
+	}
+}
+
+#endif
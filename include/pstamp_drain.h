@@ -0,0 +1,201 @@
+/*
+ * Background draining of pstamp logs into a consumer, recycling rings through a pool.
+ *
+ * Copyright (c) 2024 David P. Reed. All rights reserved.
+ */
+#ifndef _PSTAMP_DRAIN_H_
+#define _PSTAMP_DRAIN_H_
+/*
+ * This is the consumer that pstamp_log_extend assumes is running. Each producer's log is
+ * a chain of rings taken from a pstamp_pool. The drain keeps one spare ring attached as
+ * next_ring of the ring the producer is logging into, so the producer always has somewhere
+ * to move when its ring fills, and never allocates. When the producer moves on, its old ring
+ * is marked inactive; the drain then passes it to the consume callback and returns it to
+ * the pool.
+ *
+ * No entries are lost as long as the drain polls each log at least once in the time it takes
+ * the producer to fill a ring. If the pool runs dry, a log is not extended (counted in
+ * starved) and the producer will wrap around its ring, as a simple log does.
+ *
+ * A consumer that needs a ring after consume returns (to write it out asynchronously, as
+ * pstamp_stream.h does) asks the drain to let it retain rings, and puts each back in the
+ * pool itself when done with it.
+ *
+ * Logs are added before the drain thread is started. The drain thread should run on its own
+ * core, it spins between polls unless poll_ns is nonzero.
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include "pstamp.h"
+
+/* the oldest ring of a producer's log that has not been consumed */
+struct pstamp_drain_log {
+	pstamp_ring_t *first;
+	pstamp_ring_t *starved;		/* the ring last counted in starved, so each counts once */
+};
+
+typedef struct pstamp_drain {
+	pstamp_pool_t *pool;
+	void (*consume)(pstamp_ring_t *pstamp_ring, void *arg);
+	void *arg;
+	unsigned long poll_ns;		/* sleep between polls that find nothing to do, 0 to spin */
+	unsigned long consumed;		/* rings consumed */
+	unsigned long starved;		/* rings that couldn't be extended because the pool was empty */
+	bool retain;			/* consume returns rings to the pool itself */
+	bool stop;
+	pthread_t thread;
+	unsigned int count;
+	unsigned int capacity;
+	struct pstamp_drain_log logs[];
+} pstamp_drain_t;
+
+/* size of memory for draining up to n logs, if we want to allocate it dynamically */
+#define pstamp_drain_size(n) (sizeof(pstamp_drain_t) + sizeof(struct pstamp_drain_log) * (n))
+
+static inline void pstamp_drain_init(pstamp_drain_t *drain, unsigned int capacity, pstamp_pool_t *pool,
+				     void (*consume)(pstamp_ring_t *pstamp_ring, void *arg), void *arg,
+				     unsigned long poll_ns)
+{
+	drain->pool = pool;
+	drain->consume = consume;
+	drain->arg = arg;
+	drain->poll_ns = poll_ns;
+	drain->consumed = drain->starved = 0;
+	drain->retain = false;
+	drain->stop = false;
+	drain->count = 0;
+	drain->capacity = capacity;
+}
+
+/* consume keeps the rings it is given, and puts each back in the pool when done with it */
+static inline void pstamp_drain_retain(pstamp_drain_t *drain)
+{
+	drain->retain = true;
+}
+
+/*
+ * start a new log, returns the ring the producer logs into (with a spare already attached),
+ * or NULL if the drain is full or the pool is empty. Only call before pstamp_drain_start.
+ */
+static inline pstamp_ring_t *pstamp_drain_add(pstamp_drain_t *drain)
+{
+	pstamp_ring_t *pstamp_ring, *spare;
+
+	if (drain->count == drain->capacity)
+		return NULL;
+	pstamp_ring = pstamp_pool_get(drain->pool);
+	if (pstamp_ring == NULL)
+		return NULL;
+	spare = pstamp_pool_get(drain->pool);
+	drain->logs[drain->count].starved = NULL;
+	if (spare != NULL) {
+		pstamp_log_extend(pstamp_ring, spare);
+	} else {
+		drain->starved += 1;
+		drain->logs[drain->count].starved = pstamp_ring;
+	}
+	drain->logs[drain->count++].first = pstamp_ring;
+	return pstamp_ring;
+}
+
+/* consume the inactive rings of every log and replace spares, returns true if any work was done */
+static inline bool pstamp_drain_poll(pstamp_drain_t *drain)
+{
+	bool busy = false;
+
+	for (unsigned int i = 0; i < drain->count; i++) {
+		pstamp_ring_t *pstamp_ring = drain->logs[i].first;
+
+		/* inactive rings always have a next_ring, the one the producer moved to */
+		while (pstamp_log_inactive(pstamp_ring)) {
+			pstamp_ring_t *done = pstamp_ring;
+			pstamp_ring = done->next_ring;
+			drain->consume(done, drain->arg);
+			if (!drain->retain)
+				pstamp_pool_put(drain->pool, done);
+			drain->consumed += 1;
+			busy = true;
+		}
+		drain->logs[i].first = pstamp_ring;
+
+		/* pstamp_ring is now the producer's current ring, make sure it has a spare */
+		if (!pstamp_log_extended(pstamp_ring)) {
+			pstamp_ring_t *spare = pstamp_pool_get(drain->pool);
+			if (spare == NULL) {
+				/* nothing done, wait for rings to come back to the pool */
+				if (drain->logs[i].starved != pstamp_ring) {
+					drain->logs[i].starved = pstamp_ring;
+					drain->starved += 1;
+				}
+				continue;
+			}
+			if (!pstamp_log_extend(pstamp_ring, spare)) {
+				/* producer moved on meanwhile, catch it next poll */
+				pstamp_pool_put(drain->pool, spare);
+			}
+			busy = true;
+		}
+	}
+	return busy;
+}
+
+/*
+ * consume every ring left in every log, including the ones being logged into, and return
+ * them all to the pool. Only call when the producers have stopped logging and the drain
+ * thread isn't running.
+ */
+static inline void pstamp_drain_flush(pstamp_drain_t *drain)
+{
+	for (unsigned int i = 0; i < drain->count; i++) {
+		pstamp_ring_t *pstamp_ring = drain->logs[i].first;
+
+		while (pstamp_ring != NULL) {
+			pstamp_ring_t *done = pstamp_ring;
+			pstamp_ring = done->next_ring;
+			if (pstamp_ring_count(done) > 0) {
+				drain->consume(done, drain->arg);
+				drain->consumed += 1;
+				if (drain->retain)
+					continue;
+			}
+			pstamp_pool_put(drain->pool, done);
+		}
+	}
+	drain->count = 0;
+}
+
+static inline void *_pstamp_drain_main(void *arg)
+{
+	pstamp_drain_t *drain = (pstamp_drain_t *)arg;
+	struct timespec poll = {.tv_sec = drain->poll_ns / 1000000000UL,
+				.tv_nsec = drain->poll_ns % 1000000000UL};
+
+	while (!__atomic_load_n(&drain->stop, __ATOMIC_ACQUIRE)) {
+		if (pstamp_drain_poll(drain))
+			continue;
+		if (drain->poll_ns)
+			nanosleep(&poll, NULL);
+		else
+			asm volatile("pause;");
+	}
+	/* pick up rings that went inactive before stop was seen */
+	pstamp_drain_poll(drain);
+	return NULL;
+}
+
+/* start the drain thread, returns 0 or an error number as pthread_create does */
+static inline int pstamp_drain_start(pstamp_drain_t *drain, const pthread_attr_t *attr)
+{
+	drain->stop = false;
+	return pthread_create(&drain->thread, attr, _pstamp_drain_main, drain);
+}
+
+/* stop the drain thread and wait for it to finish its last poll */
+static inline int pstamp_drain_stop(pstamp_drain_t *drain)
+{
+	__atomic_store_n(&drain->stop, true, __ATOMIC_RELEASE);
+	return pthread_join(drain->thread, NULL);
+}
+
+#endif
@@ -0,0 +1,294 @@
+/*
+ * Binary trace files of pstamp logs, and a zero copy reader using mmap.
+ *
+ * Copyright (c) 2024 David P. Reed. All rights reserved.
+ */
+#ifndef _PSTAMP_FILE_H_
+#define _PSTAMP_FILE_H_
+/*
+ * A trace file holds the entries of any number of logs (chains of rings), in the host's
+ * native byte order:
+ *
+ *	header		struct pstamp_file_header, at offset 0
+ *	entries		pstamp_log_t entries of each ring segment, oldest first
+ *	segments	struct pstamp_file_segment per segment: where its entries are, its log,
+ *			its logical processor and its overflow count
+ *	points		struct pstamp_file_point per named point
+ *	names		the point names, NUL terminated
+ *
+ * The tables are at the end, so a writer streams the entries straight from the rings with
+ * no copying, and writes the header last. Until then the file starts with a placeholder
+ * without the magic, so a write cut short by a crash is not taken for a trace. The header
+ * carries the tsc_ns_adjust constants of the machine that captured the trace, so times can
+ * be converted to ns offline.
+ *
+ * A reader maps the file and validates the header and tables once. After that, segment
+ * entries are used in place, as arrays of pstamp_log_t that can be enumerated or merged
+ * like rings. The mapping is private, so entries can be modified without changing the file.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "shorthand.h"
+#include "pstamp.h"
+#include "pstamp_point.h"
+#include "tsc_freq.h"
+
+#define PSTAMP_FILE_MAGIC "PSTAMP\0\0"
+#define PSTAMP_FILE_VERSION 1
+
+struct pstamp_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;		/* sizeof(pstamp_log_t) */
+	struct tsc_ns_adjust ns_adjust;
+	uint32_t segment_count;
+	uint32_t point_count;
+	uint64_t segments_offset;
+	uint64_t points_offset;
+	uint64_t names_offset;
+	uint64_t names_size;
+};
+
+struct pstamp_file_segment {
+	uint64_t offset;		/* of the first entry */
+	uint32_t count;
+	uint32_t log;			/* index of the log the segment came from */
+	uint64_t overflows;
+	int32_t logical_processor;	/* of the first entry */
+	uint32_t reserved;
+};
+
+struct pstamp_file_point {
+	int32_t point;
+	uint32_t name;			/* offset of the name in the names */
+};
+
+/* a point number and its name, to be written with a trace */
+struct pstamp_point_name {
+	int point;
+	const char *name;
+};
+
+/* write all of iov, continuing after short writes, returns 0 or -1 with errno set */
+static inline int _pstamp_file_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t n = writev(fd, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		for (; iovcnt > 0 && (size_t)n >= iov->iov_len; iov++, iovcnt--)
+			n -= iov->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * write count logs, each a chain of rings, to fd, which must be positioned at the start
+ * of an empty file. names are written as the point name table, if names is NULL the names
+ * of the points registered with PSTAMP_POINT are written.
+ * Returns 0, or -1 with errno set. Logs should be inactive or extended while being written,
+ * as for pstamp_log_enumerate.
+ */
+static inline int pstamp_file_write(int fd, pstamp_ring_t *const *logs, unsigned int count,
+				    const struct tsc_ns_adjust *ns_adjust,
+				    const struct pstamp_point_name *names, unsigned int name_count)
+{
+	struct pstamp_file_header header = {.magic = PSTAMP_FILE_MAGIC,
+					    .version = PSTAMP_FILE_VERSION,
+					    .entry_size = sizeof(pstamp_log_t),
+					    .ns_adjust = *ns_adjust};
+	struct pstamp_point_name *registry = NULL;
+	struct pstamp_file_segment *segments = NULL;
+	struct pstamp_file_point *points = NULL;
+	struct iovec iov[3];
+	uint64_t offset = sizeof(header);
+	unsigned int segment_count = 0;
+	int ret = -1;
+
+	if (names == NULL) {
+		name_count = pstamp_point_count();
+		registry = calloc(name_count + 1, sizeof(*registry));
+		if (registry == NULL) goto out;
+		for (unsigned int i = 0; i < name_count; i++)
+			registry[i] = (struct pstamp_point_name){.point = i, .name = pstamp_point_name(i)};
+		names = registry;
+	}
+	header.point_count = name_count;
+
+	/* count the segments, to size the segment table */
+	for (unsigned int i = 0; i < count; i++)
+		for (pstamp_ring_t *pstamp_ring = logs[i]; pstamp_ring != NULL; pstamp_ring = pstamp_ring->next_ring)
+			segment_count += pstamp_ring_count(pstamp_ring) > 0;
+	segments = calloc(segment_count + 1, sizeof(*segments));
+	points = calloc(name_count + 1, sizeof(*points));
+	if (segments == NULL || points == NULL) goto out;
+
+	/* placeholder header, no magic until it is rewritten with the offsets */
+	memset(header.magic, 0, sizeof(header.magic));
+	iov[0] = (struct iovec){.iov_base = &header, .iov_len = sizeof(header)};
+	if (_pstamp_file_writev(fd, iov, 1) < 0) goto out;
+	memcpy(header.magic, PSTAMP_FILE_MAGIC, sizeof(header.magic));
+
+	header.segment_count = 0;
+	for (unsigned int i = 0; i < count; i++) {
+		for (pstamp_ring_t *pstamp_ring = logs[i]; pstamp_ring != NULL; pstamp_ring = pstamp_ring->next_ring) {
+			unsigned int n = pstamp_ring_count(pstamp_ring);
+			unsigned int first = pstamp_ring_first(pstamp_ring);
+			unsigned int run = min(n, pstamp_ring->size - first);
+			struct pstamp_file_segment *segment = segments + header.segment_count;
+			int iovcnt = 1;
+
+			if (n == 0 || header.segment_count == segment_count)
+				continue;
+			iov[0] = (struct iovec){.iov_base = pstamp_ring->ring + first,
+						.iov_len = sizeof(pstamp_log_t) * run};
+			if (run < n)
+				iov[iovcnt++] = (struct iovec){.iov_base = pstamp_ring->ring,
+							       .iov_len = sizeof(pstamp_log_t) * (n - run)};
+			if (_pstamp_file_writev(fd, iov, iovcnt) < 0) goto out;
+			segment->offset = offset;
+			segment->count = n;
+			segment->log = i;
+			segment->overflows = pstamp_log_overflows(pstamp_ring);
+			segment->logical_processor = pstamp_ring->ring[first].pstamp.logical_processor;
+			offset += sizeof(pstamp_log_t) * n;
+			header.segment_count += 1;
+		}
+	}
+
+	/* tables and names */
+	header.segments_offset = offset;
+	header.points_offset = header.segments_offset + sizeof(*segments) * header.segment_count;
+	header.names_offset = header.points_offset + sizeof(*points) * name_count;
+	for (unsigned int i = 0; i < name_count; i++) {
+		points[i].point = names[i].point;
+		points[i].name = header.names_size;
+		header.names_size += strlen(names[i].name) + 1;
+	}
+	iov[0] = (struct iovec){.iov_base = segments, .iov_len = sizeof(*segments) * header.segment_count};
+	iov[1] = (struct iovec){.iov_base = points, .iov_len = sizeof(*points) * name_count};
+	if (_pstamp_file_writev(fd, iov, 2) < 0) goto out;
+	for (unsigned int i = 0; i < name_count; i++) {
+		iov[0] = (struct iovec){.iov_base = (void *)names[i].name, .iov_len = strlen(names[i].name) + 1};
+		if (_pstamp_file_writev(fd, iov, 1) < 0) goto out;
+	}
+
+	if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) goto out;
+	ret = 0;
+ out:
+	free(segments);
+	free(points);
+	free(registry);
+	return ret;
+}
+
+typedef struct pstamp_file {
+	void *map;
+	size_t length;
+	const struct pstamp_file_header *header;
+	const struct pstamp_file_segment *segments;
+	const struct pstamp_file_point *points;
+	const char *names;
+} pstamp_file_t;
+
+/* true if a table of count items of size at offset lies within length */
+static inline bool _pstamp_file_fits(uint64_t offset, uint64_t count, uint64_t size, size_t length)
+{
+	return offset <= length && count <= (length - offset) / size;
+}
+
+/* map and validate a trace file, returns 0, or -1 with errno set (EINVAL if not a valid trace) */
+static inline int pstamp_file_open(pstamp_file_t *file, const char *path)
+{
+	const struct pstamp_file_header *header;
+	struct stat st;
+	int fd, err;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+	if (fstat(fd, &st) < 0) goto fail;
+	if ((size_t)st.st_size < sizeof(*header)) { errno = EINVAL; goto fail; }
+	file->length = st.st_size;
+	file->map = mmap(NULL, file->length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (file->map == MAP_FAILED) goto fail;
+	close(fd);
+
+	header = file->header = file->map;
+	if (memcmp(header->magic, PSTAMP_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->version != PSTAMP_FILE_VERSION || header->entry_size != sizeof(pstamp_log_t) ||
+	    header->segments_offset < sizeof(*header) || header->points_offset < header->segments_offset ||
+	    header->names_offset < header->points_offset ||
+	    !_pstamp_file_fits(header->segments_offset, header->segment_count, sizeof(*file->segments), file->length) ||
+	    !_pstamp_file_fits(header->points_offset, header->point_count, sizeof(*file->points), file->length) ||
+	    !_pstamp_file_fits(header->names_offset, header->names_size, 1, file->length))
+		goto invalid;
+	file->segments = (const struct pstamp_file_segment *)((char *)file->map + header->segments_offset);
+	file->points = (const struct pstamp_file_point *)((char *)file->map + header->points_offset);
+	file->names = (const char *)file->map + header->names_offset;
+
+	for (unsigned int i = 0; i < header->segment_count; i++)
+		if (!_pstamp_file_fits(file->segments[i].offset, file->segments[i].count, sizeof(pstamp_log_t), file->length))
+			goto invalid;
+	for (unsigned int i = 0; i < header->point_count; i++)
+		if (file->points[i].name >= header->names_size)
+			goto invalid;
+	if (header->names_size > 0 && file->names[header->names_size - 1] != '\0')
+		goto invalid;
+	return 0;
+
+ invalid:
+	munmap(file->map, file->length);
+	errno = EINVAL;
+	return -1;
+ fail:
+	err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+static inline void pstamp_file_close(pstamp_file_t *file)
+{
+	munmap(file->map, file->length);
+}
+
+static inline unsigned int pstamp_file_segment_count(const pstamp_file_t *file)
+{
+	return file->header->segment_count;
+}
+
+/* the entries of a segment, in place in the mapped file, oldest first */
+static inline pstamp_log_t *pstamp_file_entries(const pstamp_file_t *file, unsigned int segment)
+{
+	return (pstamp_log_t *)((char *)file->map + file->segments[segment].offset);
+}
+
+/* name recorded for a point, NULL if the point has no name */
+static inline const char *pstamp_file_point_name(const pstamp_file_t *file, int point)
+{
+	for (unsigned int i = 0; i < file->header->point_count; i++)
+		if (file->points[i].point == point)
+			return file->names + file->points[i].name;
+	return NULL;
+}
+
+/* pstamp_file_point_name as a pstamp_point_lookup_t, arg is the file */
+static inline const char *pstamp_file_lookup_point(int point, const void *file)
+{
+	return pstamp_file_point_name(file, point);
+}
+
+#endif
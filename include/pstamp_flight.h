@@ -0,0 +1,307 @@
+/*
+ * Flight recorder: pstamp rings that run all the time and are kept when a latency trigger fires.
+ *
+ * Copyright (c) 2024 David P. Reed. All rights reserved.
+ */
+#ifndef _PSTAMP_FLIGHT_H_
+#define _PSTAMP_FLIGHT_H_
+/*
+ * Each core logs into its ring as usual, overwriting the oldest entries, so the rings always
+ * hold the recent past and cost nothing to store. The trigger is a hop: an entry at point
+ * "to" whose cause is at point "from", more than threshold cycles after its cause. When one
+ * fires (on whatever core logs it), the recorder notes the trigger time and keeps logging
+ * for window cycles after it, so the dump shows what happened after the anomaly too. Then,
+ * depending on the action:
+ *	STOP		every core stops logging at the end of the window, the rings are frozen
+ *			with the window around the trigger in them, and are dumped
+ *	SNAPSHOT	the rings are copied and dumped as soon as the window ends, logging
+ *			carries on, so what was logged since is dumped too and a busy ring may
+ *			have wrapped past the trigger (entries overwritten while it is copied are
+ *			left out): best effort, with no cost to the logging cores
+ *	EXTEND		from the trigger on, rings extend from a pool instead of wrapping, so the
+ *			whole window is kept, and is dumped at the end of the window
+ * A dump thread waits for the end of the window and passes the entries, up to the end of
+ * the window, to a dump callback, off the logging cores. After a dump the recorder is
+ * rearmed if rearm was set, otherwise it waits for pstamp_flight_rearm. Triggers while
+ * one is being handled are ignored. On rearm an EXTEND log gives its extra rings back to
+ * the pool and starts again in its own ring, emptied and with the OVERWRITE policy.
+ *
+ * On the logging path the recorder adds a load of the (read mostly) trigger time, and the
+ * compare of point and cause point with the trigger's. Each core notices a trigger, or a
+ * rearm, itself, on its next log, so a core's ring is only ever changed by that core. A log
+ * handle (struct pstamp_flight_log) belongs to one core, or one thread, like a ring.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include "pstamp.h"
+#include "tsc_stuff.h"
+
+enum pstamp_flight_action {
+	PSTAMP_FLIGHT_STOP,
+	PSTAMP_FLIGHT_SNAPSHOT,
+	PSTAMP_FLIGHT_EXTEND,
+};
+
+/* a core's log, on its own cache line */
+struct pstamp_flight_log {
+	pstamp_ring_t *ring;		/* ring being logged into */
+	pstamp_ring_t *first;		/* the log's own ring, earlier than ring if extended */
+	unsigned long seen;		/* trigger time this log has acted on, 0 for none */
+} __attribute__((aligned(64)));
+
+typedef struct pstamp_flight {
+	/* read on every log */
+	unsigned long trigger_time;	/* time of the triggering entry, 0 while armed */
+	unsigned long threshold;	/* cycles */
+	unsigned long window;		/* cycles logged after the trigger */
+	int from, to;			/* trigger points */
+	enum pstamp_flight_action action;
+	/* set on trigger, read by the dump thread */
+	bool trigger_ready;
+	pstamp_log_t trigger;		/* the entry that fired */
+	unsigned long triggers;
+	unsigned long dumps;
+	unsigned long dumped;		/* trigger time of the last dump */
+	bool rearm;			/* rearm after each dump */
+	pstamp_pool_t *pool;		/* rings for EXTEND */
+	void (*dump)(struct pstamp_flight *flight, unsigned int log, const struct pstamp_span *span, void *arg);
+	void *arg;
+	unsigned long poll_ns;
+	bool stop;
+	pthread_t thread;
+	pstamp_log_t *copy;		/* dump thread's snapshot of a ring */
+	unsigned int copy_size;		/* entries */
+	unsigned int count;
+	unsigned int capacity;
+	struct pstamp_flight_log logs[];
+} pstamp_flight_t;
+
+/* size of memory for a recorder of n logs, if we want to allocate it dynamically */
+#define pstamp_flight_size(n) (sizeof(pstamp_flight_t) + sizeof(struct pstamp_flight_log) * (n))
+
+/* wait after a window before the dump when poll_ns is 0, for entries being logged as it ended */
+#define PSTAMP_FLIGHT_GRACE_NS 10000UL	/* 10 usec */
+
+/*
+ * set up a recorder for capacity logs, that fires when an entry at point to is more than
+ * threshold cycles after its cause at point from. It must be allocated with 64 byte
+ * alignment, for the logs. dump is called on the dump thread with each span of each log,
+ * and with span NULL when the dump is complete. pool is only needed for EXTEND.
+ */
+static inline void pstamp_flight_init(pstamp_flight_t *flight, unsigned int capacity, int from, int to,
+				      unsigned long threshold, unsigned long window,
+				      enum pstamp_flight_action action, pstamp_pool_t *pool,
+				      void (*dump)(pstamp_flight_t *flight, unsigned int log,
+						   const struct pstamp_span *span, void *arg),
+				      void *arg, unsigned long poll_ns)
+{
+	memset(flight, 0, sizeof(*flight));
+	flight->from = from;
+	flight->to = to;
+	flight->threshold = threshold;
+	flight->window = window;
+	flight->action = action;
+	flight->pool = pool;
+	flight->rearm = true;
+	flight->dump = dump;
+	flight->arg = arg;
+	flight->poll_ns = poll_ns;
+	flight->capacity = capacity;
+}
+
+/* add a log starting with ring, returns its handle or NULL if the recorder is full */
+static inline struct pstamp_flight_log *pstamp_flight_add(pstamp_flight_t *flight, pstamp_ring_t *pstamp_ring)
+{
+	struct pstamp_flight_log *log;
+
+	if (flight->count == flight->capacity)
+		return NULL;
+	log = flight->logs + flight->count++;
+	log->ring = log->first = pstamp_ring;
+	log->seen = 0;
+	return log;
+}
+
+/*
+ * give back the rings an EXTEND log kept for a trigger, once dumped, and go back to logging
+ * into the log's own ring, emptied
+ */
+static inline void _pstamp_flight_reset(pstamp_flight_t *flight, struct pstamp_flight_log *log)
+{
+	pstamp_ring_t *pstamp_ring = log->first->next_ring;
+
+	while (pstamp_ring != NULL) {
+		pstamp_ring_t *next_ring = pstamp_ring->next_ring;
+		pstamp_pool_put(flight->pool, pstamp_ring);
+		pstamp_ring = next_ring;
+	}
+	pstamp_ring_init(log->first, log->first->size);
+	__atomic_store_n(&log->ring, log->first, __ATOMIC_RELEASE);
+}
+
+/*
+ * this log hasn't acted on the current trigger (or rearm) yet, returns false if the entry
+ * is not to be logged because the log is stopped
+ */
+static __attribute__((__noinline__, __unused__)) bool _pstamp_flight_notice(pstamp_flight_t *flight,
+									    struct pstamp_flight_log *log)
+{
+	unsigned long trigger_time = __atomic_load_n(&flight->trigger_time, __ATOMIC_ACQUIRE);
+
+	/* rearmed since the last trigger this log acted on, which has been dumped */
+	if (log->seen != 0 && flight->action == PSTAMP_FLIGHT_EXTEND)
+		_pstamp_flight_reset(flight, log);
+	log->seen = 0;
+	if (trigger_time == 0)
+		return true;
+	switch (flight->action) {
+	case PSTAMP_FLIGHT_STOP:
+		/* keep checking the time until the window ends, then stay stopped until rearmed */
+		return tsc_cycles() - trigger_time <= flight->window;
+	case PSTAMP_FLIGHT_EXTEND:
+		pstamp_ring_policy(log->ring, PSTAMP_EXTEND, flight->pool);
+		break;
+	case PSTAMP_FLIGHT_SNAPSHOT:
+		break;
+	}
+	log->seen = trigger_time;
+	return true;
+}
+
+static __attribute__((__noinline__, __unused__)) void _pstamp_flight_trigger(pstamp_flight_t *flight,
+									     const pstamp_log_t *entry)
+{
+	unsigned long armed = 0;
+
+	if (!__atomic_compare_exchange_n(&flight->trigger_time, &armed, entry->pstamp.time, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return;
+	flight->trigger = *entry;
+	flight->triggers += 1;
+	__atomic_store_n(&flight->trigger_ready, true, __ATOMIC_RELEASE);
+}
+
+/* log into a core's log, and fire the trigger if this entry is a slow enough hop */
+static inline void pstamp_flight_log(pstamp_flight_t *flight, struct pstamp_flight_log *log, int point,
+				     const pstamp_t *cause)
+{
+	pstamp_ring_t *pstamp_ring;
+	const pstamp_log_t *entry;
+
+	if (__atomic_load_n(&flight->trigger_time, __ATOMIC_RELAXED) != log->seen &&
+	    !_pstamp_flight_notice(flight, log))
+		return;
+	pstamp_ring = pstamp_log(log->ring, point, cause);
+	/* the dump thread reads ring, only this core writes it */
+	__atomic_store_n(&log->ring, pstamp_ring, __ATOMIC_RELEASE);
+	if (point == flight->to && cause->point == flight->from) {
+		entry = pstamp_ring->ring + pstamp_ring->next - 1;
+		if (entry->pstamp.time - cause->time > flight->threshold)
+			_pstamp_flight_trigger(flight, entry);
+	}
+}
+
+/* rearm after a dump, when rearm is not set */
+static inline void pstamp_flight_rearm(pstamp_flight_t *flight)
+{
+	__atomic_store_n(&flight->trigger_ready, false, __ATOMIC_RELAXED);
+	__atomic_store_n(&flight->trigger_time, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * pass the entries of a ring up to the end of the window to dump, from a snapshot of the
+ * ring, as its core may still be logging into it
+ */
+static inline void _pstamp_flight_dump_ring(pstamp_flight_t *flight, unsigned int log, pstamp_ring_t *pstamp_ring,
+					    unsigned long end)
+{
+	struct pstamp_span span;
+	unsigned int size = pstamp_ring->size;
+
+	if (size > flight->copy_size) {
+		free(flight->copy);
+		flight->copy = malloc(sizeof(pstamp_log_t) * size);
+		flight->copy_size = flight->copy != NULL ? size : 0;
+		if (flight->copy == NULL)
+			return;
+	}
+	pstamp_ring_snapshot(pstamp_ring, flight->copy, &span);
+	/* entries are in time order, drop those after the window */
+	while (span.count > 0 && span.entries[span.count - 1].pstamp.time > end)
+		span.count -= 1;
+	if (span.count > 0)
+		flight->dump(flight, log, &span, flight->arg);
+}
+
+static inline void _pstamp_flight_dump(pstamp_flight_t *flight, unsigned long trigger_time)
+{
+	/* a snapshot is of the rings as they are, the window has gone on being overwritten */
+	unsigned long end = flight->action == PSTAMP_FLIGHT_SNAPSHOT ? ~0UL : trigger_time + flight->window;
+
+	for (unsigned int i = 0; i < flight->count; i++) {
+		struct pstamp_flight_log *log = flight->logs + i;
+		pstamp_ring_t *last = __atomic_load_n(&log->ring, __ATOMIC_ACQUIRE);
+		pstamp_ring_t *pstamp_ring = flight->action == PSTAMP_FLIGHT_EXTEND ? log->first : last;
+
+		/* EXTEND: the rings kept since the trigger, up to the one being logged into */
+		for (;;) {
+			_pstamp_flight_dump_ring(flight, i, pstamp_ring, end);
+			if (pstamp_ring == last)
+				break;
+			pstamp_ring = pstamp_ring->next_ring;
+		}
+	}
+	flight->dump(flight, 0, NULL, flight->arg);
+}
+
+static inline void *_pstamp_flight_main(void *arg)
+{
+	pstamp_flight_t *flight = (pstamp_flight_t *)arg;
+	struct timespec poll = {.tv_sec = flight->poll_ns / 1000000000UL,
+				.tv_nsec = flight->poll_ns % 1000000000UL};
+	struct timespec grace = flight->poll_ns ? poll : (struct timespec){.tv_nsec = PSTAMP_FLIGHT_GRACE_NS};
+
+	while (!__atomic_load_n(&flight->stop, __ATOMIC_ACQUIRE)) {
+		unsigned long trigger_time = __atomic_load_n(&flight->trigger_time, __ATOMIC_ACQUIRE);
+
+		/* a new trigger whose window has ended, and a grace period for stragglers */
+		if (trigger_time != 0 && trigger_time != flight->dumped &&
+		    __atomic_load_n(&flight->trigger_ready, __ATOMIC_ACQUIRE) &&
+		    tsc_cycles() - trigger_time > flight->window) {
+			if (flight->action != PSTAMP_FLIGHT_SNAPSHOT)
+				nanosleep(&grace, NULL);
+			_pstamp_flight_dump(flight, trigger_time);
+			flight->dumped = trigger_time;
+			flight->dumps += 1;
+			if (flight->rearm)
+				pstamp_flight_rearm(flight);
+			continue;
+		}
+		if (flight->poll_ns)
+			nanosleep(&poll, NULL);
+		else
+			asm volatile("pause;");
+	}
+	free(flight->copy);
+	flight->copy = NULL;
+	flight->copy_size = 0;
+	return NULL;
+}
+
+/* start the dump thread, returns 0 or an error number as pthread_create does */
+static inline int pstamp_flight_start(pstamp_flight_t *flight, const pthread_attr_t *attr)
+{
+	flight->stop = false;
+	return pthread_create(&flight->thread, attr, _pstamp_flight_main, flight);
+}
+
+/* stop the dump thread, a trigger not yet dumped is not dumped */
+static inline int pstamp_flight_stop(pstamp_flight_t *flight)
+{
+	__atomic_store_n(&flight->stop, true, __ATOMIC_RELEASE);
+	return pthread_join(flight->thread, NULL);
+}
+
+#endif
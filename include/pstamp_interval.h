@@ -0,0 +1,83 @@
+/*
+ * Paired begin and end pstamps for intervals, with their durations accumulated as they are logged.
+ *
+ * Copyright (c) 2024 David P. Reed. All rights reserved.
+ */
+#ifndef _PSTAMP_INTERVAL_H_
+#define _PSTAMP_INTERVAL_H_
+/*
+ * Most instrumentation marks where something begins and where it ends. An interval is
+ * logged as two entries:
+ *	begin	at the begin point, with the cause passed in, as any entry
+ *	end	at the end point, with the begin pstamp as its cause
+ * The begin pstamp (point, logical processor, time) identifies the interval, and is what
+ * the caller keeps between the two calls, so the end entry is linked to its begin the way
+ * every pstamp is linked to its cause, and the pair is found by the cause tools
+ * (pstamp_cause.h, the pairs of pstamp_stats.h) with nothing new to parse. Nested work
+ * inside an interval can use the begin pstamp as its cause too.
+ *
+ * The duration, end time less begin time, is known at the end, so it can also be folded
+ * into a running_stats or a log2_hist for the interval there and then, and read while
+ * tracing, without going through the log. That costs a subtraction and the update,
+ * a few cycles for the histogram, a division for the running stats. The interval's
+ * statistics belong to the logging thread, like its ring; keep one per thread and merge.
+ *
+ * (A pstamp_span, in pstamp.h, is something else: a contiguous run of entries in a ring.)
+ */
+
+#include "pstamp.h"
+#include "running_average.h"
+#include "log2_hist.h"
+
+/*
+ * log an entry as pstamp_log and return its pstamp in stamp. A dropped entry still gets a
+ * stamp, so the interval can be timed.
+ */
+static inline pstamp_ring_t *_pstamp_interval_log(pstamp_ring_t *pstamp_ring, int point, const pstamp_t *cause,
+						  pstamp_t *stamp)
+{
+	pstamp_log_t *entry = _pstamp_log_entry(&pstamp_ring, point, cause);
+
+	if (entry != NULL)
+		*stamp = entry->pstamp;
+	else
+		pstamp(point, stamp);
+	return pstamp_ring;
+}
+
+/* log the beginning of an interval, its begin pstamp goes in interval */
+static inline pstamp_ring_t *pstamp_interval_begin(pstamp_ring_t *pstamp_ring, int point, const pstamp_t *cause,
+						   pstamp_t *interval)
+{
+	return _pstamp_interval_log(pstamp_ring, point, cause, interval);
+}
+
+/* log the end of an interval, caused by its begin */
+static inline pstamp_ring_t *pstamp_interval_end(pstamp_ring_t *pstamp_ring, int point, const pstamp_t *interval)
+{
+	return pstamp_log(pstamp_ring, point, interval);
+}
+
+/* log the end of an interval, and add its duration in cycles to stats */
+static inline pstamp_ring_t *pstamp_interval_end_stats(pstamp_ring_t *pstamp_ring, int point,
+						       const pstamp_t *interval, struct running_stats *stats)
+{
+	pstamp_t end;
+
+	pstamp_ring = _pstamp_interval_log(pstamp_ring, point, interval, &end);
+	running_stats_sample(stats, end.time - interval->time);
+	return pstamp_ring;
+}
+
+/* log the end of an interval, and add its duration in cycles to hist */
+static inline pstamp_ring_t *pstamp_interval_end_hist(pstamp_ring_t *pstamp_ring, int point,
+						      const pstamp_t *interval, struct log2_hist *hist)
+{
+	pstamp_t end;
+
+	pstamp_ring = _pstamp_interval_log(pstamp_ring, point, interval, &end);
+	log2_hist_sample(hist, end.time - interval->time);
+	return pstamp_ring;
+}
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * Export of pstamp logs as Chrome Trace Event JSON, for viewing in Perfetto or chrome://tracing.
+ *
+ * Copyright (c) 2024 David P. Reed. All rights reserved.
+ */
+#ifndef _PSTAMP_JSON_H_
+#define _PSTAMP_JSON_H_
+/*
+ * Each entry becomes a zero length slice on the track of its logical processor, named by
+ * its point's name, from PSTAMP_POINT or another lookup such as a trace file's names. If
+ * the entry has a cause, a flow arrow is drawn from the cause's time on the cause's track
+ * to the entry. Timestamps are microseconds (with ns fraction) relative to
+ * a base time, normally the first entry, converted with tsc_cycles_to_ns.
+ *
+ * Output is streamed one entry at a time, and the only state kept is which tracks have been
+ * named, so the size of a capture doesn't matter. Entries are normally taken from
+ * pstamp_merge_next, but the viewers don't require them to be in time order.
+ */
+
+#include <stdio.h>
+#include "pstamp.h"
+#include "pstamp_merge.h"
+#include "pstamp_point.h"
+#include "tsc_freq.h"
+
+#define PSTAMP_JSON_TRACKS 4096		/* CPU numbers, the low 12 bits of a logical processor */
+
+typedef struct pstamp_json {
+	FILE *out;
+	struct tsc_ns_adjust ns_adjust;
+	unsigned long base;		/* time shown as 0 */
+	unsigned long flows;		/* flow ids used */
+	pstamp_point_lookup_t *point_name;
+	const void *point_name_arg;
+	bool first;			/* no event written yet */
+	unsigned long named[PSTAMP_JSON_TRACKS / 64];	/* tracks given a name */
+} pstamp_json_t;
+
+/* start the JSON document */
+static inline void pstamp_json_begin(pstamp_json_t *json, FILE *out, const struct tsc_ns_adjust *ns_adjust,
+				     unsigned long base)
+{
+	json->out = out;
+	json->ns_adjust = *ns_adjust;
+	json->base = base;
+	json->flows = 0;
+	json->point_name = pstamp_point_lookup;
+	json->point_name_arg = NULL;
+	json->first = true;
+	for (unsigned int i = 0; i < PSTAMP_JSON_TRACKS / 64; i++)
+		json->named[i] = 0;
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+}
+
+/* write a time as a microsecond timestamp relative to base, times before base are negative */
+static inline void _pstamp_json_ts(pstamp_json_t *json, unsigned long time)
+{
+	unsigned long ns;
+	const char *sign = "";
+
+	if (time >= json->base) {
+		ns = tsc_cycles_to_ns(time - json->base, &json->ns_adjust);
+	} else {
+		ns = tsc_cycles_to_ns(json->base - time, &json->ns_adjust);
+		sign = "-";
+	}
+	fprintf(json->out, "\"ts\":%s%lu.%03lu", sign, ns / 1000, ns % 1000);
+}
+
+/* name points with lookup instead of the PSTAMP_POINT registry */
+static inline void pstamp_json_point_names(pstamp_json_t *json, pstamp_point_lookup_t *lookup, const void *arg)
+{
+	json->point_name = lookup;
+	json->point_name_arg = arg;
+}
+
+/* write a point's name as a JSON string, "point N" if it has none */
+static inline void _pstamp_json_point(pstamp_json_t *json, int point)
+{
+	const char *name = json->point_name(point, json->point_name_arg);
+
+	if (name == NULL) {
+		fprintf(json->out, "\"point %d\"", point);
+		return;
+	}
+	fputc('"', json->out);
+	for (; *name != '\0'; name++) {
+		unsigned char c = *name;
+		if (c == '"' || c == '\\')
+			fprintf(json->out, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(json->out, "\\u%04x", c);
+		else
+			fputc(c, json->out);
+	}
+	fputc('"', json->out);
+}
+
+static inline void _pstamp_json_separator(pstamp_json_t *json)
+{
+	if (!json->first)
+		fputs(",\n", json->out);
+	json->first = false;
+}
+
+/*
+ * name the track of a logical processor the first time it is used. As rdtscp gives it, the
+ * CPU number is the low 12 bits, and Linux puts the node above them.
+ */
+static inline void _pstamp_json_track(pstamp_json_t *json, int logical_processor)
+{
+	unsigned int cpu = logical_processor & (PSTAMP_JSON_TRACKS - 1);
+
+	if (logical_processor < 0 || (json->named[cpu / 64] & (1UL << (cpu % 64))))
+		return;
+	json->named[cpu / 64] |= 1UL << (cpu % 64);
+	_pstamp_json_separator(json);
+	fprintf(json->out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,"
+		"\"args\":{\"name\":\"cpu %u node %d\"}}", logical_processor, cpu, logical_processor >> 12);
+}
+
+/* write one entry, and a flow from its cause */
+static inline void pstamp_json_event(pstamp_json_t *json, const pstamp_log_t *pstamp_log)
+{
+	const pstamp_t *pstamp = &pstamp_log->pstamp;
+	const pstamp_t *cause = &pstamp_log->cause;
+
+	_pstamp_json_track(json, pstamp->logical_processor);
+	_pstamp_json_separator(json);
+	fputs("{\"name\":", json->out);
+	_pstamp_json_point(json, pstamp->point);
+	fprintf(json->out, ",\"cat\":\"pstamp\",\"ph\":\"X\",\"dur\":0,\"pid\":0,\"tid\":%d,",
+		pstamp->logical_processor);
+	_pstamp_json_ts(json, pstamp->time);
+	fprintf(json->out, ",\"args\":{\"point\":%d,\"cause_point\":%d,\"cause_cpu\":%d}}",
+		pstamp->point, cause->point, cause->logical_processor);
+	if (cause->time == 0)
+		return;
+
+	/* flow from the cause to this entry, the finish binds to the entry's slice */
+	json->flows += 1;
+	_pstamp_json_track(json, cause->logical_processor);
+	fprintf(json->out, ",\n{\"name\":\"cause\",\"cat\":\"cause\",\"ph\":\"s\",\"id\":%lu,\"pid\":0,\"tid\":%d,",
+		json->flows, cause->logical_processor);
+	_pstamp_json_ts(json, cause->time);
+	fprintf(json->out, "},\n{\"name\":\"cause\",\"cat\":\"cause\",\"ph\":\"f\",\"bp\":\"e\",\"id\":%lu,\"pid\":0,\"tid\":%d,",
+		json->flows, pstamp->logical_processor);
+	_pstamp_json_ts(json, pstamp->time);
+	fputs("}", json->out);
+}
+
+/* finish the JSON document, returns 0 or -1 if there was an output error */
+static inline int pstamp_json_end(pstamp_json_t *json)
+{
+	fputs("\n]}\n", json->out);
+	return fflush(json->out) == 0 && !ferror(json->out) ? 0 : -1;
+}
+
+/* export all entries of a merge, times relative to the first entry, returns 0 or -1 on output error */
+static inline int pstamp_json_export(FILE *out, pstamp_merge_t *merge, const struct tsc_ns_adjust *ns_adjust)
+{
+	pstamp_json_t json;
+	pstamp_log_t *entry = pstamp_merge_next(merge);
+
+	pstamp_json_begin(&json, out, ns_adjust, entry != NULL ? entry->pstamp.time : 0);
+	for (; entry != NULL; entry = pstamp_merge_next(merge))
+		pstamp_json_event(&json, entry);
+	return pstamp_json_end(&json);
+}
+
+#endif
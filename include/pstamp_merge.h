@@ -0,0 +1,174 @@
+/*
+ * K-way merge of pstamp logs.
+ *
+ * Copyright (c) 2024 David P. Reed. All rights reserved.
+ */
+#ifndef _PSTAMP_MERGE_H_
+#define _PSTAMP_MERGE_H_
+/*
+ * Each logical processor keeps its own log, a chain of pstamp rings linked by next_ring.
+ * Entries within one log are already in time order, so a timeline of all the logs is
+ * produced by repeatedly taking the oldest entry at the head of any log. The heads are
+ * kept in a binary heap ordered by time, so each entry costs O(log N) compares for N logs,
+ * and the entries are never copied - the merge hands back pointers into the rings.
+ *
+ * A log is walked as contiguous runs of entries: a ring has at most two (the part
+ * before and after its wrap point), then the merge follows next_ring to the next segment.
+ * The same rules as pstamp_log_enumerate apply: only merge logs that are inactive or have
+ * been extended, or entries may be overwritten while they are being merged.
+ */
+
+#include "pstamp.h"
+
+/* position in one log being merged */
+struct pstamp_merge_cursor {
+	unsigned long time;		/* time of entry, the heap key */
+	pstamp_log_t *entry;		/* next entry of this log */
+	pstamp_log_t *limit;		/* end of the run of entries containing entry */
+	pstamp_log_t *wrap;		/* second run in the current ring, NULL if none */
+	pstamp_log_t *wrap_limit;
+	pstamp_ring_t *ring;		/* ring containing entry, followed by its next_ring, or NULL */
+};
+
+typedef struct pstamp_merge {
+	unsigned int count;		/* logs with entries left, in heap[0 .. count-1] */
+	unsigned int capacity;
+	struct pstamp_merge_cursor heap[];
+} pstamp_merge_t;
+
+/* size of memory for merging up to n logs, if we want to allocate it dynamically */
+#define pstamp_merge_size(n) (sizeof(pstamp_merge_t) + sizeof(struct pstamp_merge_cursor) * (n))
+
+static inline void pstamp_merge_init(pstamp_merge_t *merge, unsigned int capacity)
+{
+	merge->count = 0;
+	merge->capacity = capacity;
+}
+
+/* point cursor at the first non-empty ring in the chain starting at ring, false if none */
+static inline bool _pstamp_merge_load(struct pstamp_merge_cursor *cursor, pstamp_ring_t *ring)
+{
+	struct pstamp_span span[2];
+
+	for (; ring != NULL; ring = ring->next_ring) {
+		unsigned int spans = pstamp_ring_spans(ring, span);
+		if (spans == 0)
+			continue;
+		cursor->ring = ring;
+		cursor->entry = span[0].entries;
+		cursor->limit = span[0].entries + span[0].count;
+		if (spans == 2) {
+			cursor->wrap = span[1].entries;
+			cursor->wrap_limit = span[1].entries + span[1].count;
+		} else {
+			cursor->wrap = NULL;
+		}
+		return true;
+	}
+	return false;
+}
+
+/* move cursor to its next run of entries, false if its log is exhausted */
+static inline bool _pstamp_merge_advance(struct pstamp_merge_cursor *cursor)
+{
+	if (cursor->wrap != NULL) {
+		cursor->entry = cursor->wrap;
+		cursor->limit = cursor->wrap_limit;
+		cursor->wrap = NULL;
+		return true;
+	}
+	return cursor->ring != NULL && _pstamp_merge_load(cursor, cursor->ring->next_ring);
+}
+
+/* restore heap order below position i, by moving the hole at i down */
+static inline void _pstamp_merge_sift_down(pstamp_merge_t *merge, unsigned int i)
+{
+	struct pstamp_merge_cursor *heap = merge->heap;
+	struct pstamp_merge_cursor x = heap[i];
+	unsigned int count = merge->count;
+
+	for (unsigned int child = 2 * i + 1; child < count; child = 2 * i + 1) {
+		if (child + 1 < count && heap[child + 1].time < heap[child].time)
+			child += 1;
+		if (heap[child].time >= x.time)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = x;
+}
+
+/* insert a loaded cursor into the heap */
+static inline void _pstamp_merge_push(pstamp_merge_t *merge, struct pstamp_merge_cursor *x)
+{
+	unsigned int i;
+
+	x->time = x->entry->pstamp.time;
+	/* sift up from the new leaf */
+	for (i = merge->count++; i > 0; i = (i - 1) / 2) {
+		unsigned int parent = (i - 1) / 2;
+		if (merge->heap[parent].time <= x->time)
+			break;
+		merge->heap[i] = merge->heap[parent];
+	}
+	merge->heap[i] = *x;
+}
+
+/*
+ * add a log (a chain of rings) to the merge, returns true if added, false if the merge
+ * is already at capacity. Empty logs are accepted and ignored.
+ */
+static inline bool pstamp_merge_add_ring(pstamp_merge_t *merge, pstamp_ring_t *pstamp_ring)
+{
+	struct pstamp_merge_cursor x;
+
+	if (merge->count == merge->capacity)
+		return false;
+	if (_pstamp_merge_load(&x, pstamp_ring))
+		_pstamp_merge_push(merge, &x);
+	return true;
+}
+
+/* add an array of count entries in time order, such as a segment of a trace file */
+static inline bool pstamp_merge_add_entries(pstamp_merge_t *merge, pstamp_log_t *entries, unsigned int count)
+{
+	struct pstamp_merge_cursor x = {.entry = entries, .limit = entries + count};
+
+	if (merge->count == merge->capacity)
+		return false;
+	if (count > 0)
+		_pstamp_merge_push(merge, &x);
+	return true;
+}
+
+/* return the oldest entry not yet returned from all the logs, NULL when all are exhausted */
+static inline pstamp_log_t *pstamp_merge_next(pstamp_merge_t *merge)
+{
+	struct pstamp_merge_cursor *top = merge->heap;
+	pstamp_log_t *entry;
+
+	if (merge->count == 0)
+		return NULL;
+	entry = top->entry;
+	if (++top->entry == top->limit && !_pstamp_merge_advance(top)) {
+		/* this log is done, replace it with the last log in the heap */
+		if (--merge->count == 0)
+			return entry;
+		*top = merge->heap[merge->count];
+	} else {
+		top->time = top->entry->pstamp.time;
+	}
+	_pstamp_merge_sift_down(merge, 0);
+	return entry;
+}
+
+/* enumerate all entries of the merged logs in time order, calling a callback per entry */
+static inline void pstamp_merge_enumerate(pstamp_merge_t *merge, void (*callback)(pstamp_log_t *pstamp_log))
+{
+	pstamp_log_t *entry;
+
+	while ((entry = pstamp_merge_next(merge)) != NULL)
+		callback(entry);
+}
+
+#endif
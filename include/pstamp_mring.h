@@ -0,0 +1,147 @@
+/*
+ * pstamp rings indexed by a monotonic count, logged into with a single store to commit.
+ *
+ * Copyright (c) 2024 David P. Reed. All rights reserved.
+ */
+#ifndef _PSTAMP_MRING_H_
+#define _PSTAMP_MRING_H_
+/*
+ * A pstamp_ring keeps next, limit and seq, and wrapping changes them all, so a log can
+ * only be made by one thread that can't be interrupted by another logger mid-update. An
+ * mring instead keeps one count, head, of all the entries ever logged to it. The next
+ * entry goes at head modulo size (a power of two), the oldest entry still in the ring is
+ * head - size once it has wrapped, and an entry is logged by writing it and then storing
+ * head + 1. Overwriting the oldest entry is just what happens when head passes size, so
+ * the single store of head is the whole commit. That is what lets a log be made in a
+ * restartable sequence (pstamp_rseq.h) or by nested loggers.
+ *
+ * Nested loggers are those that can interrupt a logger of the same ring on the same
+ * thread, such as a signal handler, or a callback run from the middle of logging. If one
+ * logs while pstamp_log is between reading next and storing it, both write the same
+ * entry, and one in the middle of a wrap can leave next and limit inconsistent. The nested
+ * log claims its slot with an xadd to head, without the lock prefix: a single instruction
+ * can't be interrupted halfway on its own CPU, so an interrupting logger claims the next
+ * slot, and a plain xadd costs about as much as the load and store it replaces. It is not
+ * atomic with respect to other CPUs, so the ring must still belong to one thread (use
+ * pstamp_mring_log_shared otherwise). Every logger of such a ring, the thread's own code
+ * too, must use pstamp_mring_log_nested: a pstamp_mring_log interrupted between its load
+ * and store of head stores over the nested logger's claim.
+ *
+ * There is no extension by next_ring and no DROP policy: an mring is a flight recorder of
+ * the last size entries. Readers follow the same rules as for a pstamp_ring, an entry
+ * being logged can overwrite the oldest one while it is read.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include "pstamp.h"
+
+typedef struct pstamp_mring {
+	unsigned long head;	/* entries ever logged, the next goes at head & mask */
+	unsigned int size;	/* a power of two */
+	unsigned int mask;	/* size - 1 */
+	pstamp_log_t ring[];
+} pstamp_mring_t;
+
+/* size of memory for a particular mring size, if we want to allocate it dynamically */
+#define pstamp_mring_size(size) (sizeof(pstamp_mring_t) + sizeof(pstamp_log_t) * (size))
+
+/* initialize an mring in memory, size must be a power of two, returns 0 or -1 if not */
+static inline int pstamp_mring_init(pstamp_mring_t *pstamp_mring, unsigned int size)
+{
+	if (size == 0 || (size & (size - 1)) != 0)
+		return -1;
+	pstamp_mring->head = 0;
+	pstamp_mring->size = size;
+	pstamp_mring->mask = size - 1;
+	return 0;
+}
+
+/* log from the thread that owns the mring */
+static inline void pstamp_mring_log(pstamp_mring_t *pstamp_mring, int point, const pstamp_t *cause)
+{
+	unsigned long head = pstamp_mring->head;
+
+	log_pstamp(point, cause, pstamp_mring->ring + (head & pstamp_mring->mask));
+	/* commit, readers see the entry once they see head */
+	__atomic_store_n(&pstamp_mring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * log from the thread that owns the mring, or a signal handler (or other nested code) of
+ * that thread. Only safe if all logging to the mring, including the thread's own outside
+ * the handler, is through pstamp_mring_log_nested. Head moves before the entry is written,
+ * so a reader may see an entry that is still being written, and an interrupted entry is
+ * completed after the nested one.
+ */
+static inline void pstamp_mring_log_nested(pstamp_mring_t *pstamp_mring, int point, const pstamp_t *cause)
+{
+	unsigned long head = 1;
+
+	asm volatile("xaddq %0, %1" : "+r"(head), "+m"(pstamp_mring->head) : : "memory");
+	log_pstamp(point, cause, pstamp_mring->ring + (head & pstamp_mring->mask));
+}
+
+/*
+ * log from any thread. The slot is claimed with an atomic add, so no two loggers get the
+ * same one, but a reader may see head before the entry is written, and a logger that
+ * falls size entries behind can have its slot overwritten.
+ */
+static inline void pstamp_mring_log_shared(pstamp_mring_t *pstamp_mring, int point, const pstamp_t *cause)
+{
+	unsigned long head = __atomic_fetch_add(&pstamp_mring->head, 1, __ATOMIC_RELAXED);
+
+	log_pstamp(point, cause, pstamp_mring->ring + (head & pstamp_mring->mask));
+}
+
+/* entries overwritten so far */
+static inline unsigned long pstamp_mring_overflows(const pstamp_mring_t *pstamp_mring)
+{
+	unsigned long head = __atomic_load_n(&pstamp_mring->head, __ATOMIC_ACQUIRE);
+	return head > pstamp_mring->size ? head - pstamp_mring->size : 0;
+}
+
+/* number of entries in the mring */
+static inline unsigned int pstamp_mring_count(const pstamp_mring_t *pstamp_mring)
+{
+	unsigned long head = __atomic_load_n(&pstamp_mring->head, __ATOMIC_ACQUIRE);
+	return head < pstamp_mring->size ? head : pstamp_mring->size;
+}
+
+/*
+ * the entries of the mring as at most two contiguous spans, oldest first, as
+ * pstamp_ring_spans. Returns the number of spans filled in, 0 for an empty mring.
+ */
+static inline unsigned int pstamp_mring_spans(pstamp_mring_t *pstamp_mring, struct pstamp_span span[2])
+{
+	/* snapshot head */
+	unsigned long head = __atomic_load_n(&pstamp_mring->head, __ATOMIC_ACQUIRE);
+	unsigned int size = pstamp_mring->size;
+	unsigned int count = head < size ? head : size;
+	unsigned int first = (head - count) & pstamp_mring->mask;
+
+	if (count == 0)
+		return 0;
+	span[0].entries = pstamp_mring->ring + first;
+	if (first + count <= size) {
+		span[0].count = count;
+		return 1;
+	}
+	span[0].count = size - first;
+	span[1].entries = pstamp_mring->ring;
+	span[1].count = first + count - size;
+	return 2;
+}
+
+/* enumerate current entries in order, calling a callback per entry */
+static inline void pstamp_mring_enumerate(pstamp_mring_t *pstamp_mring, void (*callback)(pstamp_log_t *pstamp_log))
+{
+	struct pstamp_span span[2];
+	unsigned int spans = pstamp_mring_spans(pstamp_mring, span);
+
+	for (unsigned int s = 0; s < spans; s++)
+		for (unsigned int i = 0; i < span[s].count; i++)
+			callback(span[s].entries + i);
+}
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Named pstamp points, with small integer ids assigned at link time.
+ *
+ * Copyright (c) 2024 David P. Reed. All rights reserved.
+ */
+#ifndef _PSTAMP_POINT_H_
+#define _PSTAMP_POINT_H_
+/*
+ * A point is declared where it is logged, by name:
+ *
+ *	pstamp_ring = pstamp_log(pstamp_ring, PSTAMP_POINT("rx packet"), &cause);
+ *
+ * Each use puts a static descriptor (name, file, line) in the "pstamp_points" section. The
+ * linker gathers the descriptors of the whole program into one array, bracketed by the
+ * __start_pstamp_points and __stop_pstamp_points symbols it defines, and a point's id is the
+ * index of its descriptor in that array. So ids are small, dense and never collide between
+ * modules, and nothing runs to register them: the id is the difference of two addresses
+ * fixed at link time, a couple of register instructions with no memory access on the
+ * logging path.
+ *
+ * Ids are only meaningful within one executable (or shared object, each has its own
+ * array), and they can change from one build to the next, so a trace must carry its name
+ * table. pstamp_file_write writes this registry when given no names, and the JSON export
+ * and cause report show names from it. Each use of PSTAMP_POINT is its own point, so
+ * declare a point once (in a function, or a macro of its own) if it is logged in several
+ * places. Raw integer points still work but share the same id space.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+struct pstamp_point {
+	const char *name;
+	const char *file;
+	int line;
+} __attribute__((aligned(32)));	/* a power of two, so every descriptor is the same stride */
+
+/* bounds of the array, weak so a program with no points links, and sees an empty array */
+extern const struct pstamp_point __start_pstamp_points[] __attribute__((weak, visibility("hidden")));
+extern const struct pstamp_point __stop_pstamp_points[] __attribute__((weak, visibility("hidden")));
+/*
+ * the same start, not weak, for PSTAMP_POINT. Where there is a point the array exists, and
+ * a non weak symbol can be addressed relative to the code rather than loaded from the GOT.
+ */
+extern const struct pstamp_point _pstamp_points_base[] __asm__("__start_pstamp_points")
+	__attribute__((visibility("hidden")));
+
+/* the id of a point named name, a string literal */
+#define PSTAMP_POINT(name) ({								\
+	static const struct pstamp_point _pstamp_point					\
+		__attribute__((section("pstamp_points"), used)) = {name, __FILE__, __LINE__}; \
+	(int)(&_pstamp_point - _pstamp_points_base);					\
+})
+
+/* number of points in the program, ids are 0 .. count-1 */
+static inline int pstamp_point_count(void)
+{
+	return __stop_pstamp_points - __start_pstamp_points;
+}
+
+/* descriptor of a point, NULL if it isn't a registered id */
+static inline const struct pstamp_point *pstamp_point_get(int point)
+{
+	if (point < 0 || point >= pstamp_point_count())
+		return NULL;
+	return __start_pstamp_points + point;
+}
+
+/* name of a point, NULL if it isn't a registered id */
+static inline const char *pstamp_point_name(int point)
+{
+	const struct pstamp_point *descriptor = pstamp_point_get(point);
+	return descriptor != NULL ? descriptor->name : NULL;
+}
+
+/* id of the first point with a name, -1 if none */
+static inline int pstamp_point_find(const char *name)
+{
+	for (int point = 0; point < pstamp_point_count(); point++)
+		if (strcmp(__start_pstamp_points[point].name, name) == 0)
+			return point;
+	return -1;
+}
+
+/*
+ * a name lookup, for code that prints points from a trace that may not come from this
+ * program (see pstamp_file_lookup_point). This one uses the registry, arg is unused.
+ */
+typedef const char *pstamp_point_lookup_t(int point, const void *arg);
+
+static inline const char *pstamp_point_lookup(int point, const void *arg)
+{
+	(void)arg;
+	return pstamp_point_name(point);
+}
+
+/* the name of a point from lookup, or its number if it has none, formatted in buffer */
+static inline const char *pstamp_point_label(pstamp_point_lookup_t *lookup, const void *arg, int point,
+					     char *buffer, size_t size)
+{
+	const char *name = lookup(point, arg);
+
+	if (name != NULL)
+		return name;
+	snprintf(buffer, size, "%d", point);
+	return buffer;
+}
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ * Per CPU pstamp logging from threads that aren't pinned, with restartable sequences.
+ *
+ * Copyright (c) 2024 David P. Reed. All rights reserved.
+ */
+#ifndef _PSTAMP_RSEQ_H_
+#define _PSTAMP_RSEQ_H_
+/*
+ * A pstamp ring must only be logged into by one thread that no other logger of the ring
+ * can preempt, which in practice means a ring per thread, pinned. Worker threads that the
+ * scheduler moves around would rather log into the ring of whatever CPU they are on, and
+ * that is what a restartable sequence (rseq) allows. glibc (2.35 and later) registers an
+ * rseq area for each thread, in which the kernel keeps the current CPU number, and a
+ * thread can name a short critical section of code there. If the thread is preempted,
+ * migrated or signalled inside the section, the kernel doesn't resume it where it was but
+ * at an abort address, so the section either runs to its end on one CPU without another
+ * thread of that CPU running in between, or has no effect if it didn't reach its commit.
+ *
+ * The rings are mrings (pstamp_mring.h), one per CPU. The section checks the CPU is still
+ * the one whose ring was picked, reads the TSC, writes the entry at head and commits by
+ * storing head + 1, a single store as its last instruction. So the cost is a few more
+ * instructions than pstamp_mring_log, with no atomic instruction. A section that is
+ * aborted may have written its entry into the slot at head without committing it. Once
+ * that ring has wrapped, the slot holds the ring's oldest entry, which is then lost, and
+ * the retry logs into the ring of whatever CPU the thread is on by then.
+ *
+ * The critical section is x86_64 assembly. Plain stores to head are only safe if every
+ * logger of a ring commits in a section on its CPU, so an entry that can't be logged that
+ * way goes into one more, shared, ring with an atomic add to claim the slot, which is
+ * correct but slower: from a thread with no rseq area (older glibc, or rseq disabled by the
+ * glibc.pthread.rseq tunable), or from a CPU beyond the number given at init, which should
+ * cover all CPU numbers, as from get_nprocs_conf.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/rseq.h>
+#include "pstamp.h"
+#include "pstamp_mring.h"
+
+typedef struct pstamp_rseq {
+	unsigned int cpus;
+	unsigned int size;		/* entries per ring */
+	pstamp_mring_t *ring[];		/* indexed by CPU number, then the shared ring */
+} pstamp_rseq_t;
+
+/* size of memory for the rings of n CPUs, if we want to allocate it dynamically */
+#define pstamp_rseq_size(n) (sizeof(pstamp_rseq_t) + sizeof(pstamp_mring_t *) * ((n) + 1))
+
+/*
+ * allocate a ring of size entries (a power of two) for each of cpus CPUs, and the shared
+ * ring, returns 0 or -1
+ */
+static inline int pstamp_rseq_init(pstamp_rseq_t *prs, unsigned int cpus, unsigned int size)
+{
+	prs->cpus = cpus;
+	prs->size = size;
+	for (unsigned int cpu = 0; cpu <= cpus; cpu++)
+		prs->ring[cpu] = NULL;
+	for (unsigned int cpu = 0; cpu <= cpus; cpu++) {
+		void *memory;
+		/* each ring on its own cache lines */
+		if (posix_memalign(&memory, 64, pstamp_mring_size(size)) != 0)
+			goto fail;
+		prs->ring[cpu] = memory;
+		if (pstamp_mring_init(prs->ring[cpu], size) != 0)
+			goto fail;
+	}
+	return 0;
+fail:
+	for (unsigned int cpu = 0; cpu <= cpus; cpu++)
+		free(prs->ring[cpu]);
+	return -1;
+}
+
+static inline void pstamp_rseq_destroy(pstamp_rseq_t *prs)
+{
+	for (unsigned int cpu = 0; cpu <= prs->cpus; cpu++)
+		free(prs->ring[cpu]);
+}
+
+/* the calling thread's rseq area, NULL if it has none */
+static inline struct rseq *pstamp_rseq_area(void)
+{
+	struct rseq *rs;
+
+	if (__rseq_size == 0)
+		return NULL;
+	rs = (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+	if ((int)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED) < 0)
+		return NULL;
+	return rs;
+}
+
+/*
+ * one try at logging into the ring of CPU cpu, in a restartable sequence. Returns false if
+ * the thread is no longer on cpu, or was preempted or signalled before the commit.
+ */
+static inline bool _pstamp_rseq_try(struct rseq *rs, unsigned int cpu, pstamp_mring_t *pstamp_mring, int point,
+				    const pstamp_t *cause)
+{
+	unsigned long c[2];
+
+	__builtin_memcpy(c, cause, sizeof(c));
+	/*
+	 * the descriptor of the section goes in __rseq_cs, the abort code, after the
+	 * signature the kernel checks, in __rseq_failure. Registers rax, rcx and rdx are
+	 * taken by rdtscp.
+	 */
+	asm goto(".pushsection __rseq_cs, \"aw\"\n\t"
+		 ".balign 32\n\t"
+		 "3:\n\t"
+		 ".long 0, 0\n\t"			/* version, flags */
+		 ".quad 1f, 2f - 1f, 4f\n\t"		/* start, length, abort */
+		 ".popsection\n\t"
+		 "leaq 3b(%%rip), %%rax\n\t"
+		 "movq %%rax, %[rseq_cs]\n\t"
+		 "1:\n\t"
+		 "cmpl %[cpu], %[cpu_id]\n\t"
+		 "jnz %l[abort]\n\t"
+		 "movq %[head], %%rsi\n\t"
+		 "movq %%rsi, %%rdi\n\t"
+		 "andq %[mask], %%rdi\n\t"
+		 "shlq $5, %%rdi\n\t"			/* sizeof(pstamp_log_t) */
+		 "addq %[entries], %%rdi\n\t"
+		 "rdtscp\n\t"
+		 "shlq $32, %%rdx\n\t"
+		 "orq %%rdx, %%rax\n\t"
+		 "movl %[point], (%%rdi)\n\t"
+		 "movl %%ecx, 4(%%rdi)\n\t"
+		 "movq %%rax, 8(%%rdi)\n\t"
+		 "movq %[c0], 16(%%rdi)\n\t"
+		 "movq %[c1], 24(%%rdi)\n\t"
+		 "incq %%rsi\n\t"
+		 "movq %%rsi, %[head]\n\t"		/* commit */
+		 "2:\n\t"
+		 ".pushsection __rseq_failure, \"ax\"\n\t"
+		 ".byte 0x0f, 0xb9, 0x3d\n\t"		/* ud1, so the signature disassembles */
+		 ".long %c[sig]\n\t"
+		 "4:\n\t"
+		 "jmp %l[abort]\n\t"
+		 ".popsection\n\t"
+		 :
+		 : [rseq_cs] "m"(rs->rseq_cs), [cpu_id] "m"(rs->cpu_id), [cpu] "r"(cpu),
+		   [head] "m"(pstamp_mring->head), [mask] "r"((unsigned long)pstamp_mring->mask),
+		   [entries] "r"(pstamp_mring->ring), [point] "r"(point), [c0] "r"(c[0]), [c1] "r"(c[1]),
+		   [sig] "i"(RSEQ_SIG)
+		 : "rax", "rcx", "rdx", "rsi", "rdi", "memory", "cc"
+		 : abort);
+	return true;
+abort:
+	return false;
+}
+
+/* log into the ring of the CPU the calling thread is on */
+static inline void pstamp_rseq_log(pstamp_rseq_t *prs, int point, const pstamp_t *cause)
+{
+	struct rseq *rs = pstamp_rseq_area();
+	unsigned int cpu;
+
+	if (rs != NULL) {
+		for (;;) {
+			cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED);
+			/* a CPU beyond the rings can't be checked by the section */
+			if (cpu >= prs->cpus)
+				break;
+			if (_pstamp_rseq_try(rs, cpu, prs->ring[cpu], point, cause))
+				return;
+		}
+	}
+	pstamp_mring_log_shared(prs->ring[prs->cpus], point, cause);
+}
+
+/* ring of a CPU, to read, or the shared ring for cpu == cpus */
+static inline pstamp_mring_t *pstamp_rseq_ring(pstamp_rseq_t *prs, unsigned int cpu)
+{
+	return cpu <= prs->cpus ? prs->ring[cpu] : NULL;
+}
+
+#endif
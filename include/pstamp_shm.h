@@ -0,0 +1,291 @@
+/*
+ * pstamp rings in shared memory, readable by a separate collector process.
+ *
+ * Copyright (c) 2024 David P. Reed. All rights reserved.
+ */
+#ifndef _PSTAMP_SHM_H_
+#define _PSTAMP_SHM_H_
+/*
+ * The producer (the process being traced) makes a memfd holding a small header and a pool
+ * of rings, and logs into rings from that pool just as it would into any other rings. A
+ * collector process opens the same memfd, through /proc/<pid>/fd/<fd> or a descriptor
+ * passed over a unix socket, maps it read only, and reads the rings while the producer
+ * runs, so aggregation, compression and export happen outside the traced process.
+ *
+ * Each log is published in the header as the offset of its first ring. Logs are extended
+ * with rings from the same pool (PSTAMP_EXTEND), so a whole chain lives in the region.
+ * next_ring holds producer addresses, so the header records where the producer mapped the
+ * region and the collector translates. The collector first tries to map the region at the
+ * producer's address, and if it gets it the rings can be used directly, by pstamp_merge_*
+ * or anything else that follows next_ring.
+ *
+ * The collector doesn't trust the region: attach checks the header's layout, and keeps its
+ * own copy of it, so a corrupt (or changed) header or ring pointer ends a log early rather
+ * than taking the collector outside the region.
+ *
+ * The collector has the same view as any other consumer: a ring that is inactive (or has
+ * been extended) won't change, entries of the active ring may be overwritten as they are
+ * read. Rings are never returned to the pool, the collector can't tell the producer it is
+ * done with them, so size the pool for the run, or let the last ring wrap.
+ *
+ * memfd_create and MAP_FIXED_NOREPLACE need _GNU_SOURCE defined before any include.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pstamp.h"
+
+#define PSTAMP_SHM_MAGIC "PSTAMPSH"
+#define PSTAMP_SHM_VERSION 3
+
+struct pstamp_shm_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;		/* offset of the first ring */
+	uint64_t region_size;
+	uint64_t base;			/* address of the region in the producer */
+	uint64_t ring_stride;
+	uint32_t ring_size;		/* entries per ring */
+	uint32_t ring_count;
+	uint32_t log_capacity;
+	uint32_t log_count;		/* logs published, stored with release */
+	uint64_t logs[];		/* offset of the first ring of each log */
+};
+
+typedef struct pstamp_shm {
+	int fd;
+	struct pstamp_shm_header *header;
+	size_t size;
+	intptr_t delta;			/* local address - producer address */
+	/* the header's layout, as made by create or checked by attach */
+	uint64_t base;
+	uint64_t ring_stride;
+	uint32_t header_size;
+	uint32_t ring_size;
+	uint32_t log_capacity;
+	pstamp_pool_t pool;		/* producer only */
+} pstamp_shm_t;
+
+/*
+ * create a region named name (shown in /proc/<pid>/fd) for up to logs logs, with a pool of
+ * count rings of size entries. Returns 0 if ok, -1 with errno set if not.
+ */
+static inline int pstamp_shm_create(pstamp_shm_t *shm, const char *name, unsigned int logs,
+				    unsigned int count, unsigned int size)
+{
+	size_t header_size = (sizeof(struct pstamp_shm_header) + sizeof(uint64_t) * logs + 63) & ~(size_t)63;
+	size_t stride = pstamp_pool_stride(size);
+	struct pstamp_shm_header *header;
+
+	shm->size = header_size + stride * count;
+	shm->delta = 0;
+	shm->fd = memfd_create(name, MFD_CLOEXEC);
+	if (shm->fd == -1) return -1;
+	if (ftruncate(shm->fd, shm->size) == -1) goto fail_close;
+	header = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+	if (header == MAP_FAILED) goto fail_close;
+	if (pstamp_pool_init_memory(&shm->pool, (char *)header + header_size, count, size) != 0) {
+		munmap(header, shm->size);
+		errno = ENOMEM;
+		goto fail_close;
+	}
+	header->version = PSTAMP_SHM_VERSION;
+	header->header_size = header_size;
+	header->region_size = shm->size;
+	header->base = (uintptr_t)header;
+	header->ring_stride = stride;
+	header->ring_size = size;
+	header->ring_count = count;
+	header->log_capacity = logs;
+	header->log_count = 0;
+	shm->base = header->base;
+	shm->ring_stride = stride;
+	shm->header_size = header_size;
+	shm->ring_size = size;
+	shm->log_capacity = logs;
+	/* a collector that sees the magic sees a complete header */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(header->magic, PSTAMP_SHM_MAGIC, sizeof(header->magic));
+	shm->header = header;
+	return 0;
+ fail_close:
+	close(shm->fd);
+	return -1;
+}
+
+/*
+ * start a new log in the region, returns its first ring, set to extend from the region's
+ * pool, or NULL if there are no rings or log slots left.
+ */
+static inline pstamp_ring_t *pstamp_shm_add_log(pstamp_shm_t *shm)
+{
+	struct pstamp_shm_header *header = shm->header;
+	pstamp_ring_t *pstamp_ring = pstamp_pool_get(&shm->pool);
+
+	if (pstamp_ring == NULL)
+		return NULL;
+	pstamp_ring_policy(pstamp_ring, PSTAMP_EXTEND, &shm->pool);
+	/* the pool lock also serializes adding logs */
+	_pstamp_pool_lock(&shm->pool);
+	if (header->log_count == header->log_capacity) {
+		_pstamp_pool_unlock(&shm->pool);
+		pstamp_pool_put(&shm->pool, pstamp_ring);
+		return NULL;
+	}
+	header->logs[header->log_count] = (char *)pstamp_ring - (char *)header;
+	__atomic_store_n(&header->log_count, header->log_count + 1, __ATOMIC_RELEASE);
+	_pstamp_pool_unlock(&shm->pool);
+	return pstamp_ring;
+}
+
+/* producer: unmap and close the region, collectors that have it mapped keep their view */
+static inline void pstamp_shm_destroy(pstamp_shm_t *shm)
+{
+	munmap(shm->header, shm->size);
+	close(shm->fd);
+	pstamp_pool_destroy(&shm->pool);
+}
+
+/* true if the layout of a mapped header describes rings that fit in the region */
+static inline bool _pstamp_shm_valid(const struct pstamp_shm_header *header, size_t size)
+{
+	uint64_t stride = header->ring_stride;
+
+	return header->header_size >= sizeof(*header) && header->header_size <= size &&
+	       header->log_capacity <= (header->header_size - sizeof(*header)) / sizeof(uint64_t) &&
+	       __atomic_load_n(&header->log_count, __ATOMIC_ACQUIRE) <= header->log_capacity &&
+	       header->ring_size > 0 && stride != 0 && stride >= pstamp_ring_size((uint64_t)header->ring_size) &&
+	       stride <= size;
+}
+
+/*
+ * collector: map the region open on fd, read only. Returns 0 if ok, -1 with errno set if not,
+ * EINVAL if fd doesn't hold a pstamp region, or its header's layout is corrupt. The fd can be
+ * closed after.
+ */
+static inline int pstamp_shm_attach(pstamp_shm_t *shm, int fd)
+{
+	struct pstamp_shm_header *header;
+	struct stat st;
+	void *base;
+
+	if (fstat(fd, &st) == -1) return -1;
+	if ((size_t)st.st_size < sizeof(*header)) { errno = EINVAL; return -1; }
+	header = mmap(NULL, sizeof(*header), PROT_READ, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED) return -1;
+	if (memcmp(header->magic, PSTAMP_SHM_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->version != PSTAMP_SHM_VERSION || header->region_size != (uint64_t)st.st_size) {
+		munmap(header, sizeof(*header));
+		errno = EINVAL;
+		return -1;
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	base = (void *)(uintptr_t)header->base;
+	munmap(header, sizeof(*header));
+
+	/* at the producer's address if that is free, so next_ring can be followed directly */
+	shm->size = st.st_size;
+	header = mmap(base, shm->size, PROT_READ, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+	if (header == MAP_FAILED || header != base) {
+		if (header != MAP_FAILED)
+			munmap(header, shm->size);
+		header = mmap(NULL, shm->size, PROT_READ, MAP_SHARED, fd, 0);
+		if (header == MAP_FAILED) return -1;
+	}
+	if (!_pstamp_shm_valid(header, shm->size)) {
+		munmap(header, shm->size);
+		errno = EINVAL;
+		return -1;
+	}
+	shm->fd = -1;
+	shm->header = header;
+	shm->base = header->base;
+	shm->ring_stride = header->ring_stride;
+	shm->header_size = header->header_size;
+	shm->ring_size = header->ring_size;
+	shm->log_capacity = header->log_capacity;
+	shm->delta = (intptr_t)header - (intptr_t)shm->base;
+	return 0;
+}
+
+/* collector: attach to region open on fd in process pid, through /proc */
+static inline int pstamp_shm_attach_pid(pstamp_shm_t *shm, pid_t pid, int fd)
+{
+	char path[64];
+	int ret;
+
+	snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int)pid, fd);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return -1;
+	ret = pstamp_shm_attach(shm, fd);
+	close(fd);
+	return ret;
+}
+
+/* collector: unmap the region */
+static inline void pstamp_shm_detach(pstamp_shm_t *shm)
+{
+	munmap(shm->header, shm->size);
+}
+
+/* true if the region is mapped at the producer's address, so rings can be used directly */
+static inline bool pstamp_shm_direct(const pstamp_shm_t *shm)
+{
+	return shm->delta == 0;
+}
+
+/* number of logs published so far, never more than the region has room for */
+static inline unsigned int pstamp_shm_log_count(const pstamp_shm_t *shm)
+{
+	unsigned int count = __atomic_load_n(&shm->header->log_count, __ATOMIC_ACQUIRE);
+
+	return count < shm->log_capacity ? count : shm->log_capacity;
+}
+
+/* a producer address in the region as a local address, NULL if it isn't a ring in the region */
+static inline pstamp_ring_t *_pstamp_shm_ring(const pstamp_shm_t *shm, uintptr_t address)
+{
+	uint64_t offset = address - shm->base;
+
+	if (address == 0 || offset < shm->header_size || offset > shm->size - shm->ring_stride ||
+	    (offset - shm->header_size) % shm->ring_stride != 0)
+		return NULL;
+	return (pstamp_ring_t *)((char *)shm->header + offset);
+}
+
+/* first ring of log i, i < pstamp_shm_log_count */
+static inline pstamp_ring_t *pstamp_shm_log(const pstamp_shm_t *shm, unsigned int i)
+{
+	return _pstamp_shm_ring(shm, shm->base + shm->header->logs[i]);
+}
+
+/* next ring of a log read from the region, NULL if not extended (yet) */
+static inline pstamp_ring_t *pstamp_shm_next_ring(const pstamp_shm_t *shm, pstamp_ring_t *pstamp_ring)
+{
+	return _pstamp_shm_ring(shm, (uintptr_t)__atomic_load_n(&pstamp_ring->next_ring, __ATOMIC_ACQUIRE));
+}
+
+/* as pstamp_log_enumerate_spans, for log i of the region */
+static inline void pstamp_shm_enumerate_spans(const pstamp_shm_t *shm, unsigned int i,
+					      void (*callback)(const struct pstamp_span *span, void *arg),
+					      void *arg)
+{
+	struct pstamp_span span[2];
+
+	for (pstamp_ring_t *ring = pstamp_shm_log(shm, i); ring != NULL; ring = pstamp_shm_next_ring(shm, ring)) {
+		unsigned int spans;
+		if (ring->size != shm->ring_size)
+			break;
+		spans = pstamp_ring_spans(ring, span);
+		for (unsigned int s = 0; s < spans; s++)
+			callback(span + s, arg);
+	}
+}
+
+#endif
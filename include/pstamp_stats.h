@@ -0,0 +1,300 @@
+/*
+ * Live per point and per point pair statistics, aggregated from pstamp rings as they fill.
+ *
+ * Copyright (c) 2024 David P. Reed. All rights reserved.
+ */
+#ifndef _PSTAMP_STATS_H_
+#define _PSTAMP_STATS_H_
+/*
+ * Keeping every entry (pstamp_cause.h) is fine for a capture, but not for tracing that is
+ * always on. This aggregator reads each ring once, as the consume callback of a drain,
+ * folds its entries into fixed size tables and lets the ring be reused, so memory doesn't
+ * grow with the run. So the statistics cover only the rings the drain has retired: the
+ * entries of the rings still being logged into are counted when they fill, or at
+ * pstamp_drain_flush.
+ *	per point: entries, and the latency from each entry's cause
+ *	per pair of points A -> B: the latency from A to the next entry B of the same chain,
+ *	the entries with the same cause (or from the cause itself for the first entry)
+ *
+ * Finding the previous entry of a chain needs memory of recent chains. A small direct
+ * mapped cache, indexed by a hash of the cause, holds the last entry of each chain. If a
+ * chain's slot was taken by another chain meanwhile, its next entry is counted as a hop
+ * from the cause, so a cache too small for the number of chains in flight blurs pairs
+ * but never makes up a latency. With no cache (chains 0) every hop is from the cause.
+ *
+ * Points are PSTAMP_POINT ids (or small integers) below a limit set at init, pairs go in
+ * a fixed size hash table. Entries whose point or pair doesn't fit are counted as other.
+ *
+ * One thread aggregates. Any thread can take a consistent snapshot at any time with
+ * pstamp_stats_read, into tables made by pstamp_stats_init_snapshot: the tables are
+ * updated under a sequence count, odd while a ring is being aggregated, and the reader
+ * copies them and retries if the count moved.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include "pstamp.h"
+#include "pstamp_point.h"
+#include "running_average.h"
+#include "tsc_freq.h"
+
+struct pstamp_point_stats {
+	unsigned long entries;
+	struct running_stats latency;	/* cycles from cause, for entries with a cause */
+};
+
+struct pstamp_pair_stats {
+	int from, to;			/* from is INT_MIN for an empty slot */
+	struct running_stats latency;	/* cycles */
+};
+
+/* last entry of a recent chain */
+struct pstamp_stats_chain {
+	unsigned long cause_time;	/* 0 for an empty slot */
+	unsigned long cause_key;
+	int point;
+	unsigned long time;
+};
+
+typedef struct pstamp_stats {
+	unsigned int seq;		/* odd while the tables are being updated */
+	unsigned int points;		/* point stats for points 0 .. points-1 */
+	unsigned int pair_capacity;	/* power of two */
+	unsigned int pair_count;
+	unsigned int chain_slots;	/* power of two, or 0 for no chain cache */
+	bool snapshot;			/* a copy for pstamp_stats_read, not aggregated into */
+	unsigned long entries;
+	unsigned long other_points;	/* entries with a point out of range */
+	unsigned long other_pairs;	/* hops not counted because the pair table is full */
+	struct pstamp_point_stats *point;
+	struct pstamp_pair_stats *pair;
+	struct pstamp_stats_chain *chain;
+} pstamp_stats_t;
+
+/* a cause (or any pstamp) as a key, as in pstamp_cause.h */
+#define _pstamp_stats_key(p) (((unsigned long)(unsigned int)(p)->point << 32) | (unsigned int)(p)->logical_processor)
+
+static inline unsigned long _pstamp_stats_hash(unsigned long k1, unsigned long k2)
+{
+	unsigned long h = (k1 ^ (k2 * 0x9e3779b97f4a7c15UL)) * 0xff51afd7ed558ccdUL;
+	return h ^ (h >> 32);
+}
+
+/*
+ * allocate tables for points ids, up to pairs pairs, and chains recent chains (rounded up
+ * to powers of two, none if 0). Returns 0 or -1 if out of memory.
+ */
+static inline int pstamp_stats_init(pstamp_stats_t *stats, unsigned int points, unsigned int pairs,
+				    unsigned int chains)
+{
+	unsigned int pair_capacity = 1, chain_slots = 0;
+
+	/* keep the pair table at most 3/4 full */
+	while (pair_capacity * 3 < pairs * 4)
+		pair_capacity *= 2;
+	if (chains > 0)
+		for (chain_slots = 1; chain_slots < chains; chain_slots *= 2)
+			;
+	memset(stats, 0, sizeof(*stats));
+	stats->points = points;
+	stats->pair_capacity = pair_capacity;
+	stats->chain_slots = chain_slots;
+	stats->point = calloc(points + 1, sizeof(*stats->point));
+	stats->pair = malloc(sizeof(*stats->pair) * pair_capacity);
+	stats->chain = calloc(chain_slots + 1, sizeof(*stats->chain));
+	if (stats->point == NULL || stats->pair == NULL || stats->chain == NULL) {
+		free(stats->point);
+		free(stats->pair);
+		free(stats->chain);
+		return -1;
+	}
+	for (unsigned int i = 0; i < pair_capacity; i++)
+		stats->pair[i].from = INT_MIN;
+	return 0;
+}
+
+/* allocate a snapshot of the same size as stats to pstamp_stats_read into, 0 or -1 */
+static inline int pstamp_stats_init_snapshot(pstamp_stats_t *snapshot, const pstamp_stats_t *stats)
+{
+	if (pstamp_stats_init(snapshot, stats->points, stats->pair_capacity * 3 / 4, 0) != 0)
+		return -1;
+	snapshot->snapshot = true;
+	return 0;
+}
+
+static inline void pstamp_stats_destroy(pstamp_stats_t *stats)
+{
+	free(stats->point);
+	free(stats->pair);
+	free(stats->chain);
+}
+
+/* the pair from -> to, added if new, NULL if the table is full */
+static inline struct pstamp_pair_stats *_pstamp_stats_pair(pstamp_stats_t *stats, int from, int to)
+{
+	unsigned int mask = stats->pair_capacity - 1;
+	unsigned int i = _pstamp_stats_hash(from, to) & mask;
+
+	for (;; i = (i + 1) & mask) {
+		struct pstamp_pair_stats *pair = stats->pair + i;
+		if (pair->from == from && pair->to == to)
+			return pair;
+		if (pair->from == INT_MIN)
+			break;
+	}
+	if ((stats->pair_count + 1) * 4 > stats->pair_capacity * 3)
+		return NULL;
+	stats->pair_count += 1;
+	stats->pair[i].from = from;
+	stats->pair[i].to = to;
+	running_stats_init(&stats->pair[i].latency);
+	return stats->pair + i;
+}
+
+/* fold one entry into the tables, called between _pstamp_stats_begin and _end */
+static inline void _pstamp_stats_add(pstamp_stats_t *stats, const pstamp_log_t *entry)
+{
+	const pstamp_t *cause = &entry->cause;
+	unsigned int point = entry->pstamp.point;
+	struct pstamp_stats_chain *chain;
+	struct pstamp_pair_stats *pair;
+	unsigned long cause_key;
+	int from;
+	unsigned long from_time;
+
+	stats->entries += 1;
+	if (point < stats->points)
+		stats->point[point].entries += 1;
+	else
+		stats->other_points += 1;
+	if (cause->time == 0)
+		return;
+	if (point < stats->points)
+		running_stats_sample(&stats->point[point].latency, entry->pstamp.time - cause->time);
+
+	/* hop from the previous entry of the chain, or from the cause */
+	from = cause->point;
+	from_time = cause->time;
+	if (stats->chain_slots > 0) {
+		cause_key = _pstamp_stats_key(cause);
+		chain = stats->chain + (_pstamp_stats_hash(cause->time, cause_key) & (stats->chain_slots - 1));
+		if (chain->cause_time == cause->time && chain->cause_key == cause_key) {
+			from = chain->point;
+			from_time = chain->time;
+		} else {
+			chain->cause_time = cause->time;
+			chain->cause_key = cause_key;
+		}
+		chain->point = entry->pstamp.point;
+		chain->time = entry->pstamp.time;
+	}
+	pair = _pstamp_stats_pair(stats, from, entry->pstamp.point);
+	if (pair != NULL)
+		running_stats_sample(&pair->latency, entry->pstamp.time - from_time);
+	else
+		stats->other_pairs += 1;
+}
+
+static inline void _pstamp_stats_begin(pstamp_stats_t *stats)
+{
+	__atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void _pstamp_stats_end(pstamp_stats_t *stats)
+{
+	__atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* aggregate count entries in time order, such as a span of a ring */
+static inline void pstamp_stats_add(pstamp_stats_t *stats, const pstamp_log_t *entries, unsigned int count)
+{
+	_pstamp_stats_begin(stats);
+	for (unsigned int i = 0; i < count; i++)
+		_pstamp_stats_add(stats, entries + i);
+	_pstamp_stats_end(stats);
+}
+
+/*
+ * aggregate all the entries of a ring, with the signature of a pstamp_drain consume
+ * callback, arg is the pstamp_stats_t. The ring can be reused after.
+ */
+static inline void pstamp_stats_consume(pstamp_ring_t *pstamp_ring, void *arg)
+{
+	pstamp_stats_t *stats = arg;
+	struct pstamp_span span[2];
+	unsigned int spans = pstamp_ring_spans(pstamp_ring, span);
+
+	_pstamp_stats_begin(stats);
+	for (unsigned int s = 0; s < spans; s++)
+		for (unsigned int i = 0; i < span[s].count; i++)
+			_pstamp_stats_add(stats, span[s].entries + i);
+	_pstamp_stats_end(stats);
+}
+
+/*
+ * copy a consistent snapshot of the statistics into snapshot, made by
+ * pstamp_stats_init_snapshot of stats. Safe while another thread aggregates.
+ */
+static inline void pstamp_stats_read(const pstamp_stats_t *stats, pstamp_stats_t *snapshot)
+{
+	unsigned int seq;
+
+	for (;;) {
+		seq = __atomic_load_n(&stats->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			asm volatile("pause;");
+			continue;
+		}
+		snapshot->entries = stats->entries;
+		snapshot->other_points = stats->other_points;
+		snapshot->other_pairs = stats->other_pairs;
+		snapshot->pair_count = stats->pair_count;
+		memcpy(snapshot->point, stats->point, sizeof(*stats->point) * stats->points);
+		memcpy(snapshot->pair, stats->pair, sizeof(*stats->pair) * stats->pair_capacity);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&stats->seq, __ATOMIC_RELAXED) == seq)
+			break;
+	}
+	snapshot->seq = seq;
+}
+
+static inline double _pstamp_stats_ns(double cycles, const struct tsc_ns_adjust *ns_adjust)
+{
+	return cycles > 0 ? tsc_cycles_to_ns(cycles, ns_adjust) : 0;
+}
+
+/* print the points and pairs of a snapshot (not of live stats), times in ns */
+static inline void pstamp_stats_report(pstamp_stats_t *snapshot, FILE *out, const struct tsc_ns_adjust *ns_adjust)
+{
+	char from_buffer[16], to_buffer[16];
+
+	fprintf(out, "%lu entries, %lu with other points, %lu hops with other pairs\n",
+		snapshot->entries, snapshot->other_points, snapshot->other_pairs);
+	fprintf(out, "\n%16s %10s %10s %10s\n", "point", "entries", "mean", "std");
+	for (unsigned int p = 0; p < snapshot->points; p++) {
+		struct running_stats *latency = &snapshot->point[p].latency;
+		if (snapshot->point[p].entries == 0)
+			continue;
+		fprintf(out, "%16s %10lu %10.0f %10.0f\n",
+			pstamp_point_label(pstamp_point_lookup, NULL, p, from_buffer, sizeof(from_buffer)),
+			snapshot->point[p].entries, _pstamp_stats_ns(running_stats_mean(latency), ns_adjust),
+			_pstamp_stats_ns(sqrt(running_stats_variance(latency)), ns_adjust));
+	}
+	fprintf(out, "\n%16s %16s %10s %10s %10s\n", "from", "to", "hops", "mean", "std");
+	for (unsigned int i = 0; i < snapshot->pair_capacity; i++) {
+		struct pstamp_pair_stats *pair = snapshot->pair + i;
+		if (pair->from == INT_MIN)
+			continue;
+		fprintf(out, "%16s %16s %10lu %10.0f %10.0f\n",
+			pstamp_point_label(pstamp_point_lookup, NULL, pair->from, from_buffer, sizeof(from_buffer)),
+			pstamp_point_label(pstamp_point_lookup, NULL, pair->to, to_buffer, sizeof(to_buffer)),
+			running_stats_samples(&pair->latency),
+			_pstamp_stats_ns(running_stats_mean(&pair->latency), ns_adjust),
+			_pstamp_stats_ns(sqrt(running_stats_variance(&pair->latency)), ns_adjust));
+	}
+}
+
+#endif
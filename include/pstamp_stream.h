@@ -0,0 +1,750 @@
+/*
+ * Streaming pstamp rings to a trace file as they fill, with io_uring, and reading it back after a crash.
+ *
+ * Copyright (c) 2024 David P. Reed. All rights reserved.
+ */
+#ifndef _PSTAMP_STREAM_H_
+#define _PSTAMP_STREAM_H_
+/*
+ * pstamp_file.h writes a whole capture at the end, which is no good for a capture that
+ * runs for hours, or ends in a crash. A stream is written as it goes, one record per
+ * ring, by the consume callback of a pstamp_drain (pstamp_stream_consume) that retains
+ * the rings it is given:
+ *
+ *	header		struct pstamp_stream_header, padded to PSTAMP_STREAM_BLOCK bytes
+ *	records		each a struct pstamp_stream_record and its payload, padded to 64 bytes
+ *		POINTS	the point name table, struct pstamp_file_point per point, then names
+ *		SEGMENT	the entries of one ring, oldest first
+ *		PAD	nothing, fills up to a block boundary
+ *
+ * Every record carries its sequence number and checks of itself and its payload, so a
+ * reader can take the longest run of valid records from the start of the file. Whatever
+ * stops the writer, a crash of the process or a file cut short, the records before the
+ * damage are recovered; records reach the disk itself when the kernel writes them back,
+ * or at pstamp_stream_close, which syncs the file. For the same reason, once a record's
+ * write fails or is short the stream is broken: later rings are counted in errors and
+ * not written, as the reader would stop before them.
+ *
+ * With io_uring, a record is written straight from the ring by a vectored write of its
+ * header and the ring's spans, so the entries are not copied in user space. Writes are
+ * queued and submitted batch rings at a time, and the ring goes back to the pool when its
+ * write completes, as seen on a later call. The io_uring calls are made directly, no
+ * library is needed. If io_uring is not available (an old kernel, a seccomp filter, or
+ * kernel.io_uring_disabled), records are copied into an aligned buffer, batch rings at a
+ * time, and written with pwrite to a file opened O_DIRECT, padded to blocks, so the copy
+ * replaces the one into the page cache. Where O_DIRECT isn't supported (tmpfs) the same
+ * buffer is written without it.
+ *
+ * O_DIRECT needs _GNU_SOURCE defined before the first system header is included.
+ *
+ * Either way, the producers never wait for the disk: only the drain thread does, when the
+ * writes fall behind. Rings waiting for their write are not in the pool, so if the disk
+ * is slower than the producers the pool runs dry, the drain counts starved, and the
+ * producers wrap around their rings and lose entries, as with any drain.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "shorthand.h"
+#include "pstamp.h"
+#include "pstamp_point.h"
+#include "pstamp_file.h"
+#include "tsc_freq.h"
+
+#define PSTAMP_STREAM_MAGIC "PSTAMPST"
+#define PSTAMP_STREAM_VERSION 1
+#define PSTAMP_STREAM_BLOCK 4096		/* alignment for O_DIRECT, and the size of the header */
+#define PSTAMP_STREAM_RECORD 0x52545350U	/* "PSTR" */
+
+enum pstamp_stream_type {
+	PSTAMP_STREAM_POINTS = 1,
+	PSTAMP_STREAM_SEGMENT,
+	PSTAMP_STREAM_PAD,
+};
+
+struct pstamp_stream_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;		/* sizeof(pstamp_log_t) */
+	struct tsc_ns_adjust ns_adjust;
+	uint32_t record_size;		/* sizeof(struct pstamp_stream_record) */
+	uint32_t reserved;
+};
+
+struct pstamp_stream_record {
+	uint32_t magic;			/* PSTAMP_STREAM_RECORD */
+	uint32_t type;			/* enum pstamp_stream_type */
+	uint64_t length;		/* of the record, its payload and padding, a multiple of 64 */
+	uint64_t seq;			/* records are numbered from 0 in file order */
+	uint64_t overflows;		/* of the ring */
+	uint32_t count;			/* entries, or points */
+	int32_t logical_processor;	/* of the first entry */
+	uint64_t payload;		/* bytes */
+	uint64_t payload_check;
+	uint64_t check;			/* of the record up to here */
+};
+
+/* the io_uring rings, mapped */
+struct _pstamp_uring {
+	int fd;
+	unsigned int entries;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+};
+
+/* a ring being written by io_uring, with its record and iovecs, free if pstamp_ring is NULL */
+struct _pstamp_stream_slot {
+	pstamp_ring_t *pstamp_ring;
+	struct pstamp_stream_record record;
+	struct iovec iov[4];		/* record, up to two spans, padding */
+};
+
+typedef struct pstamp_stream {
+	int fd;
+	bool direct;			/* opened O_DIRECT, writes are whole blocks */
+	pstamp_pool_t *pool;		/* where written rings go back */
+	uint64_t offset;		/* of the next write */
+	uint64_t seq;			/* of the next record */
+	unsigned int batch;		/* rings per write or submission */
+	unsigned int pending;		/* rings in the buffer, or queued and not submitted */
+	unsigned int in_flight;		/* io_uring writes submitted and not completed */
+	struct _pstamp_uring uring;	/* fd -1 when not used */
+	struct _pstamp_stream_slot *slots;	/* batch * 2 of them, with io_uring */
+	char *buffer;			/* records to write without io_uring, block aligned */
+	size_t buffer_size;
+	size_t used;
+	unsigned long rings;		/* rings written */
+	unsigned long errors;		/* rings lost to write errors */
+	int error;			/* errno of the first error */
+	bool broken;			/* a record failed to write, nothing after it is readable */
+} pstamp_stream_t;
+
+/* don't use io_uring, even if it is available */
+#define PSTAMP_STREAM_NO_URING 1
+
+/* check of size bytes (a multiple of 8) of data, continuing from check */
+static inline uint64_t _pstamp_stream_check(uint64_t check, const void *data, size_t size)
+{
+	const uint64_t *word = data;
+
+	for (size_t i = 0; i < size / sizeof(uint64_t); i++) {
+		check = (check + word[i]) * 0x9e3779b97f4a7c15UL;
+		check ^= check >> 32;
+	}
+	return check;
+}
+
+static inline uint64_t _pstamp_stream_length(uint64_t payload)
+{
+	return (sizeof(struct pstamp_stream_record) + payload + 63) & ~(uint64_t)63;
+}
+
+/* fill in the rest of a record whose type, count and payload are set */
+static inline void _pstamp_stream_seal(pstamp_stream_t *stream, struct pstamp_stream_record *record,
+				       uint64_t payload_check)
+{
+	record->magic = PSTAMP_STREAM_RECORD;
+	record->length = _pstamp_stream_length(record->payload);
+	record->seq = stream->seq++;
+	record->payload_check = payload_check;
+	record->check = _pstamp_stream_check(0, record, offsetof(struct pstamp_stream_record, check));
+}
+
+/* a segment record for the entries of a ring, returns the number of spans */
+static inline unsigned int _pstamp_stream_segment(pstamp_stream_t *stream, pstamp_ring_t *pstamp_ring,
+						  struct pstamp_stream_record *record, struct pstamp_span span[2])
+{
+	unsigned int spans = pstamp_ring_spans(pstamp_ring, span);
+	uint64_t check = 0;
+
+	memset(record, 0, sizeof(*record));
+	record->type = PSTAMP_STREAM_SEGMENT;
+	for (unsigned int s = 0; s < spans; s++) {
+		record->count += span[s].count;
+		check = _pstamp_stream_check(check, span[s].entries, sizeof(pstamp_log_t) * span[s].count);
+	}
+	record->payload = sizeof(pstamp_log_t) * record->count;
+	record->overflows = pstamp_log_overflows(pstamp_ring);
+	record->logical_processor = spans > 0 ? span[0].entries[0].pstamp.logical_processor : -1;
+	_pstamp_stream_seal(stream, record, check);
+	return spans;
+}
+
+static inline void _pstamp_stream_fail(pstamp_stream_t *stream, int err)
+{
+	if (stream->error == 0)
+		stream->error = err;
+}
+
+/*
+ * io_uring, by system calls
+ */
+
+static inline int _pstamp_uring_setup(struct _pstamp_uring *uring, unsigned int entries)
+{
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+	uring->sq_ring = uring->cq_ring = MAP_FAILED;
+	uring->sqes = MAP_FAILED;
+	uring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (uring->fd < 0)
+		return -1;
+	uring->entries = params.sq_entries;
+	uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		uring->sq_ring_size = uring->cq_ring_size = max(uring->sq_ring_size, uring->cq_ring_size);
+	uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			      uring->fd, IORING_OFF_SQ_RING);
+	if (uring->sq_ring == MAP_FAILED)
+		goto fail;
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		uring->cq_ring = uring->sq_ring;
+	else
+		uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				      uring->fd, IORING_OFF_CQ_RING);
+	if (uring->cq_ring == MAP_FAILED)
+		goto fail;
+	uring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED)
+		goto fail;
+	uring->sq_head = (unsigned int *)((char *)uring->sq_ring + params.sq_off.head);
+	uring->sq_tail = (unsigned int *)((char *)uring->sq_ring + params.sq_off.tail);
+	uring->sq_mask = (unsigned int *)((char *)uring->sq_ring + params.sq_off.ring_mask);
+	uring->sq_array = (unsigned int *)((char *)uring->sq_ring + params.sq_off.array);
+	uring->cq_head = (unsigned int *)((char *)uring->cq_ring + params.cq_off.head);
+	uring->cq_tail = (unsigned int *)((char *)uring->cq_ring + params.cq_off.tail);
+	uring->cq_mask = (unsigned int *)((char *)uring->cq_ring + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)((char *)uring->cq_ring + params.cq_off.cqes);
+	return 0;
+fail:
+	if (uring->sq_ring != MAP_FAILED)
+		munmap(uring->sq_ring, uring->sq_ring_size);
+	if (uring->cq_ring != MAP_FAILED && uring->cq_ring != uring->sq_ring)
+		munmap(uring->cq_ring, uring->cq_ring_size);
+	close(uring->fd);
+	uring->fd = -1;
+	return -1;
+}
+
+static inline void _pstamp_uring_destroy(struct _pstamp_uring *uring)
+{
+	if (uring->fd < 0)
+		return;
+	munmap(uring->sqes, uring->entries * sizeof(struct io_uring_sqe));
+	if (uring->cq_ring != uring->sq_ring)
+		munmap(uring->cq_ring, uring->cq_ring_size);
+	munmap(uring->sq_ring, uring->sq_ring_size);
+	close(uring->fd);
+	uring->fd = -1;
+}
+
+/* queue a vectored write, there is always room as no more than entries are in flight */
+static inline void _pstamp_uring_writev(struct _pstamp_uring *uring, int fd, const struct iovec *iov,
+					unsigned int iovcnt, uint64_t offset, uint64_t user_data)
+{
+	unsigned int tail = *uring->sq_tail;
+	unsigned int index = tail & *uring->sq_mask;
+	struct io_uring_sqe *sqe = uring->sqes + index;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)iov;
+	sqe->len = iovcnt;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+	uring->sq_array[index] = index;
+	/* the kernel sees the entry once it sees tail */
+	__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* submit count queued entries, and wait for at least wait completions */
+static inline int _pstamp_uring_enter(struct _pstamp_uring *uring, unsigned int count, unsigned int wait)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, uring->fd, count, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+/* a completion, false if there is none */
+static inline bool _pstamp_uring_complete(struct _pstamp_uring *uring, uint64_t *user_data, int *res)
+{
+	unsigned int head = *uring->cq_head;
+	struct io_uring_cqe *cqe;
+
+	if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+		return false;
+	cqe = uring->cqes + (head & *uring->cq_mask);
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/*
+ * writing
+ */
+
+/* submit the queued writes */
+static inline void _pstamp_stream_submit(pstamp_stream_t *stream)
+{
+	if (stream->pending == 0)
+		return;
+	if (_pstamp_uring_enter(&stream->uring, stream->pending, 0) < 0) {
+		/* the entries stay queued, and go with the next submission */
+		_pstamp_stream_fail(stream, errno);
+		return;
+	}
+	stream->in_flight += stream->pending;
+	stream->pending = 0;
+}
+
+/* put back the rings whose writes have completed, waiting for one if wait */
+static inline void _pstamp_stream_reap(pstamp_stream_t *stream, bool wait)
+{
+	uint64_t user_data;
+	int res;
+
+	if (wait && _pstamp_uring_enter(&stream->uring, 0, 1) < 0)
+		_pstamp_stream_fail(stream, errno);
+	while (_pstamp_uring_complete(&stream->uring, &user_data, &res)) {
+		struct _pstamp_stream_slot *slot = stream->slots + user_data;
+		if (res < 0 || (uint64_t)res != slot->record.length) {
+			/* a short write leaves a record the reader rejects, and ends the stream there */
+			_pstamp_stream_fail(stream, res < 0 ? -res : EIO);
+			stream->broken = true;
+			stream->errors += 1;
+		} else {
+			stream->rings += 1;
+		}
+		pstamp_pool_put(stream->pool, slot->pstamp_ring);
+		slot->pstamp_ring = NULL;
+		stream->in_flight -= 1;
+	}
+}
+
+/* room for size more bytes in the buffer, and padding, returns 0 or -1 if out of memory */
+static inline int _pstamp_stream_reserve(pstamp_stream_t *stream, size_t size)
+{
+	size_t need = stream->used + size + PSTAMP_STREAM_BLOCK;
+	void *buffer;
+
+	if (need <= stream->buffer_size)
+		return 0;
+	need = (max(need, stream->buffer_size * 2) + PSTAMP_STREAM_BLOCK - 1) & ~(size_t)(PSTAMP_STREAM_BLOCK - 1);
+	if (posix_memalign(&buffer, PSTAMP_STREAM_BLOCK, need) != 0)
+		return -1;
+	memcpy(buffer, stream->buffer, stream->used);
+	free(stream->buffer);
+	stream->buffer = buffer;
+	stream->buffer_size = need;
+	return 0;
+}
+
+/* copy a record and its payload into the buffer, zero padded, the space was reserved */
+static inline void _pstamp_stream_append(pstamp_stream_t *stream, const struct pstamp_stream_record *record,
+					 const struct iovec *payload, unsigned int count)
+{
+	char *to = stream->buffer + stream->used;
+
+	memcpy(to, record, sizeof(*record));
+	to += sizeof(*record);
+	for (unsigned int i = 0; i < count; i++) {
+		memcpy(to, payload[i].iov_base, payload[i].iov_len);
+		to += payload[i].iov_len;
+	}
+	memset(to, 0, stream->buffer + stream->used + record->length - to);
+	stream->used += record->length;
+}
+
+/* write the buffer, padded with a PAD record to whole blocks for O_DIRECT */
+static inline void _pstamp_stream_write(pstamp_stream_t *stream)
+{
+	size_t gap = -stream->used & (PSTAMP_STREAM_BLOCK - 1);
+	size_t done = 0;
+
+	if (stream->direct && gap > 0) {
+		struct pstamp_stream_record pad = {.type = PSTAMP_STREAM_PAD,
+						   .payload = gap - sizeof(pad)};
+		_pstamp_stream_seal(stream, &pad, 0);
+		memcpy(stream->buffer + stream->used, &pad, sizeof(pad));
+		memset(stream->buffer + stream->used + sizeof(pad), 0, pad.payload);
+		stream->used += gap;
+	}
+	while (done < stream->used) {
+		ssize_t n = pwrite(stream->fd, stream->buffer + done, stream->used - done, stream->offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			_pstamp_stream_fail(stream, n < 0 ? errno : EIO);
+			stream->broken = true;
+			stream->errors += stream->pending;
+			stream->rings -= stream->pending;
+			break;
+		}
+		done += n;
+	}
+	stream->offset += stream->used;
+	stream->used = 0;
+	stream->pending = 0;
+}
+
+/*
+ * write a ring as the next record of the stream, then put it back in the pool (at once,
+ * or when its write completes). A pstamp_drain consume callback, arg is the stream, for a
+ * drain set to retain rings.
+ */
+static inline void pstamp_stream_consume(pstamp_ring_t *pstamp_ring, void *arg)
+{
+	pstamp_stream_t *stream = arg;
+	struct pstamp_stream_record record;
+	struct pstamp_span span[2];
+	struct _pstamp_stream_slot *slot = NULL;
+	unsigned int spans, iovcnt = 1;
+	static const char zeros[64];
+
+	if (stream->broken) {
+		stream->errors += 1;
+		pstamp_pool_put(stream->pool, pstamp_ring);
+		return;
+	}
+	if (stream->uring.fd < 0) {
+		struct iovec payload[2];
+		if (_pstamp_stream_reserve(stream, _pstamp_stream_length(sizeof(pstamp_log_t) * pstamp_ring->size)) < 0) {
+			_pstamp_stream_fail(stream, ENOMEM);
+			stream->errors += 1;
+			pstamp_pool_put(stream->pool, pstamp_ring);
+			return;
+		}
+		spans = _pstamp_stream_segment(stream, pstamp_ring, &record, span);
+		for (unsigned int s = 0; s < spans; s++)
+			payload[s] = (struct iovec){.iov_base = span[s].entries,
+						    .iov_len = sizeof(pstamp_log_t) * span[s].count};
+		_pstamp_stream_append(stream, &record, payload, spans);
+		pstamp_pool_put(stream->pool, pstamp_ring);
+		stream->rings += 1;
+		if (++stream->pending >= stream->batch)
+			_pstamp_stream_write(stream);
+		return;
+	}
+
+	/* a free slot, waiting for a write to complete if there is none */
+	_pstamp_stream_reap(stream, false);
+	while (slot == NULL) {
+		for (unsigned int i = 0; i < stream->batch * 2; i++)
+			if (stream->slots[i].pstamp_ring == NULL) {
+				slot = stream->slots + i;
+				break;
+			}
+		if (slot != NULL)
+			break;
+		_pstamp_stream_submit(stream);
+		if (stream->in_flight == 0) {
+			/* the writes queued can't be submitted, there is nothing to wait for */
+			stream->errors += 1;
+			pstamp_pool_put(stream->pool, pstamp_ring);
+			return;
+		}
+		_pstamp_stream_reap(stream, true);
+	}
+	slot->pstamp_ring = pstamp_ring;
+	spans = _pstamp_stream_segment(stream, pstamp_ring, &slot->record, span);
+	slot->iov[0] = (struct iovec){.iov_base = &slot->record, .iov_len = sizeof(slot->record)};
+	for (unsigned int s = 0; s < spans; s++)
+		slot->iov[iovcnt++] = (struct iovec){.iov_base = span[s].entries,
+						     .iov_len = sizeof(pstamp_log_t) * span[s].count};
+	if (slot->record.length > sizeof(slot->record) + slot->record.payload)
+		slot->iov[iovcnt++] = (struct iovec){.iov_base = (void *)zeros,
+						     .iov_len = slot->record.length - sizeof(slot->record) - slot->record.payload};
+	_pstamp_uring_writev(&stream->uring, stream->fd, slot->iov, iovcnt, stream->offset, slot - stream->slots);
+	stream->offset += slot->record.length;
+	if (++stream->pending >= stream->batch)
+		_pstamp_stream_submit(stream);
+}
+
+/*
+ * create a stream file at path, writing rings batch at a time and returning them to pool.
+ * names are written as the point name table, if names is NULL the names of the points
+ * registered with PSTAMP_POINT are written. flags is 0 or PSTAMP_STREAM_NO_URING.
+ * Returns 0, or -1 with errno set.
+ */
+static inline int pstamp_stream_open(pstamp_stream_t *stream, const char *path, pstamp_pool_t *pool,
+				     unsigned int batch, const struct tsc_ns_adjust *ns_adjust,
+				     const struct pstamp_point_name *names, unsigned int name_count, int flags)
+{
+	struct pstamp_stream_header header = {.magic = PSTAMP_STREAM_MAGIC,
+					      .version = PSTAMP_STREAM_VERSION,
+					      .entry_size = sizeof(pstamp_log_t),
+					      .ns_adjust = *ns_adjust,
+					      .record_size = sizeof(struct pstamp_stream_record)};
+	struct pstamp_stream_record record = {.type = PSTAMP_STREAM_POINTS};
+	struct pstamp_file_point *points = NULL;
+	struct iovec *payload = NULL;
+	uint64_t check;
+	int err;
+
+	memset(stream, 0, sizeof(*stream));
+	stream->pool = pool;
+	stream->batch = max(batch, 1U);
+	stream->uring.fd = -1;
+	if (!(flags & PSTAMP_STREAM_NO_URING) && _pstamp_uring_setup(&stream->uring, stream->batch * 2) == 0) {
+		stream->slots = calloc(stream->batch * 2, sizeof(*stream->slots));
+		if (stream->slots == NULL)
+			goto fail;
+		stream->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	} else {
+		stream->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+		stream->direct = stream->fd >= 0;
+		if (stream->fd < 0 && errno == EINVAL)
+			stream->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (stream->fd < 0)
+		goto fail;
+
+	/* the header and the names, written now, as the first block or so */
+	if (names == NULL)
+		name_count = pstamp_point_count();
+	points = calloc(name_count + 1, sizeof(*points));
+	payload = calloc(name_count + 1, sizeof(*payload));
+	if (points == NULL || payload == NULL)
+		goto fail;
+	record.count = name_count;
+	record.payload = sizeof(*points) * name_count;
+	payload[0] = (struct iovec){.iov_base = points, .iov_len = record.payload};
+	for (unsigned int i = 0; i < name_count; i++) {
+		const char *name = names != NULL ? names[i].name : pstamp_point_name(i);
+		points[i].point = names != NULL ? names[i].point : (int)i;
+		points[i].name = record.payload - sizeof(*points) * name_count;
+		payload[i + 1] = (struct iovec){.iov_base = (void *)name, .iov_len = strlen(name) + 1};
+		record.payload += payload[i + 1].iov_len;
+	}
+	record.length = _pstamp_stream_length(record.payload);
+	/* the check is of whole words, the payload is padded with zeros */
+	if (_pstamp_stream_reserve(stream, PSTAMP_STREAM_BLOCK + _pstamp_stream_length(record.payload)) < 0)
+		goto fail;
+	memset(stream->buffer, 0, PSTAMP_STREAM_BLOCK);
+	memcpy(stream->buffer, &header, sizeof(header));
+	stream->used = PSTAMP_STREAM_BLOCK;
+	_pstamp_stream_append(stream, &record, payload, name_count + 1);
+	check = _pstamp_stream_check(0, stream->buffer + PSTAMP_STREAM_BLOCK + sizeof(record),
+				     (record.payload + 7) & ~(uint64_t)7);
+	_pstamp_stream_seal(stream, &record, check);
+	memcpy(stream->buffer + PSTAMP_STREAM_BLOCK, &record, sizeof(record));
+	_pstamp_stream_write(stream);
+	if (stream->error != 0) {
+		errno = stream->error;
+		goto fail;
+	}
+	free(points);
+	free(payload);
+	return 0;
+fail:
+	err = errno;
+	free(points);
+	free(payload);
+	free(stream->buffer);
+	free(stream->slots);
+	if (stream->fd >= 0)
+		close(stream->fd);
+	_pstamp_uring_destroy(&stream->uring);
+	errno = err;
+	return -1;
+}
+
+/*
+ * write what is left, wait for every write, sync the file and close it. Returns 0, or -1
+ * with errno set to the first error of the whole stream.
+ */
+static inline int pstamp_stream_close(pstamp_stream_t *stream)
+{
+	if (stream->uring.fd >= 0) {
+		_pstamp_stream_submit(stream);
+		while (stream->in_flight > 0) {
+			if (_pstamp_uring_enter(&stream->uring, 0, 1) < 0) {
+				_pstamp_stream_fail(stream, errno);
+				break;
+			}
+			_pstamp_stream_reap(stream, false);
+		}
+		/* rings whose writes were never submitted */
+		for (unsigned int i = 0; i < stream->batch * 2; i++)
+			if (stream->slots[i].pstamp_ring != NULL) {
+				pstamp_pool_put(stream->pool, stream->slots[i].pstamp_ring);
+				stream->errors += 1;
+			}
+		_pstamp_uring_destroy(&stream->uring);
+	} else if (stream->used > 0) {
+		_pstamp_stream_write(stream);
+	}
+	if (fdatasync(stream->fd) < 0)
+		_pstamp_stream_fail(stream, errno);
+	close(stream->fd);
+	free(stream->buffer);
+	free(stream->slots);
+	if (stream->error != 0) {
+		errno = stream->error;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * reading, and recovery
+ */
+
+typedef struct pstamp_stream_reader {
+	void *map;
+	size_t length;
+	const struct pstamp_stream_header *header;
+	const struct pstamp_stream_record *points;	/* NULL if there is no name table */
+	uint64_t end;			/* offset just past the last valid record */
+	uint64_t records;		/* valid records */
+	bool truncated;			/* there is more after the valid records, damage or a crash */
+} pstamp_stream_reader_t;
+
+/* a record at offset that is whole and intact, and the seq-th of the file */
+static inline bool _pstamp_stream_valid(const pstamp_stream_reader_t *reader, uint64_t offset, uint64_t seq)
+{
+	const struct pstamp_stream_record *record;
+
+	if (reader->length - offset < sizeof(*record))
+		return false;
+	record = (const struct pstamp_stream_record *)((char *)reader->map + offset);
+	if (record->magic != PSTAMP_STREAM_RECORD || record->seq != seq ||
+	    record->check != _pstamp_stream_check(0, record, offsetof(struct pstamp_stream_record, check)) ||
+	    record->payload > reader->length - offset - sizeof(*record) ||
+	    record->length != _pstamp_stream_length(record->payload) || record->length > reader->length - offset)
+		return false;
+	if (record->type == PSTAMP_STREAM_SEGMENT && record->payload != sizeof(pstamp_log_t) * record->count)
+		return false;
+	if (record->type == PSTAMP_STREAM_POINTS &&
+	    record->payload < sizeof(struct pstamp_file_point) * record->count)
+		return false;
+	return record->type == PSTAMP_STREAM_PAD ||
+	       record->payload_check == _pstamp_stream_check(0, record + 1, (record->payload + 7) & ~(uint64_t)7);
+}
+
+/*
+ * map a stream file, and find the valid records from its start. Returns 0, or -1 with
+ * errno set (EINVAL if the header isn't valid). A stream cut short is not an error, see
+ * truncated.
+ */
+static inline int pstamp_stream_read_open(pstamp_stream_reader_t *reader, const char *path)
+{
+	const struct pstamp_stream_header *header;
+	struct stat st;
+	uint64_t offset = PSTAMP_STREAM_BLOCK;
+	int fd, err;
+
+	memset(reader, 0, sizeof(*reader));
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+	if (fstat(fd, &st) < 0) goto fail;
+	if ((size_t)st.st_size < PSTAMP_STREAM_BLOCK) { errno = EINVAL; goto fail; }
+	reader->length = st.st_size;
+	reader->map = mmap(NULL, reader->length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (reader->map == MAP_FAILED) goto fail;
+	close(fd);
+
+	header = reader->header = reader->map;
+	if (memcmp(header->magic, PSTAMP_STREAM_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->version != PSTAMP_STREAM_VERSION || header->entry_size != sizeof(pstamp_log_t) ||
+	    header->record_size != sizeof(struct pstamp_stream_record)) {
+		munmap(reader->map, reader->length);
+		errno = EINVAL;
+		return -1;
+	}
+	while (_pstamp_stream_valid(reader, offset, reader->records)) {
+		const struct pstamp_stream_record *record =
+			(const struct pstamp_stream_record *)((char *)reader->map + offset);
+		if (record->type == PSTAMP_STREAM_POINTS && reader->points == NULL) {
+			const struct pstamp_file_point *points = (const struct pstamp_file_point *)(record + 1);
+			uint64_t names_size = record->payload - sizeof(*points) * record->count;
+			const char *names = (const char *)(points + record->count);
+			bool ok = names_size > 0 ? names[names_size - 1] == '\0' : record->count == 0;
+			for (unsigned int i = 0; ok && i < record->count; i++)
+				ok = points[i].name < names_size;
+			if (ok)
+				reader->points = record;
+		}
+		offset += record->length;
+		reader->records += 1;
+	}
+	reader->end = offset;
+	/* zeros after the end are what a write that never happened leaves */
+	for (; offset < reader->length && !reader->truncated; offset++)
+		reader->truncated = ((char *)reader->map)[offset] != 0;
+	return 0;
+fail:
+	err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+static inline void pstamp_stream_read_close(pstamp_stream_reader_t *reader)
+{
+	munmap(reader->map, reader->length);
+}
+
+/* the next valid segment record after record (NULL for the first), NULL at the end */
+static inline const struct pstamp_stream_record *pstamp_stream_next(const pstamp_stream_reader_t *reader,
+								    const struct pstamp_stream_record *record)
+{
+	uint64_t offset = record == NULL ? PSTAMP_STREAM_BLOCK :
+		(uint64_t)((const char *)record - (const char *)reader->map) + record->length;
+
+	for (; offset < reader->end; offset += record->length) {
+		record = (const struct pstamp_stream_record *)((char *)reader->map + offset);
+		if (record->type == PSTAMP_STREAM_SEGMENT)
+			return record;
+	}
+	return NULL;
+}
+
+/* the entries of a segment record, in place in the mapped file, oldest first */
+static inline pstamp_log_t *pstamp_stream_entries(const struct pstamp_stream_record *record)
+{
+	return (pstamp_log_t *)(record + 1);
+}
+
+/* name recorded for a point, NULL if the point has no name */
+static inline const char *pstamp_stream_point_name(const pstamp_stream_reader_t *reader, int point)
+{
+	const struct pstamp_file_point *points;
+
+	if (reader->points == NULL)
+		return NULL;
+	points = (const struct pstamp_file_point *)(reader->points + 1);
+	for (unsigned int i = 0; i < reader->points->count; i++)
+		if (points[i].point == point)
+			return (const char *)(points + reader->points->count) + points[i].name;
+	return NULL;
+}
+
+/* pstamp_stream_point_name as a pstamp_point_lookup_t, arg is the reader */
+static inline const char *pstamp_stream_lookup_point(int point, const void *reader)
+{
+	return pstamp_stream_point_name(reader, point);
+}
+
+#endif
@@ -0,0 +1,207 @@
+/*
+ * Conversion of TSC values to CLOCK_MONOTONIC and CLOCK_REALTIME, by a table of anchors.
+ *
+ * Copyright (c) 2024 David P. Reed. All rights reserved.
+ */
+#ifndef _TSC_ANCHOR_H_
+#define _TSC_ANCHOR_H_
+/*
+ * tsc_ns_adjust turns cycles into ns, but a pstamp time is a TSC value with an arbitrary
+ * zero, so it can't be compared with application log times or another host's clock. An
+ * anchor is a TSC value sampled together with CLOCK_MONOTONIC and CLOCK_REALTIME, and a
+ * table of anchors, sampled every second or so while tracing (by a drain thread, say),
+ * maps any TSC value in the traced period to either clock.
+ *
+ * Between two anchors the TSC is converted with the ratio measured over that interval,
+ * as a mult and shift like tsc_ns_adjust, so the conversion follows the clock's rate as
+ * NTP adjusts it. CLOCK_REALTIME is CLOCK_MONOTONIC plus the offset sampled at the start
+ * of the interval, so a step of the wall clock shows as a step, not a slope. Before the
+ * first anchor and after the last, the nearest interval's ratio is extended, or, with a
+ * single anchor, the nominal ratio the table was made with.
+ *
+ * For a perf timestamp rather than a clock_gettime one, see tsc_perf_clock in tsc_freq.h.
+ *
+ * The bulk conversion takes TSC values in time order (as from a ring or a merge), works
+ * out how many fall in each interval, and converts each run in a plain loop of 32x32 bit
+ * multiplies and shifts that the compiler can vectorize. Sampling and conversion must not
+ * run at the same time.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "tsc_stuff.h"
+#include "tsc_freq.h"
+
+struct tsc_anchor {
+	unsigned long tsc;
+	long mono;			/* CLOCK_MONOTONIC, ns */
+	long real;			/* CLOCK_REALTIME, ns */
+	unsigned long width;		/* cycles bracketing the clock reads, the uncertainty */
+	struct tsc_ns_adjust adjust;	/* ratio to the next anchor (or of the interval before) */
+};
+
+typedef struct tsc_anchors {
+	unsigned int count;
+	unsigned int capacity;		/* when full the oldest anchor is dropped */
+	struct tsc_ns_adjust nominal;	/* ratio used with only one anchor */
+	struct tsc_anchor anchor[];
+} tsc_anchors_t;
+
+/* size of memory for a table of n anchors, if we want to allocate it dynamically */
+#define tsc_anchors_size(n) (sizeof(tsc_anchors_t) + sizeof(struct tsc_anchor) * (n))
+
+/* an empty table of room for capacity anchors, returns 0, or -1 with errno EINVAL if capacity is 0 */
+static inline int tsc_anchors_init(tsc_anchors_t *anchors, unsigned int capacity, const struct tsc_ns_adjust *nominal)
+{
+	if (capacity == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	anchors->count = 0;
+	anchors->capacity = capacity;
+	anchors->nominal = *nominal;
+	return 0;
+}
+
+static inline long _tsc_anchor_timespec_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000L + ts->tv_nsec;
+}
+
+/*
+ * add an anchor for now, taking the tightest of a few tries at bracketing both clock reads
+ * between two TSC reads. Returns 0, or -1 if clock_gettime failed.
+ */
+static inline int tsc_anchor_sample(tsc_anchors_t *anchors)
+{
+	struct tsc_anchor best = {.width = ~0UL};
+	struct timespec mono, real;
+	struct tsc_anchor *last;
+
+	for (int i = 0; i < 8; i++) {
+		unsigned long before = tsc_cycles();
+		if (clock_gettime(CLOCK_MONOTONIC, &mono) != 0 || clock_gettime(CLOCK_REALTIME, &real) != 0)
+			return -1;
+		unsigned long after = tsc_cycles();
+		if (after - before < best.width) {
+			best.width = after - before;
+			best.tsc = before + best.width / 2;
+			best.mono = _tsc_anchor_timespec_ns(&mono);
+			best.real = _tsc_anchor_timespec_ns(&real);
+		}
+	}
+	best.adjust = anchors->nominal;
+	if (anchors->count > 0) {
+		last = anchors->anchor + anchors->count - 1;
+		if (best.tsc <= last->tsc || best.mono <= last->mono)
+			return 0;	/* too close to measure a ratio, keep the last */
+		tsc_ns_adjust_ratio(&last->adjust, best.mono - last->mono, best.tsc - last->tsc);
+		best.adjust = last->adjust;
+	}
+	if (anchors->count == anchors->capacity) {
+		memmove(anchors->anchor, anchors->anchor + 1, sizeof(struct tsc_anchor) * (anchors->count - 1));
+		anchors->count -= 1;
+	}
+	anchors->anchor[anchors->count++] = best;
+	return 0;
+}
+
+/* cycles * mult >> shift, with 32x32 bit multiplies, the same result as tsc_cycles_to_ns */
+static inline unsigned long _tsc_anchor_scale(unsigned long cycles, uint32_t mult, uint32_t shift)
+{
+	unsigned long a = (cycles >> 32) * mult;
+	unsigned long b = (cycles & 0xffffffffUL) * mult;
+
+	if (shift <= 32)
+		return (a << (32 - shift)) + (b >> shift);
+	return (a + (b >> 32)) >> (shift - 32);
+}
+
+/* anchor whose interval contains tsc: the last anchor at or before it, or the first */
+static inline const struct tsc_anchor *_tsc_anchor_find(const tsc_anchors_t *anchors, unsigned long tsc)
+{
+	unsigned int low = 0, high = anchors->count;
+
+	/* the answer is in [low, high) */
+	while (high - low > 1) {
+		unsigned int mid = (low + high) / 2;
+		if (anchors->anchor[mid].tsc <= tsc)
+			low = mid;
+		else
+			high = mid;
+	}
+	return anchors->anchor + low;
+}
+
+/* ns of tsc by the anchor's clock, clock is CLOCK_MONOTONIC or CLOCK_REALTIME */
+static inline long _tsc_anchor_ns(const struct tsc_anchor *anchor, clockid_t clock, unsigned long tsc)
+{
+	long base = clock == CLOCK_REALTIME ? anchor->real : anchor->mono;
+
+	if (tsc >= anchor->tsc)
+		return base + _tsc_anchor_scale(tsc - anchor->tsc, anchor->adjust.time_mult, anchor->adjust.time_shift);
+	return base - _tsc_anchor_scale(anchor->tsc - tsc, anchor->adjust.time_mult, anchor->adjust.time_shift);
+}
+
+/* CLOCK_MONOTONIC ns of a TSC value, 0 if there are no anchors */
+static inline long tsc_anchor_mono(const tsc_anchors_t *anchors, unsigned long tsc)
+{
+	if (anchors->count == 0) return 0;
+	return _tsc_anchor_ns(_tsc_anchor_find(anchors, tsc), CLOCK_MONOTONIC, tsc);
+}
+
+/* CLOCK_REALTIME ns of a TSC value, 0 if there are no anchors */
+static inline long tsc_anchor_real(const tsc_anchors_t *anchors, unsigned long tsc)
+{
+	if (anchors->count == 0) return 0;
+	return _tsc_anchor_ns(_tsc_anchor_find(anchors, tsc), CLOCK_REALTIME, tsc);
+}
+
+/*
+ * convert count TSC values, in time order, to ns of clock (CLOCK_MONOTONIC or CLOCK_REALTIME)
+ * into ns. TSC values are stride unsigned longs apart, so they can be read in place from an
+ * array of entries (for pstamp_log_t, tsc = &entries->pstamp.time and stride 4).
+ */
+static inline void tsc_anchor_convert(const tsc_anchors_t *anchors, clockid_t clock,
+				      const unsigned long *tsc, size_t stride, long *ns, size_t count)
+{
+	size_t i = 0;
+
+	if (anchors->count == 0) {
+		memset(ns, 0, sizeof(*ns) * count);
+		return;
+	}
+	while (i < count) {
+		const struct tsc_anchor *anchor = _tsc_anchor_find(anchors, tsc[i * stride]);
+		const unsigned int next = anchor - anchors->anchor + 1;
+		size_t run = count;
+		long base = clock == CLOCK_REALTIME ? anchor->real : anchor->mono;
+		uint32_t mult = anchor->adjust.time_mult, shift = anchor->adjust.time_shift;
+
+		/* values before the first anchor, one at a time */
+		if (tsc[i * stride] < anchor->tsc) {
+			ns[i] = _tsc_anchor_ns(anchor, clock, tsc[i * stride]);
+			i += 1;
+			continue;
+		}
+		/* the run in this interval ends at the first value at or after the next anchor */
+		if (next < anchors->count) {
+			size_t low = i, high = count;
+			unsigned long end = anchors->anchor[next].tsc;
+			while (low < high) {
+				size_t mid = low + (high - low) / 2;
+				if (tsc[mid * stride] < end)
+					low = mid + 1;
+				else
+					high = mid;
+			}
+			run = low;
+		}
+		for (; i < run; i++)
+			ns[i] = base + _tsc_anchor_scale(tsc[i * stride] - anchor->tsc, mult, shift);
+	}
+}
+
+#endif
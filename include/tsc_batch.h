@@ -0,0 +1,175 @@
+/*
+ * Conversion of arrays of TSC cycle counts to ns, with AVX2 or AVX-512 where the CPU has it.
+ *
+ * Copyright (c) 2024 David P. Reed. All rights reserved.
+ */
+#ifndef _TSC_BATCH_H_
+#define _TSC_BATCH_H_
+/*
+ * tsc_cycles_to_ns is a 64x64 bit multiply to 128 bits and a shift, one value at a time,
+ * and no SIMD instruction set has that multiply. But the mult is only 32 bits, so the
+ * product is two 32x32 bit multiplies of the halves of the cycles, which AVX2 does 4 at a
+ * time (vpmuludq) and AVX-512 8 at a time, put back together as _tsc_anchor_scale does:
+ *	a = (cycles >> 32) * mult, b = (cycles & 0xffffffff) * mult
+ *	shift <= 32:	(a << (32 - shift)) + (b >> shift)
+ *	shift > 32:	(a + (b >> 32)) >> (shift - 32)
+ * which is exactly the low 64 bits of the 128 bit result, so every kernel gives the same
+ * bits as tsc_cycles_to_ns. (a + (b >> 32) can't carry out of 64 bits, as a is at most
+ * (2^32 - 1)^2.)
+ *
+ * tsc_batch_to_ns takes the cycles stride unsigned longs apart, less a base, so it reads
+ * an array of counts (stride 1, base 0) or the times of an array of pstamp entries in
+ * place (stride 4, as in pstamp_batch_to_ns), and picks the widest kernel the CPU runs
+ * the first time it is called. The kernels are compiled for their instruction sets with
+ * target attributes, so the rest of the program needs no -mavx flags. "-m tsc" in
+ * clock_speed checks they agree with tsc_cycles_to_ns and measures their throughput.
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <immintrin.h>
+#include "tsc_freq.h"
+
+enum tsc_batch_kernel {
+	TSC_BATCH_SCALAR,
+	TSC_BATCH_AVX2,
+	TSC_BATCH_AVX512,
+};
+#define TSC_BATCH_KERNELS 3
+
+typedef void (*tsc_batch_fn)(const unsigned long *cycles, size_t stride, unsigned long base, unsigned long *ns,
+			     size_t count, const struct tsc_ns_adjust *ns_adjust);
+
+static inline void _tsc_batch_scalar(const unsigned long *cycles, size_t stride, unsigned long base,
+				     unsigned long *ns, size_t count, const struct tsc_ns_adjust *ns_adjust)
+{
+	for (size_t i = 0; i < count; i++)
+		ns[i] = tsc_cycles_to_ns(cycles[i * stride] - base, ns_adjust);
+}
+
+static inline __attribute__((__target__("avx2"))) void
+_tsc_batch_avx2(const unsigned long *cycles, size_t stride, unsigned long base, unsigned long *ns, size_t count,
+		const struct tsc_ns_adjust *ns_adjust)
+{
+	const unsigned int shift = ns_adjust->time_shift;
+	const __m256i mult = _mm256_set1_epi64x(ns_adjust->time_mult);
+	const __m256i vbase = _mm256_set1_epi64x(base);
+	const __m256i index = _mm256_set_epi64x(3 * stride, 2 * stride, stride, 0);
+	const __m128i left = _mm_cvtsi32_si128(32 - shift), right = _mm_cvtsi32_si128(shift);
+	const __m128i high = _mm_cvtsi32_si128(shift - 32);
+	size_t i = 0;
+
+	if (shift >= 64) {
+		_tsc_batch_scalar(cycles, stride, base, ns, count, ns_adjust);
+		return;
+	}
+	for (; i + 4 <= count; i += 4) {
+		const long long *p = (const long long *)(cycles + i * stride);
+		__m256i x = stride == 1 ? _mm256_loadu_si256((const __m256i *)p) : _mm256_i64gather_epi64(p, index, 8);
+		__m256i a, b, r;
+
+		x = _mm256_sub_epi64(x, vbase);
+		b = _mm256_mul_epu32(x, mult);
+		a = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), mult);
+		if (shift <= 32)
+			r = _mm256_add_epi64(_mm256_sll_epi64(a, left), _mm256_srl_epi64(b, right));
+		else
+			r = _mm256_srl_epi64(_mm256_add_epi64(a, _mm256_srli_epi64(b, 32)), high);
+		_mm256_storeu_si256((__m256i *)(ns + i), r);
+	}
+	_tsc_batch_scalar(cycles + i * stride, stride, base, ns + i, count - i, ns_adjust);
+}
+
+static inline __attribute__((__target__("avx512f"))) void
+_tsc_batch_avx512(const unsigned long *cycles, size_t stride, unsigned long base, unsigned long *ns, size_t count,
+		  const struct tsc_ns_adjust *ns_adjust)
+{
+	const unsigned int shift = ns_adjust->time_shift;
+	const __m512i mult = _mm512_set1_epi64(ns_adjust->time_mult);
+	const __m512i vbase = _mm512_set1_epi64(base);
+	const __m512i index = _mm512_set_epi64(7 * stride, 6 * stride, 5 * stride, 4 * stride, 3 * stride,
+					       2 * stride, stride, 0);
+	const __m128i left = _mm_cvtsi32_si128(32 - shift), right = _mm_cvtsi32_si128(shift);
+	const __m128i high = _mm_cvtsi32_si128(shift - 32);
+	size_t i = 0;
+
+	if (shift >= 64) {
+		_tsc_batch_scalar(cycles, stride, base, ns, count, ns_adjust);
+		return;
+	}
+	for (; i + 8 <= count; i += 8) {
+		const long long *p = (const long long *)(cycles + i * stride);
+		__m512i x = stride == 1 ? _mm512_loadu_si512(p) : _mm512_i64gather_epi64(index, p, 8);
+		__m512i a, b, r;
+
+		x = _mm512_sub_epi64(x, vbase);
+		b = _mm512_mul_epu32(x, mult);
+		a = _mm512_mul_epu32(_mm512_srli_epi64(x, 32), mult);
+		if (shift <= 32)
+			r = _mm512_add_epi64(_mm512_sll_epi64(a, left), _mm512_srl_epi64(b, right));
+		else
+			r = _mm512_srl_epi64(_mm512_add_epi64(a, _mm512_srli_epi64(b, 32)), high);
+		_mm512_storeu_si512(ns + i, r);
+	}
+	_tsc_batch_scalar(cycles + i * stride, stride, base, ns + i, count - i, ns_adjust);
+}
+
+/* true if the CPU runs a kernel */
+static inline bool tsc_batch_supported(enum tsc_batch_kernel kernel)
+{
+	switch (kernel) {
+	case TSC_BATCH_AVX2:
+		return __builtin_cpu_supports("avx2");
+	case TSC_BATCH_AVX512:
+		return __builtin_cpu_supports("avx512f");
+	default:
+		return true;
+	}
+}
+
+static inline tsc_batch_fn tsc_batch_kernel_fn(enum tsc_batch_kernel kernel)
+{
+	switch (kernel) {
+	case TSC_BATCH_AVX2:
+		return _tsc_batch_avx2;
+	case TSC_BATCH_AVX512:
+		return _tsc_batch_avx512;
+	default:
+		return _tsc_batch_scalar;
+	}
+}
+
+static inline const char *tsc_batch_kernel_name(enum tsc_batch_kernel kernel)
+{
+	static const char *const names[TSC_BATCH_KERNELS] = {"scalar", "avx2", "avx512"};
+	return (unsigned int)kernel < TSC_BATCH_KERNELS ? names[kernel] : "?";
+}
+
+/* the widest kernel the CPU runs */
+static inline enum tsc_batch_kernel tsc_batch_best(void)
+{
+	if (tsc_batch_supported(TSC_BATCH_AVX512))
+		return TSC_BATCH_AVX512;
+	if (tsc_batch_supported(TSC_BATCH_AVX2))
+		return TSC_BATCH_AVX2;
+	return TSC_BATCH_SCALAR;
+}
+
+/*
+ * convert count cycle counts, stride unsigned longs apart, less base, to ns into ns[0 ..
+ * count-1], the same as tsc_cycles_to_ns of each
+ */
+static inline void tsc_batch_to_ns(const unsigned long *cycles, size_t stride, unsigned long base, unsigned long *ns,
+				   size_t count, const struct tsc_ns_adjust *ns_adjust)
+{
+	static tsc_batch_fn fn;
+	tsc_batch_fn kernel = __atomic_load_n(&fn, __ATOMIC_RELAXED);
+
+	if (kernel == NULL) {
+		kernel = tsc_batch_kernel_fn(tsc_batch_best());
+		__atomic_store_n(&fn, kernel, __ATOMIC_RELAXED);
+	}
+	kernel(cycles, stride, base, ns, count, ns_adjust);
+}
+
+#endif
@@ -0,0 +1,224 @@
+/*
+ * TSC frequency calibration where the perf mmap page isn't available.
+ *
+ * Copyright (c) 2024 David P. Reed. All rights reserved.
+ */
+#ifndef _TSC_CALIBRATE_H_
+#define _TSC_CALIBRATE_H_
+/*
+ * get_tsc_ns_adjust takes the kernel's own mult and shift from a perf event, which fails
+ * where perf_event_open isn't allowed (perf_event_paranoid, seccomp in containers). Then
+ * tsc_calibrate falls back to:
+ *	CPUID	leaf 0x15 gives the TSC as a ratio of the core crystal clock, and the
+ *		crystal's frequency, or leaf 0x16 the base frequency the crystal can be
+ *		worked out from (Intel, Skylake and later). The frequency is nominal: exact
+ *		to the ratio, but as good as the crystal's tolerance, unknown here.
+ *	clock	CLOCK_MONOTONIC_RAW over a number of windows. Each window's ends are a TSC
+ *		value and a clock read bracketed tightly by two TSC reads, and gives a rate.
+ *		Windows whose rate is far from the median (preempted, or migrated, between
+ *		the reads) are rejected, and the rest are averaged. The error bound is two
+ *		standard errors of the mean plus the bracketing uncertainty, in ppm.
+ * Either way the result is the same tsc_ns_adjust mult and shift, so the rest of a program
+ * doesn't care where it came from. The clock calibration takes windows * window_ns.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <cpuid.h>
+#include "tsc_stuff.h"
+#include "tsc_freq.h"
+#include "running_average.h"
+
+enum tsc_calibration_source {
+	TSC_CALIBRATION_PERF,		/* the kernel's constants, from get_tsc_ns_adjust */
+	TSC_CALIBRATION_CPUID,		/* CPUID leaf 0x15, or 0x16 */
+	TSC_CALIBRATION_CLOCK,		/* measured against CLOCK_MONOTONIC_RAW */
+};
+
+struct tsc_calibration {
+	enum tsc_calibration_source source;
+	double hz;			/* TSC frequency */
+	double error_ppm;		/* bound on the error of hz, 0 if nominal or the kernel's */
+	unsigned int windows;		/* clock: windows measured */
+	unsigned int rejected;		/* clock: windows rejected as outliers */
+};
+
+#define TSC_CALIBRATE_WINDOWS 16
+#define TSC_CALIBRATE_WINDOW_NS 10000000UL	/* 10 msec */
+#define TSC_CALIBRATE_MAX_WINDOWS 256
+
+static inline const char *tsc_calibration_source_name(enum tsc_calibration_source source)
+{
+	switch (source) {
+	case TSC_CALIBRATION_PERF:
+		return "perf";
+	case TSC_CALIBRATION_CPUID:
+		return "cpuid";
+	case TSC_CALIBRATION_CLOCK:
+		return "CLOCK_MONOTONIC_RAW";
+	}
+	return "?";
+}
+
+/* TSC frequency from CPUID leaf 0x15 (and 0x16 for the crystal), returns 0, or -1 if not given */
+static inline int tsc_calibrate_cpuid(struct tsc_ns_adjust *ns_adjustp, struct tsc_calibration *calibration)
+{
+	unsigned int max, denominator, numerator, crystal, d, base = 0, b, c;
+	unsigned long hz;
+
+	max = __get_cpuid_max(0, NULL);
+	if (max < 0x15)
+		goto fail;
+	__cpuid(0x15, denominator, numerator, crystal, d);
+	if (denominator == 0 || numerator == 0)
+		goto fail;
+	if (max >= 0x16)
+		__cpuid(0x16, base, b, c, d);
+	if (crystal == 0) {
+		/* base MHz is the crystal times the TSC ratio, near enough */
+		if (base == 0)
+			goto fail;
+		crystal = (unsigned long)base * 1000000UL * denominator / numerator;
+	}
+	hz = (unsigned long)crystal * numerator / denominator;
+	if (tsc_ns_adjust_ratio(ns_adjustp, 1000000000UL, hz) != 0)
+		goto fail;
+	calibration->source = TSC_CALIBRATION_CPUID;
+	calibration->hz = hz;
+	calibration->error_ppm = 0.0;
+	calibration->windows = calibration->rejected = 0;
+	return 0;
+fail:
+	errno = ENOTSUP;
+	return -1;
+}
+
+/* a TSC value and CLOCK_MONOTONIC_RAW read together, and the cycles bracketing them */
+struct _tsc_calibrate_point {
+	unsigned long tsc;
+	long ns;
+	unsigned long width;
+};
+
+static inline int _tsc_calibrate_point(struct _tsc_calibrate_point *point)
+{
+	struct timespec ts;
+
+	point->tsc = 0;
+	point->ns = 0;
+	point->width = ~0UL;
+	for (int i = 0; i < 8; i++) {
+		unsigned long before = tsc_cycles();
+		if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts) != 0)
+			return -1;
+		unsigned long after = tsc_cycles();
+		if (after - before < point->width) {
+			point->width = after - before;
+			point->tsc = before + point->width / 2;
+			point->ns = ts.tv_sec * 1000000000L + ts.tv_nsec;
+		}
+	}
+	return 0;
+}
+
+static inline int _tsc_calibrate_compare(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * TSC frequency measured against CLOCK_MONOTONIC_RAW over windows (at most
+ * TSC_CALIBRATE_MAX_WINDOWS) of window_ns each. Returns 0, or -1 if the clock can't be
+ * read or too few windows agree.
+ */
+static inline int tsc_calibrate_clock(struct tsc_ns_adjust *ns_adjustp, struct tsc_calibration *calibration,
+				      unsigned int windows, unsigned long window_ns)
+{
+	double rate[TSC_CALIBRATE_MAX_WINDOWS], sorted[TSC_CALIBRATE_MAX_WINDOWS], deviation[TSC_CALIBRATE_MAX_WINDOWS];
+	double width[TSC_CALIBRATE_MAX_WINDOWS];
+	struct timespec sleep = {.tv_sec = window_ns / 1000000000UL, .tv_nsec = window_ns % 1000000000UL};
+	struct _tsc_calibrate_point start, end;
+	struct running_stats stats, widths;
+	double median, mad, hz;
+
+	if (windows > TSC_CALIBRATE_MAX_WINDOWS)
+		windows = TSC_CALIBRATE_MAX_WINDOWS;
+	if (windows < 3) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (_tsc_calibrate_point(&start) != 0)
+		return -1;
+	for (unsigned int w = 0; w < windows; w++) {
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &sleep, NULL);
+		if (_tsc_calibrate_point(&end) != 0)
+			return -1;
+		if (end.tsc <= start.tsc || end.ns <= start.ns) {
+			errno = ERANGE;
+			return -1;
+		}
+		/* cycles per ns, and its uncertainty from the bracketing at both ends */
+		rate[w] = (double)(end.tsc - start.tsc) / (end.ns - start.ns);
+		width[w] = (double)(start.width + end.width) / 2 / (end.tsc - start.tsc);
+		sorted[w] = rate[w];
+		start = end;
+	}
+
+	/* reject windows more than 3 (scaled) median absolute deviations from the median */
+	qsort(sorted, windows, sizeof(double), _tsc_calibrate_compare);
+	median = sorted[windows / 2];
+	for (unsigned int w = 0; w < windows; w++)
+		deviation[w] = fabs(rate[w] - median);
+	qsort(deviation, windows, sizeof(double), _tsc_calibrate_compare);
+	mad = 1.4826 * deviation[windows / 2];
+	running_stats_init(&stats);
+	running_stats_init(&widths);
+	for (unsigned int w = 0; w < windows; w++) {
+		if (fabs(rate[w] - median) > 3 * mad + median * 1e-9)
+			continue;
+		running_stats_sample(&stats, rate[w]);
+		running_stats_sample(&widths, width[w]);
+	}
+	if (running_stats_samples(&stats) < (windows + 1) / 2) {
+		errno = ERANGE;
+		return -1;
+	}
+
+	hz = running_stats_mean(&stats) * 1e9;
+	if (tsc_ns_adjust_ratio(ns_adjustp, 1000000000000UL, (unsigned long)(hz * 1000.0 + 0.5)) != 0)
+		return -1;
+	calibration->source = TSC_CALIBRATION_CLOCK;
+	calibration->hz = hz;
+	calibration->windows = windows;
+	calibration->rejected = windows - running_stats_samples(&stats);
+	/* the bracketing, plus two standard errors of the mean where there are enough windows */
+	calibration->error_ppm = running_stats_mean(&widths) * 1e6;
+	if (running_stats_samples(&stats) > 2)
+		calibration->error_ppm += 2e6 * sqrt(running_stats_sample_variance(&stats) / running_stats_samples(&stats)) /
+			running_stats_mean(&stats);
+	return 0;
+}
+
+/*
+ * the best conversion available: the kernel's through perf, CPUID, or a clock calibration
+ * of the default windows. Returns 0, or -1 if all failed.
+ */
+static inline int tsc_calibrate(struct tsc_ns_adjust *ns_adjustp, struct tsc_calibration *calibration)
+{
+	if (get_tsc_ns_adjust(ns_adjustp) == 0) {
+		calibration->source = TSC_CALIBRATION_PERF;
+		calibration->hz = 1e9 * ldexp(1.0, ns_adjustp->time_shift) / ns_adjustp->time_mult;
+		calibration->error_ppm = 0.0;
+		calibration->windows = calibration->rejected = 0;
+		return 0;
+	}
+	if (tsc_calibrate_cpuid(ns_adjustp, calibration) == 0)
+		return 0;
+	return tsc_calibrate_clock(ns_adjustp, calibration, TSC_CALIBRATE_WINDOWS, TSC_CALIBRATE_WINDOW_NS);
+}
+
+#endif
@@ -1,7 +1,7 @@
 /*
  * routines to manage tsc frequency conversion to nsec.
  * get_tsc_ns_adjust is "inlined" so if it isn't used in the source file, it won't be generated.
- * it really won't be called more than once in any use case I can imagine.
+ * it reads the constants once, a process that runs for days should keep a tsc_clock instead.
  *
  * Copyright (c) 2024 David P. Reed. All rights reserved.
  */
@@ -10,6 +10,8 @@
 #define _TSC_FREQ_H_
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include "perf_stuff.h"
@@ -19,9 +21,79 @@ struct tsc_ns_adjust {
 	uint32_t time_shift;
 };
 
-static inline int get_tsc_ns_adjust(struct tsc_ns_adjust *ns_adjustp)
+static inline unsigned long tsc_cycles_to_ns(unsigned long cycles, const struct tsc_ns_adjust *ns_adjustp)
+{
+    __uint128_t result = cycles; /* multiplication exceeds 64 bits */
+    result *= ns_adjustp -> time_mult;
+    result >>= ns_adjustp -> time_shift;
+    return (unsigned long)result;
+}
+
+/*
+ * set mult and shift for the ratio ns / cycles, with the largest shift (up to 32) whose
+ * mult fits in 32 bits, for the most precision. Returns 0, or -1 if the ratio is too large.
+ */
+static inline int tsc_ns_adjust_ratio(struct tsc_ns_adjust *ns_adjustp, unsigned long ns, unsigned long cycles)
+{
+	if (cycles == 0) return -1;
+	for (int shift = 32; shift >= 0; shift--) {
+		__uint128_t mult = ((__uint128_t)ns << shift) / cycles;
+		if (mult <= UINT32_MAX) {
+			ns_adjustp -> time_mult = mult;
+			ns_adjustp -> time_shift = shift;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * the perf clock (the timebase of perf samples) as a function of the TSC:
+ * time = time_zero + cycles * time_mult >> time_shift
+ * where, if the kernel says the TSC is only time_mask wide (cap_user_time_short), cycles is
+ * first taken as the value nearest time_cycles: time_cycles + ((cycles - time_cycles) & time_mask).
+ * time_offset is the same for the enabled and running times of the perf event, kept so the
+ * constants are the kernel's whole set.
+ */
+struct tsc_perf_clock {
+	uint32_t time_mult;
+	uint32_t time_shift;
+	uint64_t time_zero;
+	uint64_t time_offset;
+	uint64_t time_cycles;	/* 0 unless cap_user_time_short */
+	uint64_t time_mask;	/* all ones unless cap_user_time_short */
+};
+
+/* perf clock time in ns of a TSC value, split as in the perf_event_mmap_page comment */
+static inline unsigned long tsc_perf_clock_ns(unsigned long cycles, const struct tsc_perf_clock *clockp)
+{
+	unsigned long quot, rem;
+
+	cycles = clockp -> time_cycles + ((cycles - clockp -> time_cycles) & clockp -> time_mask);
+	quot = cycles >> clockp -> time_shift;
+	rem = cycles & ((1UL << clockp -> time_shift) - 1);
+	return clockp -> time_zero + quot * clockp -> time_mult + ((rem * clockp -> time_mult) >> clockp -> time_shift);
+}
+
+/*
+ * A tsc_clock keeps the perf mmap page of a (never enabled) perf event mapped, for the
+ * life of a process. The kernel rewrites the conversion constants in the page when it
+ * changes them, after a TSC frequency recalibration, on suspend and resume, or when it
+ * stops trusting the TSC (cap_user_time goes to 0), each time under the page's seqlock:
+ * lock is odd while it writes and has moved on when it is done. Constants read once at
+ * startup go stale when that happens, so a long running process should read them through
+ * the clock, which takes a consistent copy each time, or check tsc_clock_changed and
+ * refresh its copy (a tsc_ns_adjust from tsc_clock_adjust) when it returns true.
+ */
+typedef struct tsc_clock {
+	int fd;
+	struct perf_event_mmap_page *pc;
+	uint32_t seq;		/* lock when last checked by tsc_clock_changed */
+} tsc_clock_t;
+
+/* open a clock, returns 0, or -1 if there is no perf event or the TSC can't be used */
+static inline int tsc_clock_open(tsc_clock_t *clock)
 {
-	int ret = 0;
 	struct perf_event_attr pe = {
 		.type = PERF_TYPE_HARDWARE,
 		.size = sizeof(struct perf_event_attr),
@@ -30,25 +102,115 @@ static inline int get_tsc_ns_adjust(struct tsc_ns_adjust *ns_adjustp)
 		.exclude_kernel = 1,
 		.exclude_hv = 1
 	};
-	int fd = perf_event_open(&pe, 0, -1, -1, 0);
-	if (fd == -1) return fd;
-
-	struct perf_event_mmap_page *pc = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, fd, 0);
-	if (pc == NULL) { ret = -1; goto pc_close; }
-	if (!pc->cap_user_time) { ret = -1; goto pc_close; }
-	ns_adjustp -> time_mult = pc->time_mult;
-	ns_adjustp -> time_shift = pc->time_shift;
- pc_close:
-	close(fd);
+
+	clock -> fd = perf_event_open(&pe, 0, -1, -1, 0);
+	if (clock -> fd == -1) return -1;
+	clock -> pc = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, clock -> fd, 0);
+	if (clock -> pc == MAP_FAILED) {
+		close(clock -> fd);
+		return -1;
+	}
+	clock -> seq = __atomic_load_n(&clock -> pc -> lock, __ATOMIC_ACQUIRE);
+	if (!clock -> pc -> cap_user_time) {
+		munmap(clock -> pc, getpagesize());
+		close(clock -> fd);
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return 0;
+}
+
+static inline void tsc_clock_close(tsc_clock_t *clock)
+{
+	munmap(clock -> pc, getpagesize());
+	close(clock -> fd);
+}
+
+/*
+ * a consistent copy of the constants, read under the seqlock. Returns 0, or -1 if the
+ * kernel no longer lets the TSC be used (or, if zero is true, has no time_zero for it).
+ */
+static inline int tsc_clock_read(tsc_clock_t *clock, struct tsc_perf_clock *clockp, bool zero)
+{
+	struct perf_event_mmap_page *pc = clock -> pc;
+	uint32_t seq;
+	bool ok;
+
+	do {
+		seq = __atomic_load_n(&pc->lock, __ATOMIC_ACQUIRE);
+		ok = pc->cap_user_time && (!zero || pc->cap_user_time_zero);
+		clockp -> time_mult = pc->time_mult;
+		clockp -> time_shift = pc->time_shift;
+		clockp -> time_zero = pc->cap_user_time_zero ? pc->time_zero : 0;
+		clockp -> time_offset = pc->time_offset;
+		if (pc->cap_user_time_short) {
+			clockp -> time_cycles = pc->time_cycles;
+			clockp -> time_mask = pc->time_mask;
+		} else {
+			clockp -> time_cycles = 0;
+			clockp -> time_mask = ~0UL;
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&pc->lock, __ATOMIC_RELAXED) != seq || (seq & 1));
+	return ok ? 0 : -1;
+}
+
+/* the current mult and shift, for tsc_cycles_to_ns of intervals. Returns 0 or -1 as tsc_clock_read */
+static inline int tsc_clock_adjust(tsc_clock_t *clock, struct tsc_ns_adjust *ns_adjustp)
+{
+	struct tsc_perf_clock now;
+
+	if (tsc_clock_read(clock, &now, false) != 0) return -1;
+	ns_adjustp -> time_mult = now.time_mult;
+	ns_adjustp -> time_shift = now.time_shift;
+	return 0;
+}
+
+/*
+ * perf clock time in ns of a TSC value into *nsp, with the constants current now. Returns 0,
+ * or -1 as tsc_clock_read if the kernel no longer gives them, and *nsp is not set.
+ */
+static inline int tsc_clock_ns(tsc_clock_t *clock, unsigned long cycles, unsigned long *nsp)
+{
+	struct tsc_perf_clock now;
+
+	if (tsc_clock_read(clock, &now, false) != 0) return -1;
+	*nsp = tsc_perf_clock_ns(cycles, &now);
+	return 0;
+}
+
+/* true if the kernel has updated the constants since the last call (or the open) */
+static inline bool tsc_clock_changed(tsc_clock_t *clock)
+{
+	uint32_t seq = __atomic_load_n(&clock -> pc -> lock, __ATOMIC_ACQUIRE);
+
+	if (seq == clock -> seq) return false;
+	clock -> seq = seq;
+	return true;
+}
+
+/* the current constants, from a clock opened and closed again. Returns 0 or -1 */
+static inline int get_tsc_ns_adjust(struct tsc_ns_adjust *ns_adjustp)
+{
+	tsc_clock_t clock;
+	int ret;
+
+	if (tsc_clock_open(&clock) != 0) return -1;
+	ret = tsc_clock_adjust(&clock, ns_adjustp);
+	tsc_clock_close(&clock);
 	return ret;
 }
 
-static inline unsigned long tsc_cycles_to_ns(unsigned long cycles, const struct tsc_ns_adjust *ns_adjustp)
+/* the current perf clock, as get_tsc_ns_adjust */
+static inline int get_tsc_perf_clock(struct tsc_perf_clock *clockp)
 {
-    __uint128_t result = cycles; /* multiplication exceeds 64 bits */
-    result *= ns_adjustp -> time_mult;
-    result >>= ns_adjustp -> time_shift;
-    return (unsigned long)result;
+	tsc_clock_t clock;
+	int ret;
+
+	if (tsc_clock_open(&clock) != 0) return -1;
+	ret = tsc_clock_read(&clock, clockp, true);
+	tsc_clock_close(&clock);
+	return ret;
 }
 
 #endif
@@ -1,6 +1,9 @@
 #ifndef _TSC_STUFF_H_
 #define _TSC_STUFF_H_
 
+#include <stdbool.h>
+#include <cpuid.h>
+
 static inline unsigned long tsc_cycles(void)
 {
 	
@@ -9,6 +12,107 @@ static inline unsigned long tsc_cycles(void)
 	return (cycles_high << 32) | cycles_low;
 }
 
+/*
+ * Strategies for reading the TSC, which differ in cost and in how the read is ordered
+ * with the instructions around it (the sequence numbers are fixed, so a strategy can be
+ * chosen with -D, as PSTAMP_TSC_STRATEGY in pstamp.h):
+ *	TSC_RDTSCP		waits for earlier instructions to execute, later ones may start
+ *				before it. Also gives the logical processor. What tsc_cycles uses.
+ *	TSC_RDTSC		cheapest, ordered with nothing, may run before earlier work is done
+ *	TSC_LFENCE_RDTSC	lfence first, so it waits for earlier instructions (on AMD only
+ *				if lfence is set to be dispatch serializing, as Linux does)
+ *	TSC_RDTSCP_LFENCE	waits for earlier instructions, and holds back later ones
+ *	TSC_CPUID		cpuid, rdtsc, lfence: fully serialized. cpuid traps to the
+ *				hypervisor in a VM, so it can cost thousands of cycles there
+ *	TSC_SERIALIZE		serialize, rdtsc, lfence: the same, where there is SERIALIZE
+ *	TSC_RDPRU		AMD rdpru of MPERF, which counts at the P0 frequency while the
+ *				core is in C0. Not the TSC: only for intervals, on one core
+ * "-m tsc" in clock_speed measures each one's cost and ordering on the CPU it runs on.
+ */
+enum tsc_strategy {
+	TSC_RDTSCP = 0,
+	TSC_RDTSC = 1,
+	TSC_LFENCE_RDTSC = 2,
+	TSC_RDTSCP_LFENCE = 3,
+	TSC_CPUID = 4,
+	TSC_SERIALIZE = 5,
+	TSC_RDPRU = 6,
+};
+#define TSC_STRATEGIES 7
+
+/* read the TSC (or MPERF) with a strategy, a constant strategy compiles to just its instructions */
+static inline __attribute__((__always_inline__)) unsigned long tsc_read(enum tsc_strategy strategy)
+{
+	unsigned long low, high, aux, b;
+
+	switch (strategy) {
+	case TSC_RDTSC:
+		asm volatile("rdtsc" : "=a"(low), "=d"(high));
+		break;
+	case TSC_LFENCE_RDTSC:
+		asm volatile("lfence; rdtsc" : "=a"(low), "=d"(high) : : "memory");
+		break;
+	case TSC_RDTSCP_LFENCE:
+		asm volatile("rdtscp; lfence" : "=a"(low), "=d"(high), "=c"(aux) : : "memory");
+		break;
+	case TSC_CPUID:
+		asm volatile("cpuid; rdtsc; lfence" : "=a"(low), "=d"(high), "=b"(b), "=c"(aux) : "a"(0), "c"(0)
+			     : "memory");
+		break;
+	case TSC_SERIALIZE:
+		/* serialize, spelled out for assemblers that don't know it */
+		asm volatile(".byte 0x0f, 0x01, 0xe8; rdtsc; lfence" : "=a"(low), "=d"(high) : : "memory");
+		break;
+	case TSC_RDPRU:
+		/* rdpru, ecx 0 selects MPERF */
+		asm volatile(".byte 0x0f, 0x01, 0xfd" : "=a"(low), "=d"(high) : "c"(0));
+		break;
+	case TSC_RDTSCP:
+	default:
+		asm volatile("rdtscp" : "=a"(low), "=d"(high), "=c"(aux));
+		break;
+	}
+	return (high << 32) | low;
+}
+
+/* the logical processor, as rdtscp gives it, by rdpid (Ice Lake, Zen 2 and later) */
+static inline unsigned int tsc_rdpid(void)
+{
+	unsigned long aux;
+	asm volatile("rdpid %0" : "=r"(aux));
+	return aux;
+}
+
+/* true if the CPU has the instructions of a strategy, rdtscp is assumed as by tsc_cycles */
+static inline bool tsc_strategy_supported(enum tsc_strategy strategy)
+{
+	unsigned int a, b, c, d;
+
+	switch (strategy) {
+	case TSC_SERIALIZE:
+		return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (d & (1U << 14));
+	case TSC_RDPRU:
+		return __get_cpuid(0x80000008, &a, &b, &c, &d) && (b & (1U << 4));
+	default:
+		return true;
+	}
+}
+
+static inline bool tsc_rdpid_supported(void)
+{
+	unsigned int a, b, c, d;
+	return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (c & (1U << 22));
+}
+
+static inline const char *tsc_strategy_name(enum tsc_strategy strategy)
+{
+	static const char *const names[TSC_STRATEGIES] = {
+		"rdtscp", "rdtsc", "lfence; rdtsc", "rdtscp; lfence", "cpuid; rdtsc; lfence",
+		"serialize; rdtsc; lfence", "rdpru (MPERF)",
+	};
+	return (unsigned int)strategy < TSC_STRATEGIES ? names[strategy] : "?";
+}
+
 /* ARM processsor cycle count reading */
 #if 0
 static inline unsigned long cycles(void)
@@ -9,16 +9,51 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <math.h>
+#include <limits.h>
 #include <time.h>
 #include <sys/sysinfo.h>
 #include <pthread.h>
 #include "time_math.h"
 #include "tsc_stuff.h"
 #include "tsc_freq.h"
+#include "tsc_calibrate.h"
+#include "tsc_batch.h"
+#include "tsc_anchor.h"
 #include "running_average.h"
 #include "cpulist_parse.h"
 #include "spin_barrier.h"
 #include "pstamp.h"
+#include "pstamp_compact.h"
+#include "pstamp_point.h"
+#include "pstamp_arg.h"
+#include "pstamp_mring.h"
+#include "pstamp_rseq.h"
+#include "pstamp_drain.h"
+#include "pstamp_stream.h"
+#include "pstamp_interval.h"
+#include "log2_hist.h"
+#include "pstamp_shm.h"
+#include "pstamp_batch.h"
+#include "pstamp_stats.h"
+#include "pstamp_merge.h"
+#include "pstamp_cause.h"
+#include "pstamp_json.h"
+#include "pstamp_flight.h"
+#include "pstamp_file.h"
+#include <sys/mman.h>
+
+/*
+ * how the harness below reads the TSC, a tsc_strategy from tsc_stuff.h. "-m tsc" reports
+ * which strategies order correctly with the code timed, and the cheapest of them.
+ */
+#ifndef BENCH_TSC_STRATEGY
+#define BENCH_TSC_STRATEGY TSC_RDTSCP
+#endif
+
+static inline unsigned long bench_cycles(void)
+{
+	return tsc_read(BENCH_TSC_STRATEGY);
+}
 
 /*
  * macro that takes an asm instruction and clobbered regs and repeats it 10 times counting
@@ -33,9 +68,9 @@
 	{       unsigned long begin, fini, elapsed_cycles, nsec;	\
 		double cycles_per, nsec_per;				\
 		char output[64];					\
-		begin = tsc_cycles();					\
+		begin = bench_cycles();					\
 		TWENTYTIMES(INSTRUCTION(inst ";", b1, b2, __VA_ARGS__)); \
-		fini = tsc_cycles();					\
+		fini = bench_cycles();					\
 		elapsed_cycles = fini - begin;				\
 		elapsed_cycles -= min(elapsed_cycles, overhead);	\
 		nsec = tsc_cycles_to_ns(elapsed_cycles, &ns_adjust);	\
@@ -49,9 +84,9 @@
 	{								\
 		unsigned long begin, fini, elapsed, nsec;		\
 		double cycles_per, nsec_per;				\
-		begin = tsc_cycles();					\
+		begin = bench_cycles();					\
 		TWENTYTIMES(line);					\
-		fini = tsc_cycles();					\
+		fini = bench_cycles();					\
 		elapsed = (fini - begin);				\
 		elapsed -= min(elapsed, overhead);			\
 		nsec = tsc_cycles_to_ns(elapsed, &ns_adjust);		\
@@ -63,9 +98,9 @@
 #define TIME_CODE(line)							\
 	{								\
 	        unsigned long begin, fini, elapsed;			\
-		begin = tsc_cycles();					\
+		begin = bench_cycles();					\
 		line;							\
-		fini = tsc_cycles();					\
+		fini = bench_cycles();					\
 		elapsed = fini - begin - overhead;			\
 		printf("%s took (cycles %lu) %lu nsec.\n", #line, elapsed, \
 		       tsc_cycles_to_ns(elapsed, &ns_adjust));		\
@@ -183,6 +218,1409 @@ static inline void mtx_test(thread_enum this_thread, struct thread_shared_data *
 		sync_barrier(shared);
 }
 
+/*
+ * pstamp benchmark suite (-m pstamp): steady state logging cost by ring footprint, the cost
+ * of moving to a next ring, the effect of a consumer reading the ring from another core,
+ * and the cost of logging into cold memory. Results are per pstamp_log call, with the
+ * timing overhead subtracted, to size trace buffers for hot paths.
+ */
+struct pstamp_bench_reader {
+	pstamp_ring_t *pstamp_ring;
+	bool stop;
+	bool running;
+	unsigned long passes;
+	unsigned long sum;
+};
+
+/* log n entries, return cycles per entry */
+static double pstamp_bench_log(pstamp_ring_t **pstamp_ringp, unsigned long n, int point, unsigned long overhead)
+{
+	pstamp_ring_t *pstamp_ring = *pstamp_ringp;
+	pstamp_t cause;
+	unsigned long begin, fini;
+
+	pstamp(point, &cause);
+	begin = bench_cycles();
+	for (unsigned long i = 0; i < n; i++)
+		pstamp_ring = pstamp_log(pstamp_ring, point, &cause);
+	fini = bench_cycles();
+	*pstamp_ringp = pstamp_ring;
+	return (double)(fini - begin - min(fini - begin, overhead)) / n;
+}
+
+/* the same into a compact ring */
+static double pstamp_bench_clog(pstamp_cring_t **pstamp_cringp, unsigned long n, int point, unsigned long overhead)
+{
+	pstamp_cring_t *pstamp_cring = *pstamp_cringp;
+	pstamp_t cause;
+	unsigned long begin, fini;
+
+	pstamp(point, &cause);
+	begin = bench_cycles();
+	for (unsigned long i = 0; i < n; i++)
+		pstamp_cring = pstamp_clog(pstamp_cring, point, &cause);
+	fini = bench_cycles();
+	*pstamp_cringp = pstamp_cring;
+	return (double)(fini - begin - min(fini - begin, overhead)) / n;
+}
+
+static int pstamp_bench_compare(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+	return (x > y) - (x < y);
+}
+
+/* cycles of the entry that moves to the next ring, and of the entry just before it */
+struct pstamp_bench_switch {
+	unsigned long entry_min, entry_median;
+	unsigned long switch_min, switch_median;
+};
+
+/*
+ * log through rings of small entries starting with pstamp_ring (linked in advance, or
+ * extending from a pool), timing the last entry of each ring and the entry after it, which
+ * moves to the next ring. Each is timed alone, so the difference of the medians is the cost
+ * of a switch, not a small difference of two averages spread over all the entries.
+ */
+static void pstamp_bench_switch(pstamp_ring_t *pstamp_ring, unsigned int rings, unsigned int small, int point,
+				struct pstamp_bench_switch *result)
+{
+	unsigned long *entry = calloc(rings, sizeof(*entry)), *crossing = calloc(rings, sizeof(*crossing));
+	unsigned int logged = 0, n = rings - 1;
+	unsigned long begin;
+	pstamp_t cause;
+
+	null_exit(entry, "Error allocating samples", 1);
+	null_exit(crossing, "Error allocating samples", 1);
+	pstamp(point, &cause);
+	for (unsigned int r = 0; r < n; r++) {
+		for (; logged + 1 < small; logged++)
+			pstamp_ring = pstamp_log(pstamp_ring, point, &cause);
+		begin = bench_cycles();
+		pstamp_ring = pstamp_log(pstamp_ring, point, &cause);
+		entry[r] = bench_cycles() - begin;
+		begin = bench_cycles();
+		pstamp_ring = pstamp_log(pstamp_ring, point, &cause);
+		crossing[r] = bench_cycles() - begin;
+		logged = 1;
+	}
+	qsort(entry, n, sizeof(*entry), pstamp_bench_compare);
+	qsort(crossing, n, sizeof(*crossing), pstamp_bench_compare);
+	result->entry_min = entry[0];
+	result->entry_median = entry[n / 2];
+	result->switch_min = crossing[0];
+	result->switch_median = crossing[n / 2];
+	free(entry);
+	free(crossing);
+}
+
+static void pstamp_bench_switch_print(const char *what, const struct pstamp_bench_switch *result)
+{
+	long cost = (long)result->switch_median - (long)result->entry_median;
+
+	printf("  %-40s entry min %lu median %lu, switching entry min %lu median %lu cycles\n", what,
+	       result->entry_min, result->entry_median, result->switch_min, result->switch_median);
+	if (cost > 0)
+		printf("  %-40s %8ld cycles %8.2f nsec per switch\n", "", cost,
+		       tsc_cycles_to_ns(cost * 1000, &ns_adjust) / 1000.0);
+	else
+		printf("  %-40s not measurable above the cost of an entry\n", "");
+}
+
+static void pstamp_bench_print(const char *what, double cycles_per)
+{
+	printf("  %-40s %8.2f cycles %8.2f nsec per entry\n", what, cycles_per,
+	       tsc_cycles_to_ns(cycles_per * 1000, &ns_adjust) / 1000.0);
+}
+
+/* consumer on another core, reading the whole ring over and over */
+static void *pstamp_bench_reader_main(void *arg)
+{
+	struct pstamp_bench_reader *reader = arg;
+	struct pstamp_span span[2];
+
+	__atomic_store_n(&reader->running, true, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE)) {
+		unsigned int spans = pstamp_ring_spans(reader->pstamp_ring, span);
+		for (unsigned int s = 0; s < spans; s++)
+			for (unsigned int i = 0; i < span[s].count; i++)
+				reader->sum += __atomic_load_n(&span[s].entries[i].pstamp.time, __ATOMIC_RELAXED);
+		reader->passes += 1;
+	}
+	return NULL;
+}
+
+/* cycles per call of n calls of a logging statement */
+#define pstamp_bench_loop(n, overhead, statement) ({				\
+	unsigned long _begin = bench_cycles(), _fini;				\
+	for (unsigned long _i = 0; _i < (n); _i++)				\
+		statement;							\
+	_fini = bench_cycles();							\
+	(double)(_fini - _begin - min(_fini - _begin, (overhead))) / (n);	\
+})
+
+static void pstamp_bench_variants(int point, unsigned long overhead, unsigned int size)
+{
+	const unsigned long n = 1UL << 20;
+	int cpus = get_nprocs_conf();
+	pstamp_ring_t *pstamp_ring, *current;
+	pstamp_mring_t *pstamp_mring;
+	pstamp_rseq_t *prs;
+	pstamp_t cause;
+	int err;
+
+	pstamp_ring = malloc(pstamp_ring_size(size));
+	null_exit(pstamp_ring, "Error allocating pstamp ring", 1);
+	pstamp_mring = malloc(pstamp_mring_size(size));
+	null_exit(pstamp_mring, "Error allocating pstamp mring", 1);
+	prs = malloc(pstamp_rseq_size(cpus));
+	null_exit(prs, "Error allocating pstamp rseq rings", 1);
+	err = pstamp_rseq_init(prs, cpus, size);
+	err_exit_negative(err, "Error allocating pstamp rseq rings", 1);
+	pstamp_ring_init(pstamp_ring, size);
+	err = pstamp_mring_init(pstamp_mring, size);
+	err_exit_negative(err, "Error initializing pstamp mring", 1);
+	pstamp(point, &cause);
+
+	/* twice, the first pass warms the rings */
+	for (int pass = 0; pass < 2; pass++) {
+		double plain, mring, nested, shared, rseq;
+
+		current = pstamp_ring;
+		plain = pstamp_bench_loop(n, overhead, current = pstamp_log(current, point, &cause));
+		mring = pstamp_bench_loop(n, overhead, pstamp_mring_log(pstamp_mring, point, &cause));
+		nested = pstamp_bench_loop(n, overhead, pstamp_mring_log_nested(pstamp_mring, point, &cause));
+		shared = pstamp_bench_loop(n, overhead, pstamp_mring_log_shared(pstamp_mring, point, &cause));
+		rseq = pstamp_bench_loop(n, overhead, pstamp_rseq_log(prs, point, &cause));
+		if (pass == 0)
+			continue;
+		pstamp_bench_print("pstamp_log", plain);
+		pstamp_bench_print("pstamp_mring_log", mring);
+		pstamp_bench_print("pstamp_mring_log_nested (signal safe)", nested);
+		pstamp_bench_print("pstamp_mring_log_shared (lock xadd)", shared);
+		pstamp_bench_print(pstamp_rseq_area() != NULL ? "pstamp_rseq_log" : "pstamp_rseq_log (no rseq, shared)",
+				   rseq);
+	}
+	pstamp_rseq_destroy(prs);
+	free(prs);
+	free(pstamp_mring);
+	free(pstamp_ring);
+}
+
+/*
+ * entries with one and two arguments, 40 and 48 bytes so half of them straddle two cache
+ * lines, against plain 32 byte entries in a ring of the same number of entries
+ */
+static void pstamp_bench_args(int point, unsigned long overhead, unsigned int size)
+{
+	const unsigned long n = max(4UL * size, 1UL << 20);
+	pstamp_ring_t *pstamp_ring, *current;
+	pstamp_arg_ring_t *arg_ring;
+	pstamp_arg2_ring_t *arg2_ring;
+	pstamp_t cause;
+	char what[64];
+	double plain, one, two;
+	int err;
+
+	err = posix_memalign((void **)&pstamp_ring, 64, pstamp_ring_size(size));
+	err_exit_nonzero(err, "Error allocating pstamp ring", 1);
+	err = posix_memalign((void **)&arg_ring, 64, pstamp_arg_ring_size(size));
+	err_exit_nonzero(err, "Error allocating pstamp arg ring", 1);
+	err = posix_memalign((void **)&arg2_ring, 64, pstamp_arg2_ring_size(size));
+	err_exit_nonzero(err, "Error allocating pstamp arg2 ring", 1);
+	pstamp_ring_init(pstamp_ring, size);
+	pstamp_arg_ring_init(arg_ring, size);
+	pstamp_arg2_ring_init(arg2_ring, size);
+	pstamp(point, &cause);
+
+	/* twice, the first pass fills and wraps the rings */
+	for (int pass = 0; pass < 2; pass++) {
+		current = pstamp_ring;
+		plain = pstamp_bench_loop(n, overhead, current = pstamp_log(current, point, &cause));
+		one = pstamp_bench_loop(n, overhead, arg_ring = pstamp_arg_log(arg_ring, point, &cause, _i));
+		two = pstamp_bench_loop(n, overhead, arg2_ring = pstamp_arg2_log(arg2_ring, point, &cause, _i, n));
+	}
+	snprintf(what, sizeof(what), "pstamp_log, %u entries (%zu KiB)", size, pstamp_ring_size(size) / 1024);
+	pstamp_bench_print(what, plain);
+	snprintf(what, sizeof(what), "pstamp_arg_log (%zu KiB)", pstamp_arg_ring_size(size) / 1024);
+	pstamp_bench_print(what, one);
+	snprintf(what, sizeof(what), "pstamp_arg2_log (%zu KiB)", pstamp_arg2_ring_size(size) / 1024);
+	pstamp_bench_print(what, two);
+	free(pstamp_ring);
+	free(arg_ring);
+	free(arg2_ring);
+}
+
+static void pstamp_bench(int point, unsigned long overhead, cpu_set_t *alt_as_set, size_t cpusetsize, bool same_core)
+{
+	/* footprints from within L1 to well beyond L3 */
+	static const unsigned int sizes[] = {512, 2048, 16384, 131072, 1048576, 4194304};
+	const unsigned int small = 16, chained = 4096;
+	struct pstamp_bench_switch linked, extended;
+	pstamp_ring_t *pstamp_ring, *current, *first;
+	pstamp_cring_t *pstamp_cring, *ccurrent;
+	pstamp_pool_t pool;
+	char what[64];
+	double single, chain, shared_cost;
+	int err;
+
+	printf("pstamp benchmarks, %zu byte entries\n", sizeof(pstamp_log_t));
+
+	/*
+	 * steady state: the ring has wrapped, every entry overwrites one. A compact ring of
+	 * the same entries has half the footprint.
+	 */
+	printf("\nWraparound logging by ring footprint, %zu byte entries and compact %zu byte entries\n",
+	       sizeof(pstamp_log_t), sizeof(pstamp_clog_t));
+	for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		unsigned int size = sizes[i];
+		pstamp_ring = malloc(pstamp_ring_size(size));
+		null_exit(pstamp_ring, "Error allocating pstamp ring", 1);
+		pstamp_ring_init(pstamp_ring, size);
+		current = pstamp_ring;
+		pstamp_bench_log(&current, size + 1, point, overhead);	/* fill and wrap */
+		snprintf(what, sizeof(what), "%u entries (%zu KiB)", size, pstamp_ring_size(size) / 1024);
+		pstamp_bench_print(what, pstamp_bench_log(&current, max(4UL * size, 1UL << 20), point, overhead));
+		free(pstamp_ring);
+		err = posix_memalign((void **)&pstamp_cring, 64, pstamp_cring_size(size));
+		err_exit_nonzero(err, "Error allocating pstamp compact ring", 1);
+		pstamp_cring_init(pstamp_cring, size);
+		ccurrent = pstamp_cring;
+		pstamp_bench_clog(&ccurrent, size + 1, point, overhead);
+		snprintf(what, sizeof(what), "%u entries, compact (%zu KiB)", size, pstamp_cring_size(size) / 1024);
+		pstamp_bench_print(what, pstamp_bench_clog(&ccurrent, max(4UL * size, 1UL << 20), point, overhead));
+		free(pstamp_cring);
+	}
+
+	/* next_ring: a chain of small rings against one ring of the same total size, both warm */
+	printf("\nMoving to the next ring, %u rings of %u entries\n", chained, small);
+	err = pstamp_pool_init(&pool, chained, small);
+	err_exit_negative(err, "Error allocating pstamp pool", 1);
+	pstamp_ring = malloc(pstamp_ring_size(small * chained));
+	null_exit(pstamp_ring, "Error allocating pstamp ring", 1);
+	for (int pass = 0; pass < 2; pass++) {
+		pstamp_ring_init(pstamp_ring, small * chained);
+		current = pstamp_ring;
+		single = pstamp_bench_log(&current, small * chained, point, overhead);
+		/* link the whole pool into a chain in advance */
+		for (unsigned int r = 0; r < chained; r++)
+			pstamp_ring_init(pool.rings[r], small);
+		for (unsigned int r = 0; r + 1 < chained; r++)
+			pool.rings[r]->next_ring = pool.rings[r + 1];
+		current = pool.rings[0];
+		chain = pstamp_bench_log(&current, small * chained, point, overhead);
+	}
+	pstamp_bench_print("one ring", single);
+	pstamp_bench_print("chained rings", chain);
+
+	/* each switch timed alone, the next ring linked in advance or taken from the pool */
+	for (int pass = 0; pass < 2; pass++) {
+		for (unsigned int r = 0; r < chained; r++)
+			pstamp_ring_init(pool.rings[r], small);
+		for (unsigned int r = 0; r + 1 < chained; r++)
+			pool.rings[r]->next_ring = pool.rings[r + 1];
+		pstamp_bench_switch(pool.rings[0], chained, small, point, &linked);
+
+		/* nothing has been returned to the pool, so this refills it */
+		pool.count = pool.capacity;
+		first = pstamp_pool_get(&pool);
+		pstamp_ring_policy(first, PSTAMP_EXTEND, &pool);
+		pstamp_bench_switch(first, chained, small, point, &extended);
+	}
+	pstamp_bench_switch_print("next_ring linked in advance", &linked);
+	pstamp_bench_switch_print("extended from a pool", &extended);
+	free(pstamp_ring);
+
+	/* a consumer on the alternate core reading the ring while it is logged into */
+	printf("\nConcurrent reader on the alternate core%s\n", same_core ? " (SAME CORE as main)" : "");
+	for (unsigned int i = 0; i < 3; i++) {
+		unsigned int size = sizes[i];
+		struct pstamp_bench_reader reader = {0};
+		pthread_t reader_thread;
+		pthread_attr_t attr;
+
+		pstamp_ring = malloc(pstamp_ring_size(size));
+		null_exit(pstamp_ring, "Error allocating pstamp ring", 1);
+		pstamp_ring_init(pstamp_ring, size);
+		current = pstamp_ring;
+		pstamp_bench_log(&current, size + 1, point, overhead);
+		single = pstamp_bench_log(&current, 1UL << 20, point, overhead);
+
+		reader.pstamp_ring = pstamp_ring;
+		err = pthread_attr_init(&attr);
+		err_exit_nonzero(err, "Error creating reader thread attr", 1);
+		err = pthread_attr_setaffinity_np(&attr, cpusetsize, alt_as_set);
+		err_exit_nonzero(err, "Error setting reader thread's affinity", 1);
+		err = pthread_create(&reader_thread, &attr, pstamp_bench_reader_main, &reader);
+		err_exit_nonzero(err, "Error creating reader thread", 1);
+		pthread_attr_destroy(&attr);
+		while (!__atomic_load_n(&reader.running, __ATOMIC_ACQUIRE))
+			sched_yield();
+		shared_cost = pstamp_bench_log(&current, 1UL << 20, point, overhead);
+		__atomic_store_n(&reader.stop, true, __ATOMIC_RELEASE);
+		pthread_join(reader_thread, NULL);
+
+		snprintf(what, sizeof(what), "%u entries, no reader", size);
+		pstamp_bench_print(what, single);
+		snprintf(what, sizeof(what), "%u entries, reader (%lu passes)", size, reader.passes);
+		pstamp_bench_print(what, shared_cost);
+		free(pstamp_ring);
+	}
+
+	/* cold memory: never touched (page faults), touched but flushed from cache, warm */
+	printf("\nCold and warm ring memory, one pass over %u entries\n", sizes[3]);
+	pstamp_ring = mmap(NULL, pstamp_ring_size(sizes[3]), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pstamp_ring == MAP_FAILED) {
+		perror("Error mapping pstamp ring");
+		exit(1);
+	}
+	pstamp_ring_init(pstamp_ring, sizes[3]);
+	current = pstamp_ring;
+	pstamp_bench_print("untouched pages", pstamp_bench_log(&current, sizes[3], point, overhead));
+	for (char *line = (char *)pstamp_ring->ring; line < (char *)(pstamp_ring->ring + sizes[3]); line += 64)
+		asm volatile("clflush (%0)" : : "r"(line) : "memory");
+	asm volatile("mfence" : : : "memory");
+	pstamp_ring_init(pstamp_ring, sizes[3]);
+	current = pstamp_ring;
+	pstamp_bench_print("flushed from cache", pstamp_bench_log(&current, sizes[3], point, overhead));
+	pstamp_ring_init(pstamp_ring, sizes[3]);
+	current = pstamp_ring;
+	pstamp_bench_print("warm", pstamp_bench_log(&current, sizes[3], point, overhead));
+	munmap(pstamp_ring, pstamp_ring_size(sizes[3]));
+	pstamp_pool_destroy(&pool);
+
+	/* mrings: the plain log against nested safe (xadd), shared (lock xadd) and rseq */
+	printf("\nLogging variants, warm rings of %u entries\n", sizes[1]);
+	pstamp_bench_variants(point, overhead, sizes[1]);
+
+	/* arguments: the extra stores, and the extra footprint once the ring is beyond L2 */
+	printf("\nEntries with arguments, warm rings\n");
+	pstamp_bench_args(point, overhead, sizes[1]);
+	pstamp_bench_args(point, overhead, sizes[4]);
+}
+
+/*
+ * TSC read strategy calibration (-m tsc): for each strategy the CPU has, the cost of a
+ * read, and how a read is ordered with a cache miss next to it. A read that waits for
+ * earlier instructions sees all of a miss just before it, one that holds back later
+ * instructions sees all of a miss just after it, while an earlier miss is still in flight.
+ * Each is the fraction of the miss latency seen, the median of many trials, against reads
+ * known to be ordered (rdtscp; lfence to begin, rdtscp to end).
+ */
+#define TSC_BENCH_TRIALS 201
+#define TSC_BENCH_READS 10000
+#define TSC_BENCH_ORDERED 0.75	/* fraction of the miss seen to count as ordered */
+
+static char tsc_bench_lines[3 * 4096] __attribute__((__aligned__(4096)));
+
+struct tsc_bench_result {
+	bool supported;
+	double cost;		/* cycles per read */
+	double waits;		/* fraction of a miss before the read seen */
+	double holds;		/* fraction of a miss after the read seen */
+};
+
+static int tsc_bench_compare(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+	return (x > y) - (x < y);
+}
+
+static unsigned long tsc_bench_median(unsigned long *samples)
+{
+	qsort(samples, TSC_BENCH_TRIALS, sizeof(*samples), tsc_bench_compare);
+	return samples[TSC_BENCH_TRIALS / 2];
+}
+
+static inline void tsc_bench_flush(volatile char *line, bool flush)
+{
+	if (flush)
+		asm volatile("clflush (%0)" : : "r"(line) : "memory");
+	else
+		(void)*line;
+}
+
+/*
+ * median cycles from a begin read to an end read around a load of after, with a load of
+ * before ahead of the begin read. Either line is flushed from the cache first, or warm.
+ */
+#define tsc_bench_trials(begin_strategy, end_strategy, before, flush_before, after, flush_after) ({	\
+	unsigned long _samples[TSC_BENCH_TRIALS], _t0;						\
+	for (unsigned int _i = 0; _i < TSC_BENCH_TRIALS; _i++) {				\
+		tsc_bench_flush((before), (flush_before));					\
+		tsc_bench_flush((after), (flush_after));					\
+		asm volatile("mfence; lfence" : : : "memory");					\
+		(void)*(volatile char *)(before);						\
+		_t0 = tsc_read(begin_strategy);							\
+		(void)*(volatile char *)(after);						\
+		_samples[_i] = tsc_read(end_strategy) - _t0;					\
+	}											\
+	tsc_bench_median(_samples);								\
+})
+
+static inline __attribute__((__always_inline__)) void tsc_bench_strategy(enum tsc_strategy strategy,
+									  struct tsc_bench_result *result,
+									  double miss)
+{
+	char *before = tsc_bench_lines, *after = tsc_bench_lines + 4096, *warm = tsc_bench_lines + 2 * 4096;
+	unsigned long begin, fini, warm_cycles, miss_cycles;
+
+	begin = tsc_cycles();
+	for (unsigned int i = 0; i < TSC_BENCH_READS; i++)
+		tsc_read(strategy);
+	fini = tsc_cycles();
+	result->cost = (double)(fini - begin) / TSC_BENCH_READS;
+
+	/* waits: an ordered begin, the miss, then the strategy */
+	warm_cycles = tsc_bench_trials(TSC_RDTSCP_LFENCE, strategy, warm, false, after, false);
+	miss_cycles = tsc_bench_trials(TSC_RDTSCP_LFENCE, strategy, warm, false, after, true);
+	result->waits = ((double)miss_cycles - warm_cycles) / miss;
+
+	/* holds: a miss in flight, the strategy, a second miss, then an ordered end */
+	warm_cycles = tsc_bench_trials(strategy, TSC_RDTSCP, before, true, after, false);
+	miss_cycles = tsc_bench_trials(strategy, TSC_RDTSCP, before, true, after, true);
+	result->holds = ((double)miss_cycles - warm_cycles) / miss;
+}
+
+static void tsc_bench(void)
+{
+	static const char *const macros[TSC_STRATEGIES] = {
+		"TSC_RDTSCP", "TSC_RDTSC", "TSC_LFENCE_RDTSC", "TSC_RDTSCP_LFENCE", "TSC_CPUID",
+		"TSC_SERIALIZE", "TSC_RDPRU",
+	};
+	struct tsc_bench_result results[TSC_STRATEGIES] = {0};
+	char *warm = tsc_bench_lines + 2 * 4096, *after = tsc_bench_lines + 4096;
+	bool rdpid = tsc_rdpid_supported();
+	double rdpid_cost = 0.0, miss;
+	int pstamp_best = -1, bench_best = -1;
+	double pstamp_cost = 0.0;
+
+	memset(tsc_bench_lines, 1, sizeof(tsc_bench_lines));
+	miss = (double)tsc_bench_trials(TSC_RDTSCP_LFENCE, TSC_RDTSCP, warm, false, after, true) -
+		tsc_bench_trials(TSC_RDTSCP_LFENCE, TSC_RDTSCP, warm, false, after, false);
+	if (miss < 1.0) {
+		printf("Cache miss not measurable (%.0f cycles), can't calibrate ordering\n", miss);
+		return;
+	}
+	if (rdpid) {
+		unsigned long begin = tsc_cycles(), fini;
+		for (unsigned int i = 0; i < TSC_BENCH_READS; i++)
+			tsc_rdpid();
+		fini = tsc_cycles();
+		rdpid_cost = (double)(fini - begin) / TSC_BENCH_READS;
+	}
+
+	for (int s = 0; s < TSC_STRATEGIES; s++)
+		results[s].supported = tsc_strategy_supported(s);
+	/* each strategy a constant, so each is measured as its own instructions */
+	tsc_bench_strategy(TSC_RDTSCP, results + TSC_RDTSCP, miss);
+	tsc_bench_strategy(TSC_RDTSC, results + TSC_RDTSC, miss);
+	tsc_bench_strategy(TSC_LFENCE_RDTSC, results + TSC_LFENCE_RDTSC, miss);
+	tsc_bench_strategy(TSC_RDTSCP_LFENCE, results + TSC_RDTSCP_LFENCE, miss);
+	tsc_bench_strategy(TSC_CPUID, results + TSC_CPUID, miss);
+	if (results[TSC_SERIALIZE].supported)
+		tsc_bench_strategy(TSC_SERIALIZE, results + TSC_SERIALIZE, miss);
+	if (results[TSC_RDPRU].supported)
+		tsc_bench_strategy(TSC_RDPRU, results + TSC_RDPRU, miss);
+
+	printf("TSC read strategies, ordering as the fraction of a %.0f cycle cache miss seen\n", miss);
+	printf("  %-28s %8s %8s %8s\n", "strategy", "cycles", "waits", "holds");
+	for (int s = 0; s < TSC_STRATEGIES; s++) {
+		struct tsc_bench_result *r = results + s;
+		bool waits = r->waits >= TSC_BENCH_ORDERED, holds = r->holds >= TSC_BENCH_ORDERED;
+		double cost;
+
+		if (!r->supported) {
+			printf("  %-28s not supported\n", tsc_strategy_name(s));
+			continue;
+		}
+		printf("  %-28s %8.1f %7.0f%% %7.0f%%\n", tsc_strategy_name(s), r->cost, 100.0 * r->waits,
+		       100.0 * r->holds);
+		/* the harness needs both, begin reads must hold and end reads wait */
+		if (waits && holds && (bench_best < 0 || r->cost < results[bench_best].cost))
+			bench_best = s;
+		/* a pstamp must be taken after the work before its point, and give the TSC and CPU */
+		if (s == TSC_RDPRU || !waits || (s != TSC_RDTSCP && s != TSC_RDTSCP_LFENCE && !rdpid))
+			continue;
+		cost = r->cost + (s != TSC_RDTSCP && s != TSC_RDTSCP_LFENCE ? rdpid_cost : 0.0);
+		if (pstamp_best < 0 || cost < pstamp_cost) {
+			pstamp_best = s;
+			pstamp_cost = cost;
+		}
+	}
+	if (rdpid)
+		printf("  %-28s %8.1f\n", "rdpid", rdpid_cost);
+	else
+		printf("  no rdpid, pstamp needs rdtscp for the logical processor\n");
+
+	printf("\n");
+	if (pstamp_best >= 0)
+		printf("pstamp, waits for earlier work: %s (%.1f cycles), build with -DPSTAMP_TSC_STRATEGY=%s\n",
+		       tsc_strategy_name(pstamp_best), pstamp_cost, macros[pstamp_best]);
+	else
+		printf("pstamp: no strategy measured as ordered\n");
+	if (bench_best >= 0)
+		printf("timing, waits and holds: %s (%.1f cycles), build with -DBENCH_TSC_STRATEGY=%s\n",
+		       tsc_strategy_name(bench_best), results[bench_best].cost, macros[bench_best]);
+	else
+		printf("timing: no strategy measured as ordered\n");
+	printf("now built with PSTAMP_TSC_STRATEGY=%s BENCH_TSC_STRATEGY=%s\n", macros[PSTAMP_TSC_STRATEGY],
+	       macros[BENCH_TSC_STRATEGY]);
+}
+
+/*
+ * batch conversion of cycles to ns (tsc_batch.h): each kernel the CPU runs, checked bit for
+ * bit against tsc_cycles_to_ns with random counts and ratios, and its throughput on an
+ * array of counts and on the times of an array of pstamp entries, both cache resident
+ */
+#define TSC_BATCH_BENCH_COUNT 4096
+#define TSC_BATCH_BENCH_REPEAT 1000
+
+static unsigned long tsc_batch_bench_random(unsigned long *state)
+{
+	/* xorshift64 */
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static void tsc_batch_bench(void)
+{
+	const size_t count = TSC_BATCH_BENCH_COUNT, stride = sizeof(pstamp_log_t) / sizeof(unsigned long);
+	unsigned long *cycles = malloc(sizeof(unsigned long) * count);
+	unsigned long *ns = malloc(sizeof(unsigned long) * count);
+	unsigned long *expect = malloc(sizeof(unsigned long) * count);
+	pstamp_log_t *entries = malloc(sizeof(pstamp_log_t) * count);
+	unsigned long state = tsc_cycles() | 1;
+	double scalar = 0.0;
+
+	null_exit(cycles, "Error allocating cycles", 1);
+	null_exit(ns, "Error allocating ns", 1);
+	null_exit(expect, "Error allocating ns", 1);
+	null_exit(entries, "Error allocating entries", 1);
+	printf("\nBatch conversion of cycles to ns, %zu values, per value\n", count);
+	for (int k = 0; k < TSC_BATCH_KERNELS; k++) {
+		tsc_batch_fn fn = tsc_batch_kernel_fn(k);
+		unsigned long mismatches = 0, begin, fini;
+		double array, entry;
+
+		if (!tsc_batch_supported(k)) {
+			printf("  %-8s not supported\n", tsc_batch_kernel_name(k));
+			continue;
+		}
+		/* random ratios, every shift, and counts of every size */
+		for (unsigned int trial = 0; trial < 256; trial++) {
+			struct tsc_ns_adjust adjust = {.time_mult = tsc_batch_bench_random(&state),
+						       .time_shift = trial % 64};
+			unsigned long base = trial & 1 ? tsc_batch_bench_random(&state) : 0;
+
+			if (trial == 0)
+				adjust = ns_adjust;
+			for (size_t i = 0; i < count; i++) {
+				cycles[i] = tsc_batch_bench_random(&state) >> (i % 64);
+				entries[i].pstamp.time = cycles[i];
+				expect[i] = tsc_cycles_to_ns(cycles[i] - base, &adjust);
+			}
+			fn(cycles, 1, base, ns, count - trial % 8, &adjust);
+			for (size_t i = 0; i < count - trial % 8; i++)
+				mismatches += ns[i] != expect[i];
+			fn(&entries->pstamp.time, stride, base, ns, count - trial % 8, &adjust);
+			for (size_t i = 0; i < count - trial % 8; i++)
+				mismatches += ns[i] != expect[i];
+		}
+
+		for (size_t i = 0; i < count; i++)
+			entries[i].pstamp.time = cycles[i] = tsc_cycles() + i;
+		fn(cycles, 1, cycles[0], ns, count, &ns_adjust);	/* warm */
+		begin = tsc_cycles();
+		for (int r = 0; r < TSC_BATCH_BENCH_REPEAT; r++)
+			fn(cycles, 1, cycles[0], ns, count, &ns_adjust);
+		fini = tsc_cycles();
+		array = (double)(fini - begin) / (count * TSC_BATCH_BENCH_REPEAT);
+		begin = tsc_cycles();
+		for (int r = 0; r < TSC_BATCH_BENCH_REPEAT; r++)
+			fn(&entries->pstamp.time, stride, cycles[0], ns, count, &ns_adjust);
+		fini = tsc_cycles();
+		entry = (double)(fini - begin) / (count * TSC_BATCH_BENCH_REPEAT);
+		if (k == TSC_BATCH_SCALAR)
+			scalar = array;
+		printf("  %-8s array %6.2f cycles (%.1fx scalar), entries %6.2f cycles, %s\n", tsc_batch_kernel_name(k),
+		       array, scalar / array, entry, mismatches == 0 ? "identical to tsc_cycles_to_ns" : "MISMATCHED");
+	}
+	printf("  tsc_batch_to_ns uses %s\n", tsc_batch_kernel_name(tsc_batch_best()));
+	free(cycles);
+	free(ns);
+	free(expect);
+	free(entries);
+}
+
+/*
+ * Cross-core TSC offsets (-m skew): for each pair of CPUs in the -s list, how far the TSC
+ * of the second is ahead of the first's, with error bars, measured as NTP does over a
+ * round trip. A reference thread on the first CPU reads its TSC (t1) and pings a responder
+ * thread on the second, which reads its own TSC (t2) and pongs back, and the reference
+ * reads its TSC again (t4). The responder's read happened between t1 and t4 on the
+ * reference's clock, so the offset is between t2 - t4 and t2 - t1. Each round narrows the
+ * bounds, and the offset reported is the middle of the tightest bounds, plus or minus half
+ * their width, which is what the cache line round trip allows. A second batch of rounds,
+ * SKEW_GAP_NS after the first, gives the drift between the two TSCs, with its own bound.
+ *
+ * The largest offset plus its error bar is the cross-core ordering error: pstamps from
+ * different CPUs, merged on time, are in the right order if they are further apart.
+ */
+#define SKEW_ROUNDS 10000
+#define SKEW_GAP_NS 50000000L	/* 50 msec between batches, for the drift */
+
+struct skew_shared {
+	barrier_t barrier;
+	unsigned long rounds;
+	unsigned long ping __attribute__((__aligned__(64)));	/* round sent by the reference */
+	unsigned long pong __attribute__((__aligned__(64)));	/* round echoed by the responder */
+	unsigned long stamp;					/* the responder's TSC for it */
+};
+
+struct skew_bound {
+	long low, high;		/* the offset is in [low, high] cycles */
+	unsigned long tsc;	/* reference TSC at the middle of the batch */
+};
+
+static void *skew_responder_main(void *arg)
+{
+	struct skew_shared *skew = arg;
+
+	barrier_wait(&skew->barrier);
+	for (unsigned long round = 1; round <= skew->rounds; round++) {
+		while (__atomic_load_n(&skew->ping, __ATOMIC_ACQUIRE) != round)
+			asm volatile("pause");
+		skew->stamp = tsc_cycles();
+		__atomic_store_n(&skew->pong, round, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/* rounds first .. first + n - 1 from the reference, the bounds of the offset over them */
+static void skew_batch(struct skew_shared *skew, unsigned long first, unsigned long n, struct skew_bound *bound)
+{
+	unsigned long t1 = 0, t4, start = tsc_cycles();
+
+	bound->low = LONG_MIN;
+	bound->high = LONG_MAX;
+	for (unsigned long round = first; round < first + n; round++) {
+		t1 = tsc_cycles();
+		__atomic_store_n(&skew->ping, round, __ATOMIC_RELEASE);
+		while (__atomic_load_n(&skew->pong, __ATOMIC_ACQUIRE) != round)
+			asm volatile("pause");
+		t4 = tsc_cycles();
+		bound->low = max(bound->low, (long)(skew->stamp - t4));
+		bound->high = min(bound->high, (long)(skew->stamp - t1));
+	}
+	bound->tsc = start + (t1 - start) / 2;
+}
+
+/* offset of the TSC of cpu from that of reference, and its drift, the caller on reference */
+static void skew_pair(int reference, int cpu, size_t cpusetsize, struct skew_bound bound[2])
+{
+	struct skew_shared *skew;
+	struct timespec gap = {.tv_sec = 0, .tv_nsec = SKEW_GAP_NS};
+	cpu_set_t *set = CPU_ALLOC(cpusetsize * 8);
+	pthread_t responder;
+	pthread_attr_t attr;
+	int err;
+
+	null_exit(set, "Error allocating cpu set", 1);
+	err = posix_memalign((void **)&skew, 64, sizeof(*skew));
+	err_exit_nonzero(err, "Error allocating skew shared data", 1);
+	memset(skew, 0, sizeof(*skew));
+	barrier_init(&skew->barrier, 2);
+	skew->rounds = 2 * SKEW_ROUNDS;
+
+	CPU_ZERO_S(cpusetsize, set);
+	CPU_SET_S(reference, cpusetsize, set);
+	err = sched_setaffinity(0, cpusetsize, set);
+	err_exit_negative(err, "Error setting reference cpu affinity", 1);
+	CPU_ZERO_S(cpusetsize, set);
+	CPU_SET_S(cpu, cpusetsize, set);
+	err = pthread_attr_init(&attr);
+	err_exit_nonzero(err, "Error creating responder thread attr", 1);
+	err = pthread_attr_setaffinity_np(&attr, cpusetsize, set);
+	err_exit_nonzero(err, "Error setting responder thread's affinity", 1);
+	err = pthread_create(&responder, &attr, skew_responder_main, skew);
+	err_exit_nonzero(err, "Error creating responder thread", 1);
+	pthread_attr_destroy(&attr);
+
+	barrier_wait(&skew->barrier);
+	skew_batch(skew, 1, SKEW_ROUNDS, &bound[0]);
+	nanosleep(&gap, NULL);
+	skew_batch(skew, SKEW_ROUNDS + 1, SKEW_ROUNDS, &bound[1]);
+	pthread_join(responder, NULL);
+	free(skew);
+	CPU_FREE(set);
+}
+
+static void skew_bench(cpu_set_t *list, size_t cpusetsize)
+{
+	int cpus = CPU_COUNT_S(cpusetsize, list), n = 0;
+	int *cpu = malloc(sizeof(int) * cpus);
+	long *offset = calloc((size_t)cpus * cpus, sizeof(long));
+	long *error = calloc((size_t)cpus * cpus, sizeof(long));
+	long worst = 0;
+
+	null_exit(cpu, "Error allocating cpu list", 1);
+	null_exit(offset, "Error allocating offset matrix", 1);
+	null_exit(error, "Error allocating offset matrix", 1);
+	for (int c = 0; n < cpus; c++)
+		if (CPU_ISSET_S(c, cpusetsize, list))
+			cpu[n++] = c;
+	if (cpus < 2) {
+		printf("Cross-core TSC offsets need at least two CPUs in the -s list\n");
+		goto done;
+	}
+
+	printf("Cross-core TSC offsets, %d round trips per batch, drift over %ld msec\n", SKEW_ROUNDS,
+	       SKEW_GAP_NS / 1000000);
+	printf("  %4s %4s %12s %10s %12s %10s\n", "ref", "cpu", "offset", "+/-", "drift ppm", "+/-");
+	for (int i = 0; i < cpus; i++) {
+		for (int j = i + 1; j < cpus; j++) {
+			struct skew_bound bound[2];
+			double mid[2], half[2], elapsed, drift = 0.0, drift_error = 0.0;
+
+			skew_pair(cpu[i], cpu[j], cpusetsize, bound);
+			for (int b = 0; b < 2; b++) {
+				mid[b] = ((double)bound[b].low + bound[b].high) / 2;
+				half[b] = ((double)bound[b].high - bound[b].low) / 2;
+			}
+			elapsed = (double)(bound[1].tsc - bound[0].tsc);
+			if (elapsed > 0) {
+				drift = 1e6 * (mid[1] - mid[0]) / elapsed;
+				drift_error = 1e6 * (half[0] + half[1]) / elapsed;
+			}
+			/* the later batch's bounds, the offset as it is now */
+			offset[i * cpus + j] = lround(mid[1]);
+			offset[j * cpus + i] = -offset[i * cpus + j];
+			error[i * cpus + j] = error[j * cpus + i] = lround(half[1]);
+			worst = max(worst, labs(offset[i * cpus + j]) + error[i * cpus + j]);
+			printf("  %4d %4d %12.1f %10.1f %12.3f %10.3f%s\n", cpu[i], cpu[j], mid[1], half[1], drift,
+			       drift_error, half[0] < 0 || half[1] < 0 ? "  (bounds cross, TSCs moved)" : "");
+		}
+	}
+
+	printf("\nOffset matrix, cycles the column's TSC is ahead of the row's (+/- error)\n  %4s", "");
+	for (int j = 0; j < cpus; j++)
+		printf(" %14d", cpu[j]);
+	printf("\n");
+	for (int i = 0; i < cpus; i++) {
+		printf("  %4d", cpu[i]);
+		for (int j = 0; j < cpus; j++) {
+			char cell[32];
+			if (i == j)
+				snprintf(cell, sizeof(cell), "-");
+			else
+				snprintf(cell, sizeof(cell), "%ld+/-%ld", offset[i * cpus + j], error[i * cpus + j]);
+			printf(" %14s", cell);
+		}
+		printf("\n");
+	}
+	printf("\nCross-core ordering error: pstamps on these CPUs more than (%ld cycles) %lu nsec apart are in order\n",
+	       worst, tsc_cycles_to_ns(worst, &ns_adjust));
+done:
+	free(cpu);
+	free(offset);
+	free(error);
+}
+
+/*
+ * Capture pipeline (-m trace): a log drained as it fills into a stream file, which is then
+ * read back, whole and cut short in the middle of a record as a crash would leave it. Each
+ * step checks what comes back against what was logged, and what it cost the producer.
+ */
+#define TRACE_RING 1024
+#define TRACE_RINGS 64
+#define TRACE_ENTRIES (TRACE_RING * 48)
+#define TRACE_POLL_NS 100000UL	/* 100 usec */
+
+/* segments and entries of a stream that are in order and of point, false at the first that isn't */
+static bool trace_stream_check(pstamp_stream_reader_t *reader, int point, unsigned long *segments,
+			       unsigned long *entries)
+{
+	const struct pstamp_stream_record *record = NULL;
+	unsigned long last = 0;
+
+	*segments = *entries = 0;
+	while ((record = pstamp_stream_next(reader, record)) != NULL) {
+		pstamp_log_t *entry = pstamp_stream_entries(record);
+		for (unsigned int i = 0; i < record->count; i++) {
+			if (entry[i].pstamp.point != point || entry[i].pstamp.time < last)
+				return false;
+			last = entry[i].pstamp.time;
+		}
+		*segments += 1;
+		*entries += record->count;
+	}
+	return true;
+}
+
+/* make an empty temporary file in TMPDIR, or /tmp, its name goes in path, returns its fd or -1 */
+static int trace_tmpfile(char *path, size_t size)
+{
+	const char *dir = getenv("TMPDIR");
+
+	snprintf(path, size, "%s/clock_speed.XXXXXX", dir != NULL ? dir : "/tmp");
+	return mkstemp(path);
+}
+
+/* log into a ring drained into a stream, read the stream back, then cut it and recover it */
+static void trace_stream(int point, unsigned long overhead)
+{
+	char path[PATH_MAX];
+	const struct pstamp_stream_record *record = NULL;
+	pstamp_stream_reader_t reader;
+	pstamp_stream_t stream;
+	pstamp_drain_t *drain;
+	pstamp_ring_t *pstamp_ring;
+	pstamp_pool_t pool;
+	pstamp_t cause;
+	unsigned long segments, entries, cut_segment, cut;
+	const char *how;
+	double cost;
+	bool ok;
+	int err, fd;
+
+	fd = trace_tmpfile(path, sizeof(path));
+	err_exit_negative(fd, "Error creating stream file", 1);
+	close(fd);
+	err = pstamp_pool_init(&pool, TRACE_RINGS, TRACE_RING);
+	err_exit_negative(err, "Error allocating pstamp pool", 1);
+	err = pstamp_stream_open(&stream, path, &pool, 8, &ns_adjust, NULL, 0, 0);
+	err_exit_negative(err, "Error opening stream", 1);
+	how = stream.uring.fd >= 0 ? "io_uring" : stream.direct ? "pwrite, O_DIRECT" : "pwrite";
+	drain = malloc(pstamp_drain_size(1));
+	null_exit(drain, "Error allocating drain", 1);
+	pstamp_drain_init(drain, 1, &pool, pstamp_stream_consume, &stream, TRACE_POLL_NS);
+	pstamp_drain_retain(drain);
+	pstamp_ring = pstamp_drain_add(drain);
+	null_exit(pstamp_ring, "Error adding log to drain", 1);
+	/* the producer extends the log itself if the drain hasn't yet, so nothing is lost */
+	pstamp_ring_policy(pstamp_ring, PSTAMP_EXTEND, &pool);
+	err = pstamp_drain_start(drain, NULL);
+	err_exit_nonzero(err, "Error starting drain thread", 1);
+
+	pstamp(point, &cause);
+	cost = pstamp_bench_loop(TRACE_ENTRIES, overhead, pstamp_ring = pstamp_log(pstamp_ring, point, &cause));
+	err = pstamp_drain_stop(drain);
+	err_exit_nonzero(err, "Error stopping drain thread", 1);
+	pstamp_drain_flush(drain);
+	err = pstamp_stream_close(&stream);
+	err_exit_negative(err, "Error writing stream", 1);
+
+	printf("Streamed log, %u rings of %u entries, written with %s\n", TRACE_RINGS, TRACE_RING, how);
+	pstamp_bench_print("pstamp_log, drained to a stream", cost);
+	printf("  %lu rings consumed, %lu starved, %lu written, %lu lost to errors\n", drain->consumed,
+	       drain->starved, stream.rings, stream.errors);
+
+	err = pstamp_stream_read_open(&reader, path);
+	err_exit_negative(err, "Error reading stream", 1);
+	ok = trace_stream_check(&reader, point, &segments, &entries);
+	printf("  read back %lu segments, %lu of %u entries%s\n", segments, entries, TRACE_ENTRIES,
+	       ok && entries == TRACE_ENTRIES && !reader.truncated ? "" : "  MISMATCH");
+
+	/* a crash: the file ends in the middle of the segment half way through */
+	cut_segment = segments / 2;
+	for (unsigned long i = 0; i <= cut_segment; i++)
+		record = pstamp_stream_next(&reader, record);
+	cut = (const char *)record - (const char *)reader.map + record->length / 2;
+	pstamp_stream_read_close(&reader);
+	err = truncate(path, cut);
+	err_exit_negative(err, "Error cutting stream", 1);
+	err = pstamp_stream_read_open(&reader, path);
+	err_exit_negative(err, "Error reading cut stream", 1);
+	ok = trace_stream_check(&reader, point, &segments, &entries);
+	printf("  cut at byte %lu, recovered %lu segments, %lu entries%s\n", cut, segments, entries,
+	       ok && segments == cut_segment && entries == cut_segment * TRACE_RING && reader.truncated ?
+	       "" : "  MISMATCH");
+	pstamp_stream_read_close(&reader);
+
+	unlink(path);
+	free(drain);
+	pstamp_pool_destroy(&pool);
+}
+
+/*
+ * A run of requests, each logged as an interval: the request begins, two steps are caused by
+ * it, and it ends, with some work between that varies from request to request. Requests
+ * alternate between two logs, as if handled by two workers. The logs live in a shared
+ * memory region, extending from its pool so every entry is kept, and are read back through
+ * /proc as a collector process would.
+ */
+#define TRACE_REQUESTS 20000
+#define TRACE_REQUEST_ENTRIES 4
+#define TRACE_LOGS 2
+#define TRACE_ANCHORS 4
+
+struct trace_capture {
+	int request, parse, reply, done;	/* points */
+	pstamp_shm_t shm;
+	pstamp_ring_t *first[TRACE_LOGS];	/* first ring of each log */
+	struct log2_hist duration;		/* cycles per request, from the interval ends */
+	tsc_anchors_t *anchors;			/* sampled before and after the requests */
+	unsigned long entries;
+	double cost;				/* cycles per request, work included */
+};
+
+static inline void trace_work(unsigned long n)
+{
+	for (volatile unsigned long i = 0; i < n; i++)
+		;
+}
+
+static void trace_capture(struct trace_capture *capture, unsigned long overhead)
+{
+	static const pstamp_t none;
+	pstamp_ring_t *log[TRACE_LOGS];
+	int err;
+
+	capture->request = PSTAMP_POINT("request");
+	capture->parse = PSTAMP_POINT("parse");
+	capture->reply = PSTAMP_POINT("reply");
+	capture->done = PSTAMP_POINT("request done");
+	err = pstamp_shm_create(&capture->shm, "clock_speed trace", TRACE_LOGS,
+				TRACE_REQUESTS * TRACE_REQUEST_ENTRIES / TRACE_RING + 2 * TRACE_LOGS, TRACE_RING);
+	err_exit_negative(err, "Error creating pstamp shm region", 1);
+	for (unsigned int l = 0; l < TRACE_LOGS; l++) {
+		log[l] = capture->first[l] = pstamp_shm_add_log(&capture->shm);
+		null_exit(log[l], "Error adding pstamp shm log", 1);
+	}
+	log2_hist_init(&capture->duration);
+	capture->anchors = malloc(tsc_anchors_size(TRACE_ANCHORS));
+	null_exit(capture->anchors, "Error allocating tsc anchors", 1);
+	err = tsc_anchors_init(capture->anchors, TRACE_ANCHORS, &ns_adjust);
+	err_exit_negative(err, "Error initializing tsc anchors", 1);
+	err = tsc_anchor_sample(capture->anchors);
+	err_exit_negative(err, "Error sampling tsc anchor", 1);
+
+	capture->cost = pstamp_bench_loop(TRACE_REQUESTS, overhead, ({
+		pstamp_t request;
+		pstamp_ring_t **ring = log + _i % TRACE_LOGS;
+		unsigned long work = 50 + (_i % 7) * 50;
+		*ring = pstamp_interval_begin(*ring, capture->request, &none, &request);
+		trace_work(work);
+		*ring = pstamp_log(*ring, capture->parse, &request);
+		trace_work(work);
+		*ring = pstamp_log(*ring, capture->reply, &request);
+		*ring = pstamp_interval_end_hist(*ring, capture->done, &request, &capture->duration);
+	}));
+	err = tsc_anchor_sample(capture->anchors);
+	err_exit_negative(err, "Error sampling tsc anchor", 1);
+	capture->entries = 0;
+	for (unsigned int l = 0; l < TRACE_LOGS; l++)
+		for (pstamp_ring_t *ring = capture->first[l]; ring != NULL; ring = ring->next_ring)
+			capture->entries += pstamp_ring_count(ring);
+
+	printf("\n%u requests logged as intervals in %u logs, %u entries each\n", TRACE_REQUESTS, TRACE_LOGS,
+	       TRACE_REQUEST_ENTRIES);
+	printf("  %.0f cycles per request, work included\n", capture->cost);
+	printf("  %lu entries%s\n", capture->entries,
+	       capture->entries == TRACE_REQUESTS * TRACE_REQUEST_ENTRIES ? "" : "  MISMATCH");
+	printf("  duration p50 %lu p99 %lu max %lu nsec, %lu samples%s\n",
+	       tsc_cycles_to_ns(log2_hist_percentile(&capture->duration, 0.5), &ns_adjust),
+	       tsc_cycles_to_ns(log2_hist_percentile(&capture->duration, 0.99), &ns_adjust),
+	       tsc_cycles_to_ns(capture->duration.max, &ns_adjust), capture->duration.samples,
+	       capture->duration.samples == TRACE_REQUESTS ? "" : "  MISMATCH");
+}
+
+static void trace_shm_count(const struct pstamp_span *span, void *arg)
+{
+	*(unsigned long *)arg += span->count;
+}
+
+/* attach to the capture's region as a collector would, and count the entries it sees */
+static void trace_shm(struct trace_capture *capture)
+{
+	pstamp_shm_t collector;
+	unsigned long entries = 0;
+	int err;
+
+	err = pstamp_shm_attach_pid(&collector, getpid(), capture->shm.fd);
+	err_exit_negative(err, "Error attaching to pstamp shm region", 1);
+	for (unsigned int i = 0; i < pstamp_shm_log_count(&collector); i++)
+		pstamp_shm_enumerate_spans(&collector, i, trace_shm_count, &entries);
+	printf("  collector read %u log%s, %lu entries, %s mapping%s\n", pstamp_shm_log_count(&collector),
+	       pstamp_shm_log_count(&collector) == 1 ? "" : "s", entries,
+	       pstamp_shm_direct(&collector) ? "direct" : "translated", entries == capture->entries ? "" : "  MISMATCH");
+	pstamp_shm_detach(&collector);
+}
+
+/* the batch consumers over the capture, a span at a time */
+struct trace_batch {
+	const struct trace_capture *capture;
+	unsigned long *counts;
+	unsigned int points;
+	unsigned long other;
+	struct log2_hist latency;		/* request to request done, from the entries */
+	unsigned long ns[TRACE_RING];
+	unsigned long converted, mismatches;
+};
+
+static void trace_batch_span(const struct pstamp_span *span, void *arg)
+{
+	struct trace_batch *batch = arg;
+	unsigned long base = batch->capture->first[0]->ring[0].pstamp.time;
+
+	batch->other += pstamp_batch_count_points(span->entries, span->count, batch->counts, batch->points);
+	pstamp_batch_latency_hist(span->entries, span->count, batch->capture->done, &batch->latency);
+	pstamp_batch_to_ns(span->entries, span->count, base, &ns_adjust, batch->ns);
+	for (unsigned int i = 0; i < span->count; i++)
+		batch->mismatches += batch->ns[i] != tsc_cycles_to_ns(span->entries[i].pstamp.time - base, &ns_adjust);
+	batch->converted += span->count;
+}
+
+static void trace_batch(const struct trace_capture *capture)
+{
+	struct trace_batch batch = {.capture = capture, .points = pstamp_point_count()};
+	const int points[TRACE_REQUEST_ENTRIES] = {capture->request, capture->parse, capture->reply, capture->done};
+	bool counted = true;
+
+	batch.counts = calloc(batch.points, sizeof(*batch.counts));
+	null_exit(batch.counts, "Error allocating point counts", 1);
+	log2_hist_init(&batch.latency);
+	for (unsigned int l = 0; l < TRACE_LOGS; l++)
+		pstamp_log_enumerate_spans(capture->first[l], trace_batch_span, &batch);
+	for (unsigned int p = 0; p < TRACE_REQUEST_ENTRIES; p++)
+		counted = counted && batch.counts[points[p]] == TRACE_REQUESTS;
+	printf("  batch: %u requests at each point%s, %lu other\n", TRACE_REQUESTS, counted ? "" : "  MISMATCH",
+	       batch.other);
+	printf("  batch: latency p50 %lu p99 %lu nsec, %lu samples%s\n",
+	       tsc_cycles_to_ns(log2_hist_percentile(&batch.latency, 0.5), &ns_adjust),
+	       tsc_cycles_to_ns(log2_hist_percentile(&batch.latency, 0.99), &ns_adjust), batch.latency.samples,
+	       memcmp(&batch.latency, &capture->duration, sizeof(batch.latency)) == 0 ? ", same as the intervals"
+										    : "  MISMATCH");
+	printf("  batch: %lu times converted with %s, %lu differ from tsc_cycles_to_ns\n", batch.converted,
+	       tsc_batch_kernel_name(tsc_batch_best()), batch.mismatches);
+	free(batch.counts);
+}
+
+static void trace_stats_span(const struct pstamp_span *span, void *arg)
+{
+	pstamp_stats_add(arg, span->entries, span->count);
+}
+
+/* per point and per pair statistics of the capture, read back through a snapshot */
+static void trace_stats(const struct trace_capture *capture)
+{
+	pstamp_stats_t stats, snapshot;
+	unsigned long hops = 0;
+	int err;
+
+	err = pstamp_stats_init(&stats, pstamp_point_count(), 16, 64);
+	err_exit_negative(err, "Error allocating pstamp stats", 1);
+	err = pstamp_stats_init_snapshot(&snapshot, &stats);
+	err_exit_negative(err, "Error allocating pstamp stats snapshot", 1);
+	for (unsigned int l = 0; l < TRACE_LOGS; l++)
+		pstamp_log_enumerate_spans(capture->first[l], trace_stats_span, &stats);
+	pstamp_stats_read(&stats, &snapshot);
+	for (unsigned int i = 0; i < snapshot.pair_capacity; i++)
+		if (snapshot.pair[i].from != INT_MIN)
+			hops += running_stats_samples(&snapshot.pair[i].latency);
+	printf("\nStatistics of the requests\n");
+	pstamp_stats_report(&snapshot, stdout, &ns_adjust);
+	printf("  %lu done, %lu hops%s\n", snapshot.point[capture->done].entries, hops,
+	       snapshot.point[capture->done].entries == TRACE_REQUESTS &&
+	       hops == TRACE_REQUESTS * (TRACE_REQUEST_ENTRIES - 1) ? "" : "  MISMATCH");
+	pstamp_stats_destroy(&snapshot);
+	pstamp_stats_destroy(&stats);
+}
+
+/* the cause DAG of the capture, from its logs merged into time order */
+static void trace_cause(const struct trace_capture *capture)
+{
+	pstamp_merge_t *merge = malloc(pstamp_merge_size(TRACE_LOGS));
+	pstamp_cause_t cause;
+	pstamp_log_t *entry;
+	unsigned long entries = 0, disorder = 0, last = 0;
+	int err;
+
+	null_exit(merge, "Error allocating pstamp merge", 1);
+	err = pstamp_cause_init(&cause);
+	err_exit_negative(err, "Error allocating pstamp cause", 1);
+	pstamp_merge_init(merge, TRACE_LOGS);
+	for (unsigned int l = 0; l < TRACE_LOGS; l++)
+		pstamp_merge_add_ring(merge, capture->first[l]);
+	while ((entry = pstamp_merge_next(merge)) != NULL) {
+		disorder += entry->pstamp.time < last;
+		last = entry->pstamp.time;
+		entries += 1;
+		err = pstamp_cause_add(&cause, entry);
+		err_exit_negative(err, "Error adding to pstamp cause", 1);
+	}
+	pstamp_cause_finish(&cause);
+	printf("\nCause DAG of the requests\n");
+	pstamp_cause_report(&cause, stdout, &ns_adjust);
+	printf("  %lu entries merged, %lu out of order, %lu chains%s\n", entries, disorder, cause.chain_count,
+	       entries == capture->entries && disorder == 0 && cause.chain_count == TRACE_REQUESTS ? "" : "  MISMATCH");
+	pstamp_cause_destroy(&cause);
+	free(merge);
+}
+
+/*
+ * the requests into a compact ring, whose entries don't keep their cause's point: the
+ * cause DAG of the decoded entries finds each cause's point from its logged entry
+ */
+#define TRACE_COMPACT_REQUESTS 1000
+
+static void trace_compact(const struct trace_capture *capture)
+{
+	static const pstamp_t none;
+	const unsigned int size = TRACE_COMPACT_REQUESTS * TRACE_REQUEST_ENTRIES;
+	pstamp_cring_t *pstamp_cring, *current;
+	pstamp_cause_t cause;
+	pstamp_log_t entry;
+	unsigned long unknown = 0;
+	int err;
+
+	err = posix_memalign((void **)&pstamp_cring, 64, pstamp_cring_size(size));
+	err_exit_nonzero(err, "Error allocating pstamp compact ring", 1);
+	pstamp_cring_init(pstamp_cring, size);
+	current = pstamp_cring;
+	for (unsigned long r = 0; r < TRACE_COMPACT_REQUESTS; r++) {
+		pstamp_t request;
+		current = pstamp_clog(current, capture->request, &none);
+		pstamp_clog_decode(current, current->ring + current->next - 1, &entry);
+		request = entry.pstamp;
+		trace_work(50);
+		current = pstamp_clog(current, capture->parse, &request);
+		trace_work(50);
+		current = pstamp_clog(current, capture->reply, &request);
+		current = pstamp_clog(current, capture->done, &request);
+	}
+
+	err = pstamp_cause_init(&cause);
+	err_exit_negative(err, "Error allocating pstamp cause", 1);
+	for (unsigned int i = 0; i < pstamp_cring_count(pstamp_cring); i++) {
+		pstamp_clog_decode(pstamp_cring, pstamp_cring->ring + _wrap(pstamp_cring_first(pstamp_cring) + i, size),
+				   &entry);
+		err = pstamp_cause_add(&cause, &entry);
+		err_exit_negative(err, "Error adding to pstamp cause", 1);
+	}
+	pstamp_cause_finish(&cause);
+	for (unsigned long c = 0; c < cause.chain_count; c++)
+		unknown += cause.chains[c].cause.point == -1;
+	printf("\nCause DAG of %u requests in a compact ring\n", TRACE_COMPACT_REQUESTS);
+	printf("  %lu entries, %lu chains, %lu roots, %lu hop pairs, %lu causes of unknown point%s\n", cause.event_count,
+	       cause.chain_count, cause.root_count, cause.hop_count, unknown,
+	       cause.event_count == size && cause.chain_count == TRACE_COMPACT_REQUESTS &&
+	       cause.root_count == TRACE_COMPACT_REQUESTS && cause.hop_count == 3 && unknown == 0 ? "" : "  MISMATCH");
+	pstamp_cause_destroy(&cause);
+	free(pstamp_cring);
+}
+
+/* export the capture as Chrome Trace Event JSON, to a file that is removed after */
+static void trace_json(const struct trace_capture *capture)
+{
+	char path[PATH_MAX];
+	pstamp_merge_t *merge = malloc(pstamp_merge_size(TRACE_LOGS));
+	/* every entry but the request's own has a cause */
+	const unsigned long caused = TRACE_REQUESTS * (TRACE_REQUEST_ENTRIES - 1);
+	unsigned long slices = 0, starts = 0, finishes = 0;
+	char *line = NULL;
+	size_t length = 0;
+	long bytes;
+	FILE *out;
+	int err, fd;
+
+	null_exit(merge, "Error allocating pstamp merge", 1);
+	fd = trace_tmpfile(path, sizeof(path));
+	err_exit_negative(fd, "Error creating json file", 1);
+	unlink(path);
+	out = fdopen(fd, "w+");
+	null_exit(out, "Error opening json file", 1);
+	pstamp_merge_init(merge, TRACE_LOGS);
+	for (unsigned int l = 0; l < TRACE_LOGS; l++)
+		pstamp_merge_add_ring(merge, capture->first[l]);
+	err = pstamp_json_export(out, merge, &ns_adjust);
+	bytes = ftell(out);
+
+	/* read it back, an event to a line: a slice per entry, a flow start and finish per cause */
+	rewind(out);
+	while (getline(&line, &length, out) != -1) {
+		slices += strstr(line, "\"ph\":\"X\"") != NULL;
+		starts += strstr(line, "\"ph\":\"s\"") != NULL;
+		finishes += strstr(line, "\"ph\":\"f\"") != NULL;
+	}
+	printf("\nJSON export of the requests: %ld bytes%s\n", bytes, err == 0 ? "" : ", output error");
+	printf("  %lu slices, %lu flow starts, %lu flow finishes%s\n", slices, starts, finishes,
+	       err == 0 && slices == capture->entries && starts == caused && finishes == caused ? "" : "  MISMATCH");
+	free(line);
+	fclose(out);
+	free(merge);
+}
+
+/* write the capture as a trace file, then map it and read it back */
+static void trace_file(const struct trace_capture *capture)
+{
+	char path[PATH_MAX];
+	pstamp_file_t file;
+	const char *name;
+	unsigned long entries = 0;
+	int err, fd;
+
+	fd = trace_tmpfile(path, sizeof(path));
+	err_exit_negative(fd, "Error creating trace file", 1);
+	err = pstamp_file_write(fd, capture->first, TRACE_LOGS, &ns_adjust, NULL, 0);
+	err_exit_negative(err, "Error writing trace file", 1);
+	close(fd);
+	err = pstamp_file_open(&file, path);
+	err_exit_negative(err, "Error opening trace file", 1);
+	unlink(path);
+	for (unsigned int i = 0; i < pstamp_file_segment_count(&file); i++)
+		entries += file.segments[i].count;
+	name = pstamp_file_point_name(&file, capture->done);
+	printf("\nTrace file of the requests: %zu bytes, %u segments, %lu entries, point %d named \"%s\"%s\n",
+	       file.length, pstamp_file_segment_count(&file), entries, capture->done, name != NULL ? name : "",
+	       entries == capture->entries && name != NULL && strcmp(name, "request done") == 0 ? "" : "  MISMATCH");
+	pstamp_file_close(&file);
+}
+
+/* the capture's times as CLOCK_MONOTONIC, by the anchors sampled around it */
+struct trace_anchors {
+	const tsc_anchors_t *anchors;
+	long ns[TRACE_RING];
+	long first, last;
+	unsigned long mismatches;
+};
+
+static void trace_anchors_span(const struct pstamp_span *span, void *arg)
+{
+	struct trace_anchors *clock = arg;
+
+	tsc_anchor_convert(clock->anchors, CLOCK_MONOTONIC, &span->entries->pstamp.time,
+			   sizeof(pstamp_log_t) / sizeof(unsigned long), clock->ns, span->count);
+	for (unsigned int i = 0; i < span->count; i++) {
+		clock->mismatches += clock->ns[i] != tsc_anchor_mono(clock->anchors, span->entries[i].pstamp.time);
+		if (clock->ns[i] < clock->first)
+			clock->first = clock->ns[i];
+		if (clock->ns[i] > clock->last)
+			clock->last = clock->ns[i];
+	}
+}
+
+static void trace_anchors(const struct trace_capture *capture)
+{
+	const tsc_anchors_t *anchors = capture->anchors;
+	const struct tsc_anchor *before = anchors->anchor, *after = anchors->anchor + anchors->count - 1;
+	struct trace_anchors clock = {.anchors = anchors, .first = LONG_MAX, .last = LONG_MIN};
+	/* an anchor's clock read is somewhere within its bracketing cycles */
+	long slack = tsc_cycles_to_ns(before->width + after->width, &ns_adjust);
+
+	for (unsigned int l = 0; l < TRACE_LOGS; l++)
+		pstamp_log_enumerate_spans(capture->first[l], trace_anchors_span, &clock);
+	printf("\nCLOCK_MONOTONIC of the requests, from %u anchors\n", anchors->count);
+	printf("  first entry %ld nsec after the first anchor, last %ld nsec before the last%s\n",
+	       clock.first - before->mono, after->mono - clock.last,
+	       clock.first >= before->mono - slack && clock.last <= after->mono + slack ? "" : "  OUTSIDE");
+	printf("  %lu converted times differ from tsc_anchor_mono\n", clock.mismatches);
+}
+
+/*
+ * the same requests into a flight recorder, one of them slow: the recorder fires on its
+ * parse to reply hop, stops the log at the end of the window and dumps it
+ */
+#define TRACE_FLIGHT_REQUESTS 10000
+#define TRACE_FLIGHT_SLOW_NS 1000000UL		/* 1 msec, the trigger threshold */
+#define TRACE_FLIGHT_WINDOW_NS 10000UL		/* 10 usec, well within a ring of requests */
+
+struct trace_flight {
+	unsigned long entries;
+	unsigned long completes;		/* dump callbacks with span NULL */
+	bool trigger;				/* the trigger entry was dumped */
+};
+
+static void trace_flight_dump(pstamp_flight_t *flight, unsigned int log, const struct pstamp_span *span, void *arg)
+{
+	struct trace_flight *dumped = arg;
+
+	(void)log;
+	if (span == NULL) {
+		dumped->completes += 1;
+		return;
+	}
+	dumped->entries += span->count;
+	for (unsigned int i = 0; i < span->count; i++)
+		dumped->trigger = dumped->trigger || span->entries[i].pstamp.time == flight->trigger.pstamp.time;
+}
+
+static void trace_flight(const struct trace_capture *capture)
+{
+	struct timespec poll = {.tv_nsec = TRACE_POLL_NS};
+	double cycles_per_ns = ldexp(1.0, ns_adjust.time_shift) / ns_adjust.time_mult;
+	unsigned long threshold = TRACE_FLIGHT_SLOW_NS * cycles_per_ns;
+	struct trace_flight dumped = {0};
+	struct pstamp_flight_log *log;
+	pstamp_flight_t *flight;
+	pstamp_ring_t *pstamp_ring;
+	int err;
+
+	err = posix_memalign((void **)&flight, 64, pstamp_flight_size(1));
+	err_exit_nonzero(err, "Error allocating flight recorder", 1);
+	err = posix_memalign((void **)&pstamp_ring, 64, pstamp_ring_size(TRACE_RING));
+	err_exit_nonzero(err, "Error allocating pstamp ring", 1);
+	pstamp_ring_init(pstamp_ring, TRACE_RING);
+	pstamp_flight_init(flight, 1, capture->parse, capture->reply, threshold, TRACE_FLIGHT_WINDOW_NS * cycles_per_ns,
+			   PSTAMP_FLIGHT_STOP, NULL, trace_flight_dump, &dumped, TRACE_POLL_NS);
+	flight->rearm = false;
+	log = pstamp_flight_add(flight, pstamp_ring);
+	err = pstamp_flight_start(flight, NULL);
+	err_exit_nonzero(err, "Error starting flight recorder", 1);
+
+	for (unsigned long r = 0; r < TRACE_FLIGHT_REQUESTS; r++) {
+		pstamp_t request, parse;
+		unsigned long start;
+		pstamp(capture->request, &request);
+		trace_work(50);
+		pstamp(capture->parse, &parse);
+		pstamp_flight_log(flight, log, capture->parse, &request);
+		start = tsc_cycles();
+		if (r == TRACE_FLIGHT_REQUESTS / 2)
+			while (tsc_cycles() - start < 2 * threshold)
+				;
+		trace_work(50);
+		pstamp_flight_log(flight, log, capture->reply, &parse);
+		pstamp_flight_log(flight, log, capture->done, &request);
+	}
+	/* the window is long over, give the dump thread a second */
+	for (int i = 0; i < 10000 && __atomic_load_n(&flight->dumps, __ATOMIC_ACQUIRE) == 0; i++)
+		nanosleep(&poll, NULL);
+	err = pstamp_flight_stop(flight);
+	err_exit_nonzero(err, "Error stopping flight recorder", 1);
+
+	printf("\nFlight recorder over %u requests, one taking over %lu nsec\n", TRACE_FLIGHT_REQUESTS,
+	       2 * TRACE_FLIGHT_SLOW_NS);
+	printf("  %lu trigger%s, %lu dump%s of %lu entries, %s the trigger%s\n", flight->triggers,
+	       flight->triggers == 1 ? "" : "s", flight->dumps, flight->dumps == 1 ? "" : "s", dumped.entries,
+	       dumped.trigger ? "with" : "without",
+	       flight->dumps == 1 && dumped.completes == 1 && dumped.trigger ? "" : "  MISMATCH");
+	free(pstamp_ring);
+	free(flight);
+}
+
+static void trace_bench(int point, unsigned long overhead)
+{
+	struct trace_capture capture;
+
+	trace_stream(point, overhead);
+	trace_capture(&capture, overhead);
+	trace_shm(&capture);
+	trace_batch(&capture);
+	trace_stats(&capture);
+	trace_cause(&capture);
+	trace_compact(&capture);
+	trace_json(&capture);
+	trace_file(&capture);
+	trace_anchors(&capture);
+	trace_flight(&capture);
+	pstamp_shm_destroy(&capture.shm);
+	free(capture.anchors);
+}
+
 int main(_unused_ int argc, _unused_ char *argv[])
 {
 	struct timespec start, end;
@@ -191,6 +1629,7 @@ int main(_unused_ int argc, _unused_ char *argv[])
 	unsigned long begin, fini, elapsed_cycles;
 	unsigned long overhead;
 	struct running_stats stats;
+	struct tsc_calibration calibration;
 	double std;
 	unsigned long nsec_variance;
 	unsigned long buffer[32] = {0};
@@ -198,7 +1637,8 @@ int main(_unused_ int argc, _unused_ char *argv[])
 	char *cpu_num;
 	char *cpu_list;
 	char *cpu_alt;
-	cpu_set_t cpuset, cpu_as_set, alt_as_set;
+	char *mode = "all";
+	cpu_set_t cpuset, cpu_as_set, alt_as_set, skew_set;
 	size_t cpusetsize = 0;
 	unsigned int test_cpu;
 	char curcpu[8];
@@ -208,6 +1648,17 @@ int main(_unused_ int argc, _unused_ char *argv[])
 	int result;
 	pstamp_t cause_pstamp;
 	pstamp_ring_t *pstamp_ring;
+	pstamp_cring_t *pstamp_cring;
+	pstamp_arg_ring_t *pstamp_arg_ring;
+	pstamp_arg2_ring_t *pstamp_arg2_ring;
+	int stamp_point, log_point;
+
+	/* the TSC reads built in must run here, or logging would trap */
+	if (!pstamp_tsc_strategy_supported() || !tsc_strategy_supported(BENCH_TSC_STRATEGY)) {
+		fprintf(stderr, "Error: this CPU can't read the TSC as built, with %s for pstamps and %s for timing\n",
+			tsc_strategy_name(PSTAMP_TSC_STRATEGY), tsc_strategy_name(BENCH_TSC_STRATEGY));
+		return 1;
+	}
 
 	/* setup defaults */
 	cpusetsize = (get_nprocs_conf() + 7) >> 3;
@@ -218,7 +1669,7 @@ int main(_unused_ int argc, _unused_ char *argv[])
 	cpu_list = cpu_num = cpu_alt = curcpu;
 
 	/*  parse arguments */
-	while ((opt = getopt(argc, argv, "c:s:a:")) != -1) {
+	while ((opt = getopt(argc, argv, "c:s:a:m:")) != -1) {
 		switch (opt) {
 		case 's':
 			cpu_list = optarg;
@@ -229,11 +1680,19 @@ int main(_unused_ int argc, _unused_ char *argv[])
 		case 'a':
 			cpu_alt = optarg;
 			break;
+		case 'm':
+			mode = optarg;
+			break;
 		default:
-			fprintf(stderr, "Usage: %s [-c <cpu>] [-a <altcpu>] [-s <cpu-list>]\n", argv[0]);
+			fprintf(stderr, "Usage: %s [-c <cpu>] [-a <altcpu>] [-s <cpu-list>] [-m all|pstamp|tsc|skew|trace]\n", argv[0]);
 			return 0;
 		}
 	}
+	if (strcmp(mode, "all") != 0 && strcmp(mode, "pstamp") != 0 && strcmp(mode, "tsc") != 0 &&
+	    strcmp(mode, "skew") != 0 && strcmp(mode, "trace") != 0) {
+		fprintf(stderr, "Unknown mode %s, modes are all, pstamp, tsc, skew and trace\n", mode);
+		return 1;
+	}
 
 	/* initially set the usable cpuset and cpus to test for testing */
 	err = parse_cpu_list(cpu_list, &cpuset, cpusetsize);
@@ -249,7 +1708,7 @@ int main(_unused_ int argc, _unused_ char *argv[])
 	err = sched_setaffinity(0, cpusetsize, &cpuset);
 	err_exit_negative(err, "Error setting sched affinity", 1);
 
-	/* create alternate thread and common memory for tests involving thread communication */
+	/* common memory for tests involving thread communication */
 	shared = malloc(sizeof(struct thread_shared_data));
 	null_exit(shared, "Allocation failed", 1);
 	memset(shared, '\0', sizeof(struct thread_shared_data));
@@ -262,27 +1721,24 @@ int main(_unused_ int argc, _unused_ char *argv[])
 
 	barrier_init(&shared->spin_barrier, 2);
 
-	err = pthread_attr_init(&alt_thread_attr);
-	err_exit_nonzero(err, "Error creating alternate thread attr", 1);
-	err = pthread_attr_setaffinity_np(&alt_thread_attr, cpusetsize, &alt_as_set);
-	err_exit_nonzero(err, "Error creating alternate thread's affinity", 1);
-	err = pthread_create(&alt_thread, &alt_thread_attr, alt_thread_main, (void *)shared);
-	err_exit_nonzero(err, "Error creating alternate thread", 1);
-	err = pthread_attr_destroy(&alt_thread_attr);
-	err_exit_nonzero(err, "Error destroying alternate thread attr", 1);
-	
 	/* further restrict this primary thread to running on a specific cpu in the cpuset */
 	err = sched_setaffinity(0, cpusetsize, &cpu_as_set);
 	err_exit_negative(err, "Error setting primary affinity", 1);
 
 	/* Get TSC cycle frequency conversion constants */
-	err = get_tsc_ns_adjust(&ns_adjust);
-	err_exit_negative(err, "Error getting tsc ns adjust\n", 0);
+	err = tsc_calibrate(&ns_adjust, &calibration);
+	err_exit_negative(err, "Error calibrating the TSC frequency\n", 0);
+	if (calibration.source == TSC_CALIBRATION_CLOCK)
+		printf("TSC %.6f GHz from %s, +/- %.2g ppm (%u windows, %u rejected)\n", calibration.hz / 1e9,
+		       tsc_calibration_source_name(calibration.source), calibration.error_ppm, calibration.windows,
+		       calibration.rejected);
+	else
+		printf("TSC %.6f GHz from %s\n", calibration.hz / 1e9, tsc_calibration_source_name(calibration.source));
 
 	printf("Calibrating speed of interval timers:\n"
 	       "  POSIX clock_gettime(CLOCK_REALTIME) and\n"
-	       "  inline tsc_cycles() which uses RDTSCP instruction\n"
-	       "\n");
+	       "  inline bench_cycles() which uses %s\n"
+	       "\n", tsc_strategy_name(BENCH_TSC_STRATEGY));
 
 	err = clock_gettime(CLOCK_REALTIME, &start);
 	err = clock_gettime(CLOCK_REALTIME, &end);
@@ -290,28 +1746,63 @@ int main(_unused_ int argc, _unused_ char *argv[])
 
 	printf("clock_gettime(CLOCK_REALTIME) takes %ld nsec\n", elapsed_nsec);
 	
-	begin = tsc_cycles();
-	fini = tsc_cycles();
+	begin = bench_cycles();
+	fini = bench_cycles();
 	elapsed_cycles = fini - begin;
 
-	printf("tsc_cycles() takes (%lu cycles) %ld nsec\n", elapsed_cycles,
+	printf("bench_cycles() takes (%lu cycles) %ld nsec\n", elapsed_cycles,
 	       tsc_cycles_to_ns(elapsed_cycles, &ns_adjust));
 
 	running_stats_init(&stats);
 	for (int i = 0; i < 100; i++) {
-		begin = tsc_cycles();
-		fini = tsc_cycles();
+		begin = bench_cycles();
+		fini = bench_cycles();
 		running_stats_sample(&stats, fini - begin);
 	}
 	
 	overhead = running_stats_mean(&stats);
-	printf("Mean overhead using tsc_cycles() to measure interval is (%lu cycles) %lu nsec\n",
+	printf("Mean overhead using bench_cycles() to measure interval is (%lu cycles) %lu nsec\n",
 	       overhead, tsc_cycles_to_ns((unsigned long)overhead, &ns_adjust));
 	std = sqrt(running_stats_sample_variance(&stats));
 	nsec_variance = tsc_cycles_to_ns((unsigned long)std, &ns_adjust);
 	printf("  [Standard deviation of estimated overhead is (%.2g cycles) %lu nsec]\n",
 	       std, nsec_variance);
 
+	/* benchmark modes run on their own, without the alternate thread */
+	if (strcmp(mode, "pstamp") == 0) {
+		printf("\n");
+		pstamp_bench(PSTAMP_POINT("pstamp_bench"), overhead, &alt_as_set, cpusetsize, shared->same_core);
+		return 0;
+	}
+	if (strcmp(mode, "tsc") == 0) {
+		printf("\n");
+		tsc_bench();
+		tsc_batch_bench();
+		return 0;
+	}
+	if (strcmp(mode, "skew") == 0) {
+		printf("\n");
+		err = parse_cpu_list(cpu_list, &skew_set, cpusetsize);
+		err_exit_negative(err, "Error parsing cpu list", 0);
+		skew_bench(&skew_set, cpusetsize);
+		return 0;
+	}
+	if (strcmp(mode, "trace") == 0) {
+		printf("\n");
+		trace_bench(PSTAMP_POINT("trace_bench"), overhead);
+		return 0;
+	}
+
+	/* alternate thread for tests involving thread communication, it waits at the first barrier */
+	err = pthread_attr_init(&alt_thread_attr);
+	err_exit_nonzero(err, "Error creating alternate thread attr", 1);
+	err = pthread_attr_setaffinity_np(&alt_thread_attr, cpusetsize, &alt_as_set);
+	err_exit_nonzero(err, "Error creating alternate thread's affinity", 1);
+	err = pthread_create(&alt_thread, &alt_thread_attr, alt_thread_main, (void *)shared);
+	err_exit_nonzero(err, "Error creating alternate thread", 1);
+	err = pthread_attr_destroy(&alt_thread_attr);
+	err_exit_nonzero(err, "Error destroying alternate thread attr", 1);
+
 	printf("\n"
 	       "Timing sequences of individual instructions repeated 20 times\n"
 	       "\n");
@@ -383,16 +1874,42 @@ int main(_unused_ int argc, _unused_ char *argv[])
 	TIME_CODE(err = sched_setaffinity(0, cpusetsize, &cpu_as_set););
 
 	printf("Time pstamp operations\n");
+	/* declared once, each use of PSTAMP_POINT is a distinct point */
+	stamp_point = PSTAMP_POINT("clock_speed pstamp");
+	log_point = PSTAMP_POINT("clock_speed pstamp_log");
 	/* time simple pstamp logging */
 	pstamp_ring = (pstamp_ring_t *)malloc(pstamp_ring_size(1024));
 	null_exit(pstamp_ring, "Error allocating pstamp ring", 1);
 	pstamp_ring_init(pstamp_ring, 1024);
 
-	TIME_CODE_20(pstamp(0, &cause_pstamp););
-	TIME_CODE_20(pstamp_log(pstamp_ring, 1, &cause_pstamp););
+	TIME_CODE_20(pstamp(stamp_point, &cause_pstamp););
+	TIME_CODE_20(pstamp_log(pstamp_ring, log_point, &cause_pstamp););
 	
 	free(pstamp_ring);
 
+	/* time compact pstamp logging, 16 byte entries in a cache line aligned ring */
+	result = posix_memalign((void **)&pstamp_cring, 64, pstamp_cring_size(1024));
+	err_exit_nonzero(result, "Error allocating compact pstamp ring", 1);
+	pstamp_cring_init(pstamp_cring, 1024);
+
+	TIME_CODE_20(pstamp_clog(pstamp_cring, log_point, &cause_pstamp););
+
+	free(pstamp_cring);
+
+	/* time logging with one and two arguments, compare with pstamp_log */
+	pstamp_arg_ring = (pstamp_arg_ring_t *)malloc(pstamp_arg_ring_size(1024));
+	null_exit(pstamp_arg_ring, "Error allocating pstamp arg ring", 1);
+	pstamp_arg_ring_init(pstamp_arg_ring, 1024);
+	pstamp_arg2_ring = (pstamp_arg2_ring_t *)malloc(pstamp_arg2_ring_size(1024));
+	null_exit(pstamp_arg2_ring, "Error allocating pstamp arg2 ring", 1);
+	pstamp_arg2_ring_init(pstamp_arg2_ring, 1024);
+
+	TIME_CODE_20(pstamp_arg_log(pstamp_arg_ring, log_point, &cause_pstamp, cause_pstamp.time););
+	TIME_CODE_20(pstamp_arg2_log(pstamp_arg2_ring, log_point, &cause_pstamp, cause_pstamp.time, test_cpu););
+
+	free(pstamp_arg_ring);
+	free(pstamp_arg2_ring);
+
 	/*
 	 * Multi-thread shared data tests, use sync_barrier to coordinate with other thread.
 	 * that is, each test is separated by sync_barrier() waiting for both sides of the test